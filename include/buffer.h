@@ -11,8 +11,9 @@
 #include <pcre.h>
 
 #include "value.h"
+#include "tls.h"
 
-jmp_buf buffer_err_jb;
+extern TLS jmp_buf buffer_err_jb;
 
 struct buffer {
 
@@ -29,6 +30,10 @@ struct buffer {
         unsigned id;
         pid_t pid;
 
+#ifdef PLUM_THREADED_BUFFERS
+        pthread_t thread;
+#endif
+
         int write_fd;
         int read_fd;
 
@@ -44,6 +49,12 @@ struct buffer {
 struct buffer
 buffer_new(unsigned id);
 
+/*
+ * Called by the editor once the buffer has stopped, to give back what it shared with it.
+ */
+void
+buffer_free(struct buffer *b);
+
 /*
  * These functions are called within the child process and should never be called by the parent.
  */
@@ -234,10 +245,10 @@ void
 buffer_show_console(void);
 
 int
-buffer_horizontal_split(int, int);
+buffer_horizontal_split(int, int, struct value);
 
 int
-buffer_vertical_split(int, int);
+buffer_vertical_split(int, int, struct value);
 
 struct value
 buffer_window_height(void);
@@ -261,7 +272,7 @@ int
 buffer_id(void);
 
 int
-buffer_create(char const *prog, int n);
+buffer_create(char const *prog, int n, struct value callback);
 
 void
 buffer_cycle_window_color(void);
@@ -7,6 +7,9 @@ compiler_error(void);
 void
 compiler_init(void);
 
+void
+compiler_destroy(void);
+
 void
 compiler_introduce_symbol(char const *, char const *);
 
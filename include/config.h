@@ -4,4 +4,25 @@
 #define KEY_CHORD_TIMEOUT_MS   300
 #define STATUS_MESSAGE_TIMEOUT 300
 
+/* buffers which have been in the background for this long are hibernated */
+#define BUFFER_HIBERNATE_MS    (5 * 60 * 1000)
+
+/* how long the editor waits for a buffer thread to clean up after itself when it's destroyed */
+#define BUFFER_SHUTDOWN_MS     500
+
+#define EDITOR_MAX_EVENTS      64
+#define BUFFER_MAX_EVENTS      16
+
+/* the longest the GC should ever stop a buffer for while it's marking incrementally */
+#define GC_MAX_PAUSE_US        2000
+
+/* the most helper threads the GC will mark a big heap with (0 to always mark on one thread) */
+#define GC_MARK_THREADS        3
+
+/* total number of local variable slots available to all active function calls (only reserved up front) */
+#define VM_MAX_LOCALS          (1UL << 28)
+
+/* how many more local variable slots are committed at a time as calls get deeper */
+#define VM_LOCALS_CHUNK        (1 << 16)
+
 #endif
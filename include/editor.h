@@ -4,8 +4,6 @@
 #include <stdint.h>
 #include <stdbool.h>
 
-#include <poll.h>
-
 #include "vec.h"
 #include "buffer.h"
 #include "window.h"
@@ -19,7 +17,14 @@ struct editor {
         struct window *root_window;
         struct window *current_window;
 
-        vec(struct pollfd) pollfds;
+        int epfd;
+
+#ifdef PLUM_THREADED_BUFFERS
+        /*
+         * Destroyed buffers whose threads hadn't stopped in time (see reap()).
+         */
+        vec(struct buffer *) zombies;
+#endif
 
         bool render;
         bool background;
@@ -36,6 +36,15 @@ builtin_getenv(value_vector *args);
 struct value
 builtin_json_parse(value_vector *args);
 
+struct value
+builtin_gc_set_max_pause(value_vector *args);
+
+struct value
+builtin_gc_pauses(value_vector *args);
+
+struct value
+builtin_gc_stats(value_vector *args);
+
 struct value
 builtin_editor_insert(value_vector *args);
 
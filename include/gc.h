@@ -1,18 +1,131 @@
 #ifndef GC_H_INCLUDED
 #define GC_H_INCLUDED
 
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "tls.h"
+
+struct value;
+
 enum {
-        GC_NONE,
-        GC_MARK,
-        GC_HARD,
+        GC_NONE       = 0,
+        GC_MARK       = 1,
+        GC_HARD       = 2,
+        GC_OLD        = 4,
+        GC_REMEMBERED = 8,
+        GC_SLICE      = 16, // a string inside another one (see value_slab_string())
+
+        /*
+         * Interned strings and the constants in compiled code aren't on any chain, so they're
+         * never swept; they look like old objects which have already been marked.
+         */
+        GC_STATIC     = GC_MARK | GC_OLD,
 };
 
-extern int gc_prevent;
+/*
+ * Sizes are in bytes and times in microseconds. 'unswept' is the number of old objects still
+ * waiting to be swept after the last major collection.
+ */
+struct gc_stats {
+        unsigned minor;
+        unsigned major;
+        unsigned parallel;
+        long long pause_total;
+        long long pause_max;
+        size_t live;
+        size_t promoted;
+        size_t nursery;
+        size_t allocated;
+        double allocation_rate;
+        bool marking;
+        size_t unswept;
+};
+
+extern TLS int gc_prevent;
+
+/*
+ * Marking stops at an object with any of these bits set: GC_MARK, and during a minor
+ * collection GC_OLD as well.
+ */
+extern TLS unsigned char gc_skip;
+
+/*
+ * Set while a slice of incremental marking is running, in which case value_mark() only marks
+ * old objects.
+ */
+extern TLS bool gc_incremental;
+
+/*
+ * Set while helper threads are marking alongside the buffer, in which case mark bits have to be
+ * read and set atomically.
+ */
+extern bool gc_parallel;
+
+inline static unsigned char
+gc_peek(unsigned char const *mark)
+{
+        return gc_parallel ? __atomic_load_n(mark, __ATOMIC_RELAXED) : *mark;
+}
+
+/*
+ * Set GC_MARK in *mark, and say whether it wasn't already set.
+ */
+inline static bool
+gc_set_mark(unsigned char *mark)
+{
+        if (gc_parallel) {
+                return !(__atomic_fetch_or(mark, GC_MARK, __ATOMIC_RELAXED) & GC_MARK);
+        }
+
+        bool white = !(*mark & GC_MARK);
+        *mark |= GC_MARK;
+        return white;
+}
 
 void *
 gc_alloc(size_t n);
 
+void *
+gc_new(size_t n);
+
+void
+gc_account(size_t n);
+
+void
+gc_free(void *p);
+
+size_t
+gc_size(void const *p);
+
+void
+gc_remember(struct value v);
+
+void
+gc_gray(struct value v);
+
+void
+gc_collect(void);
+
+bool
+gc_pending(void);
+
+void
+gc_idle(void);
+
+void
+gc_set_max_pause(long us);
+
+unsigned const *
+gc_pauses(int *n);
+
+struct gc_stats
+gc_stats(void);
+
 void
 gc_reset(void);
 
+void
+gc_destroy(void);
+
 #endif
@@ -3,7 +3,43 @@
 
 #include "value.h"
 
-struct object;
+struct shape;
+struct object_entry;
+
+/*
+ * An object whose keys are all strings shares a shape (hidden class) with every other object
+ * that had the same keys added in the same order, and keeps its values in 'slots' in that
+ * order. Once it gets a non-string key or too many members, it switches for good to an array
+ * of entries in insertion order, which gets an open-addressed 'index' once it has more than a
+ * handful of them.
+ */
+struct object {
+        struct shape *shape;
+        union {
+                struct value *slots;
+                struct object_entry *entries;
+        };
+        int *index;
+        int capacity;
+        int count;
+
+        unsigned char mark;
+        struct object *next;
+};
+
+/*
+ * The inline cache kept in the code by INSTR_MEMBER_ACCESS, INSTR_TARGET_MEMBER and
+ * INSTR_CALL_METHOD. 'name' is the interned member name, which is 'length' bytes long. An
+ * object of shape 'shape' has the member in slots[index]; if 'next' isn't NULL, the member
+ * doesn't exist yet and adding it takes the object to shape 'next'.
+ */
+struct member_cache {
+        struct shape *shape;
+        struct shape *next;
+        char const *name;
+        int index;
+        int length;
+};
 
 struct object *
 object_new(void);
@@ -29,6 +65,12 @@ object_put_key_if_not_exists(struct object *obj, struct value key);
 struct value *
 object_put_member_if_not_exists(struct object *obj, char const *member);
 
+struct value *
+object_lookup_member(struct object *obj, struct member_cache *cache);
+
+struct value *
+object_add_member(struct object *obj, struct member_cache *cache);
+
 struct value
 object_keys_array(struct object *obj);
 
@@ -36,9 +78,57 @@ void
 object_mark(struct object *obj);
 
 void
-object_sweep(void);
+object_mark_fresh(void);
+
+bool
+object_has_young(struct object const *obj);
+
+size_t
+object_sweep(bool major);
+
+size_t
+object_sweep_old(int *budget);
+
+size_t
+object_unswept(void);
 
 void
 object_gc_reset(void);
 
+void
+object_gc_destroy(void);
+
+/*
+ * The write barrier (see value_array_barrier()). The functions which return a pointer to store a
+ * value through call it themselves, so the pointer is good until the next allocation.
+ */
+inline static void
+object_barrier(struct object *obj)
+{
+        if ((obj->mark & (GC_OLD | GC_REMEMBERED)) == GC_OLD) {
+                gc_remember(OBJECT(obj));
+        }
+}
+
+inline static struct value *
+object_get_member_cached(struct object *obj, struct member_cache *cache)
+{
+        if (obj->shape == cache->shape) {
+                return &obj->slots[cache->index];
+        }
+
+        return object_lookup_member(obj, cache);
+}
+
+inline static struct value *
+object_put_member_cached(struct object *obj, struct member_cache *cache)
+{
+        if (obj->shape == cache->shape && cache->next == NULL) {
+                object_barrier(obj);
+                return &obj->slots[cache->index];
+        }
+
+        return object_add_member(obj, cache);
+}
+
 #endif
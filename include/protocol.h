@@ -4,6 +4,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <sys/socket.h>
 
 #include "panic.h"
 #include "log.h"
@@ -40,6 +41,20 @@ enum {
         EVT_WINDOW_ID,
         EVT_WINDOW_DELETE,
         EVT_ERROR,
+        EVT_RESPONSE,
+        EVT_SHUTDOWN,
+};
+
+/*
+ * Message payloads bigger than MESSAGE_INLINE_MAX aren't written down the pipes. The sender
+ * puts them in a sealed memfd and only the fd (and the length) is passed along; see sendfd()
+ * and recvfd(). In place of the payload length, an EVT_MESSAGE carries MESSAGE_NIL if there
+ * is no payload, or MESSAGE_FD if the payload is in an fd.
+ */
+enum {
+        MESSAGE_INLINE_MAX = 4096,
+        MESSAGE_NIL        = -1,
+        MESSAGE_FD         = -2,
 };
 
 static inline void
@@ -82,4 +97,70 @@ Read:
         }
 }
 
+/*
+ * Send 'val' over the socket 'sock' with the file descriptor 'fd' attached.
+ */
+static inline void
+sendfd(int sock, int fd, int val)
+{
+        union {
+                char buf[CMSG_SPACE(sizeof (int))];
+                struct cmsghdr align;
+        } control;
+
+        struct iovec iov = { .iov_base = &val, .iov_len = sizeof val };
+        struct msghdr msg = {
+                .msg_iov = &iov,
+                .msg_iovlen = 1,
+                .msg_control = control.buf,
+                .msg_controllen = sizeof control.buf,
+        };
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof (int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof fd);
+
+        if (sendmsg(sock, &msg, 0) != sizeof val)
+                panic("sendmsg() failed: %s", strerror(errno));
+}
+
+/*
+ * Receive an int which was sent with sendfd(), storing it in *val, and return the
+ * attached file descriptor.
+ */
+static inline int
+recvfd(int sock, int *val)
+{
+        union {
+                char buf[CMSG_SPACE(sizeof (int))];
+                struct cmsghdr align;
+        } control;
+
+        struct iovec iov = { .iov_base = val, .iov_len = sizeof *val };
+        struct msghdr msg = {
+                .msg_iov = &iov,
+                .msg_iovlen = 1,
+                .msg_control = control.buf,
+                .msg_controllen = sizeof control.buf,
+        };
+
+Recv:
+        if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != sizeof *val) {
+                if (errno == EINTR)
+                        goto Recv;
+                panic("recvmsg() failed: %s", strerror(errno));
+        }
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS)
+                panic("recvfd(): no file descriptor was received");
+
+        int fd;
+        memcpy(&fd, CMSG_DATA(cmsg), sizeof fd);
+
+        return fd;
+}
+
 #endif
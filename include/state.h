@@ -98,6 +98,9 @@ state_push_input(struct state *s, char const *key);
 struct state
 state_new(void);
 
+void
+state_free(struct state *s);
+
 void
 state_map_normal(struct state *s, struct value_array *keys, struct value f);
 
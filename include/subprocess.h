@@ -1,15 +1,21 @@
 #ifndef SUBPROCESS_H_INCLUDED
 #define SUBPROCESS_H_INCLUDED
 
+struct sp;
+
 /* spawn a new subprocess */
-bool
+struct sp *
 sp_tryspawn(char *path, struct value_array *args, struct value on_stdout, struct value on_exit, int fds[static 2]);
 
+/* the fd for the read-end of the job's pipe */
+int
+sp_output_fd(struct sp const *job);
+
 void
-sp_on_exit(int fd);
+sp_on_exit(struct sp *job);
 
 void
-sp_on_output(int fd, char const *data, int n);
+sp_on_output(struct sp *job, char const *data, int n);
 
 /*
  * find out if 'fd' is a valid file descriptor for a currently-running
@@ -18,6 +24,10 @@ sp_on_output(int fd, char const *data, int n);
 bool
 sp_fdvalid(int fd);
 
+/* mark the output and exit handlers of every running job */
+void
+sp_mark(void);
+
 void
 sp_kill(int fd);
 
@@ -27,4 +37,8 @@ sp_close(int fd);
 void
 sp_wait(int fd);
 
+/* forget every job without calling its exit handler, closing its pipes */
+void
+sp_close_all(void);
+
 #endif
@@ -6,6 +6,9 @@
 void
 tags_init(void);
 
+void
+tags_destroy(void);
+
 int
 tags_new(char const *);
 
@@ -3,6 +3,7 @@
 
 #include <stddef.h>
 #include <stdbool.h>
+#include <stdio.h>
 
 #include <pcre.h>
 
@@ -61,6 +62,12 @@ tb_clear_right(struct tb *s);
 void
 tb_murder(struct tb *s);
 
+bool
+tb_hibernate(struct tb *s, FILE *f);
+
+bool
+tb_wake(struct tb *s, FILE *f);
+
 void
 tb_insert(struct tb *s, char const *data, int n);
 
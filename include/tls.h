@@ -0,0 +1,16 @@
+#ifndef TLS_H_INCLUDED
+#define TLS_H_INCLUDED
+
+/*
+ * Anything that belongs to a single buffer (the VM, the compiler, the GC heap, the text
+ * buffer, ...) is declared TLS. Normally each buffer is its own process and this expands
+ * to nothing, but when built with PLUM_THREADED_BUFFERS every buffer runs on a thread
+ * inside the editor process, so that state has to be thread-local.
+ */
+#ifdef PLUM_THREADED_BUFFERS
+#define TLS _Thread_local
+#else
+#define TLS
+#endif
+
+#endif
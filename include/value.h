@@ -2,22 +2,24 @@
 #define VALUE_H_INCLUDED
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <string.h>
 
 #include "vec.h"
 #include "ast.h"
-#include "object.h"
 #include "gc.h"
 #include "tags.h"
 
+struct object;
+
 #define INTEGER(k)    ((struct value){ .type = VALUE_INTEGER,          .integer          = (k), .tags = 0 })
 #define REAL(f)       ((struct value){ .type = VALUE_REAL,             .real             = (f), .tags = 0 })
 #define BOOLEAN(b)    ((struct value){ .type = VALUE_BOOLEAN,          .boolean          = (b), .tags = 0 })
 #define ARRAY(a)      ((struct value){ .type = VALUE_ARRAY,            .array            = (a), .tags = 0 })
 #define OBJECT(o)     ((struct value){ .type = VALUE_OBJECT,           .object           = (o), .tags = 0 })
 #define REGEX(r)      ((struct value){ .type = VALUE_REGEX,            .regex            = (r), .tags = 0 })
-#define FUNCTION()    ((struct value){ .type = VALUE_FUNCTION,                                  .tags = 0 })
+#define FUNCTION(f)   ((struct value){ .type = VALUE_FUNCTION,         .function         = (f), .tags = 0 })
 #define BUILTIN(f)    ((struct value){ .type = VALUE_BUILTIN_FUNCTION, .builtin_function = (f), .tags = 0 })
 #define TAG(t)        ((struct value){ .type = VALUE_TAG,              .tag              = (t), .tags = 0 })
 #define NIL           ((struct value){ .type = VALUE_NIL,                                       .tags = 0 })
@@ -37,43 +39,75 @@ struct value_array {
         struct value_array *next;
 };
 
+/*
+ * 'hash' is computed the first time it's needed (0 means not yet). Interned strings are unique
+ * per content, so two of them are equal only if they're the same string.
+ *
+ * 'used' is how many bytes of data some value has claimed. Values never change, but one which is
+ * all of a string can be extended in place into the room after it (see value_string_append()),
+ * so a string can be shared by values of different lengths; 'hash' is only for the longest.
+ *
+ * A slice (marked GC_SLICE) is a string carved out of the data of a bigger one, its slab; it
+ * isn't on any chain, and its 'next' is the slab, which is marked and freed in its place.
+ */
 struct string {
         unsigned char mark;
+        bool interned;
+        unsigned hash;
+        unsigned used;
         struct string *next;
         char data[];
 };
 
-struct reference {
-        union {
-                uintptr_t symbol;
-                uintptr_t pointer;
-        };
-        uintptr_t offset;
-};
+struct variable;
 
-struct ref_vector {
+/*
+ * A function value. The code, the frame layout and the parameters that have to be copied out
+ * of their slots (bound_symbols) all point into the compiled code; vars are the variables the
+ * closure has captured from its enclosing scopes, which the code refers to by index
+ * (INSTR_LOAD_UPVALUE / INSTR_TARGET_UPVALUE).
+ */
+struct function {
         unsigned char mark;
+        int params;
+        int slots;
+        int bound;
+        uintptr_t const *bound_symbols;
+        char *code;
+        struct function *next;
         size_t count;
-        struct ref_vector *next;
-        struct reference refs[];
+        struct variable *vars[];
+};
+
+struct regex {
+        pcre *re;
+        pcre_extra *extra;
+        char const *pattern;
+};
+
+enum {
+        VALUE_STRING           = 0,
+        VALUE_REGEX            = 1,
+        VALUE_INTEGER          = 2,
+        VALUE_REAL             = 4,
+        VALUE_BOOLEAN          = 8,
+        VALUE_NIL              = 16,
+        VALUE_ARRAY            = 32,
+        VALUE_OBJECT           = 64,
+        VALUE_FUNCTION         = 128,
+        VALUE_BUILTIN_FUNCTION = 256,
+        VALUE_TAG              = 512,
+        VALUE_TAGGED           = 1024,
 };
 
+/*
+ * 16 bytes: everything that doesn't fit in the 8-byte payload (function and regex data) lives
+ * on the heap. Strings are always the data of a struct string.
+ */
 struct value {
-        enum {
-                VALUE_STRING           = 0,
-                VALUE_REGEX            = 1,
-                VALUE_INTEGER          = 2,
-                VALUE_REAL             = 4,
-                VALUE_BOOLEAN          = 8,
-                VALUE_NIL              = 16,
-                VALUE_ARRAY            = 32,
-                VALUE_OBJECT           = 64,
-                VALUE_FUNCTION         = 128,
-                VALUE_BUILTIN_FUNCTION = 256,
-                VALUE_TAG              = 512,
-                VALUE_TAGGED           = 1024,
-        } type;
-        int tags;
+        uint16_t type;
+        uint16_t tags;
+        uint32_t bytes;
         union {
                 short tag;
                 intmax_t integer;
@@ -82,22 +116,9 @@ struct value {
                 struct value_array *array;
                 struct object *object;
                 struct value (*builtin_function)(value_vector *);
-                struct {
-                        char const *string;
-                        size_t bytes;
-                        struct string *gcstr;
-                };
-                struct {
-                        pcre *regex;
-                        pcre_extra *extra;
-                        char const *pattern;
-                };
-                struct {
-                        vec(int) param_symbols;
-                        vec(int) bound_symbols;
-                        struct ref_vector *refs;
-                        char *code;
-                };
+                char const *string;
+                struct regex const *regex;
+                struct function *function;
         };
 };
 
@@ -128,48 +149,97 @@ value_string_alloc(int n);
 struct string *
 value_clone_string(char const *s, int n);
 
+struct string *
+value_slab_string(struct string **slab, char const *s, int n, char const *t, int m);
+
+void
+value_slab_done(struct string *slab);
+
+struct string *
+value_intern_string(char const *s, int n);
+
+struct string *
+value_find_interned(char const *s, int n);
+
+char *
+value_string_append(struct value *s, int n);
+
 struct value_array *
 value_array_new(void);
 
+void
+value_array_grow(struct value_array *, size_t);
+
 struct value_array *
 value_array_clone(struct value_array const *);
 
 void
 value_array_extend(struct value_array *, struct value_array const *);
 
-struct ref_vector *
-ref_vector_new(int n);
+struct function *
+value_function_new(int n);
 
 void
 value_mark(struct value *v);
 
 void
-value_array_sweep(void);
+value_mark_children(struct value *v);
 
 void
-value_string_sweep(void);
+value_mark_fresh(void);
 
-void
-value_ref_vector_sweep(void);
+bool
+value_is_young(struct value const *v);
+
+size_t
+value_array_sweep(bool major);
+
+size_t
+value_string_sweep(bool major);
+
+size_t
+value_function_sweep(bool major);
+
+size_t
+value_array_sweep_old(int *budget);
+
+size_t
+value_string_sweep_old(int *budget);
+
+size_t
+value_function_sweep_old(int *budget);
+
+size_t
+value_unswept(void);
 
 void
 value_gc_reset(void);
 
+void
+value_gc_destroy(void);
+
+/*
+ * The write barrier, which has to be called after storing a value in an array that might be
+ * old, with nothing allocated in between (see gc.c).
+ */
+inline static void
+value_array_barrier(struct value_array *a)
+{
+        if ((a->mark & (GC_OLD | GC_REMEMBERED)) == GC_OLD) {
+                gc_remember(ARRAY(a));
+        }
+}
+
 inline static void
 value_array_push(struct value_array *a, struct value v)
 {
         if (a->count == a->capacity) {
-                a->capacity = a->capacity ? a->capacity * 2 : 4;
-                struct value *new_items = gc_alloc(a->capacity * sizeof (struct value));
-
-                if (a->items != NULL) {
-                        memcpy(new_items, a->items, a->count * sizeof (struct value));
-                }
-
-                a->items = new_items;
+                value_array_grow(a, a->capacity ? a->capacity * 2 : 4);
         }
 
         a->items[a->count++] = v;
+
+        value_array_barrier(a);
 }
 
 inline static void
@@ -179,68 +249,52 @@ value_array_reserve(struct value_array *a, int count)
                 return;
         }
 
-        if (a->capacity == 0) {
-                a->capacity = 16;
-        }
+        size_t capacity = a->capacity ? a->capacity : 16;
 
-        while (a->capacity < count) {
-                a->capacity *= 2;
+        while (capacity < count) {
+                capacity *= 2;
         }
 
-        struct value *new_items = gc_alloc(a->capacity * sizeof (struct value));
-        if (a->count != 0) {
-                memcpy(new_items, a->items, a->count * sizeof (struct value));
-        }
-        a->items = new_items;
+        value_array_grow(a, capacity);
+}
+
+inline static struct string *
+value_string_owner(char const *s)
+{
+        return (struct string *)(s - offsetof(struct string, data));
 }
 
 inline static struct value
-STRING_CLONE(char const *s, int n)
+STRING(struct string *s, int n)
 {
-        struct string *clone = value_clone_string(s, n);
         return (struct value) {
                 .type = VALUE_STRING,
                 .tags = 0,
-                .string = clone->data,
+                .string = s->data,
                 .bytes = n,
-                .gcstr = clone,
         };
 }
 
 inline static struct value
-STRING(char const *s, int n, struct string *gcstr)
+STRING_CLONE(char const *s, int n)
 {
-        return (struct value) {
-                .type = VALUE_STRING,
-                .tags = 0,
-                .string = s,
-                .bytes = n,
-                .gcstr = gcstr,
-        };
+        return STRING(value_clone_string(s, n), n);
 }
 
+/*
+ * A substring of s. Values can't point into the middle of a string (the GC finds a string's
+ * header from its data pointer), so this copies.
+ */
 inline static struct value
 STRING_VIEW(struct value s, int offset, int n)
 {
-        return (struct value) {
-                .type = VALUE_STRING,
-                .tags = 0,
-                .string = s.string + offset,
-                .bytes = n,
-                .gcstr = s.gcstr,
-        };
+        return STRING_CLONE(s.string + offset, n);
 }
 
 inline static struct value
-STRING_NOGC(char const *s, int n)
+STRING_INTERN(char const *s, int n)
 {
-        return (struct value) {
-                .type = VALUE_STRING,
-                .tags = 0,
-                .string = s,
-                .bytes = n,
-                .gcstr = NULL,
-        };
+        return STRING(value_intern_string(s, n), n);
 }
 
 inline static struct value
@@ -9,14 +9,19 @@ struct variable;
 
 enum instruction {
         INSTR_LOAD_VAR,
-        INSTR_LOAD_REF,
+        INSTR_LOAD_UPVALUE,
+        INSTR_LOAD_LOCAL,
         INSTR_PUSH_VAR,
         INSTR_POP_VAR,
         INSTR_TARGET_VAR,
-        INSTR_TARGET_REF,
+        INSTR_TARGET_UPVALUE,
+        INSTR_TARGET_LOCAL,
         INSTR_TARGET_MEMBER,
         INSTR_TARGET_SUBSCRIPT,
         INSTR_ASSIGN,
+        INSTR_ASSIGN_POP,
+        INSTR_STORE_VAR,
+        INSTR_STORE_LOCAL,
 
         INSTR_ARRAY_REST,
 
@@ -49,6 +54,8 @@ enum instruction {
         INSTR_POST_DEC,
 
         INSTR_INC,
+        INSTR_INC_LOCAL,
+        INSTR_DEC_LOCAL,
 
         INSTR_FUNCTION,
         INSTR_JUMP,
@@ -89,6 +96,25 @@ enum instruction {
         INSTR_MUT_DIV,
         INSTR_MUT_SUB,
 
+        INSTR_ADD_INT,
+        INSTR_ADD_LOCAL_INT,
+
+        // the quickened forms of the binary operators (see vm_exec)
+        INSTR_ADD_INTS,
+        INSTR_SUB_INTS,
+        INSTR_MUL_INTS,
+        INSTR_LT_INTS,
+        INSTR_GT_INTS,
+        INSTR_LEQ_INTS,
+        INSTR_GEQ_INTS,
+        INSTR_ADD_REALS,
+        INSTR_SUB_REALS,
+        INSTR_MUL_REALS,
+        INSTR_LT_REALS,
+        INSTR_GT_REALS,
+        INSTR_LEQ_REALS,
+        INSTR_GEQ_REALS,
+
         // unary operators
         INSTR_NEG,
         INSTR_NOT,
@@ -98,6 +124,9 @@ enum instruction {
 void
 vm_init(void);
 
+void
+vm_destroy(void);
+
 char const *
 vm_error(void);
 
@@ -116,6 +145,9 @@ vm_mark(void);
 void
 vm_mark_variable(struct variable *);
 
+void
+vm_mark_captured(void);
+
 void
 vm_sweep_variables(void);
 
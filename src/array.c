@@ -7,10 +7,11 @@
 #include "operators.h"
 #include "util.h"
 #include "vm.h"
+#include "tls.h"
 
 static value_vector no_args = { .count = 0 };
 
-static struct value *comparison_fn;
+static TLS struct value *comparison_fn;
 
 static int
 compare_by(void const *v1, void const *v2)
@@ -457,6 +458,7 @@ array_intersperse(struct value *array, value_vector *args)
         }
 
         array->array->count = newcount;
+        value_array_barrier(array->array);
         return *array;
 }
 
@@ -503,7 +505,7 @@ array_min_by(struct value *array, value_vector *args)
         struct value min, v, k, r;
         min = array->array->items[0];
 
-        if (f.type == VALUE_FUNCTION && f.param_symbols.count > 1) {
+        if (f.type == VALUE_FUNCTION && f.function->params > 1) {
                 for (int i = 1; i < array->array->count; ++i) {
                         v = array->array->items[i];
                         r = vm_eval_function2(&f, &v, &min);
@@ -570,7 +572,7 @@ array_max_by(struct value *array, value_vector *args)
         struct value max, v, k, r;
         max = array->array->items[0];
 
-        if (f.type == VALUE_FUNCTION && f.param_symbols.count > 1) {
+        if (f.type == VALUE_FUNCTION && f.function->params > 1) {
                 for (int i = 1; i < array->array->count; ++i) {
                         v = array->array->items[i];
                         r = vm_eval_function2(&f, &v, &max);
@@ -638,7 +640,9 @@ array_map(struct value *array, value_vector *args)
 
         int n = array->array->count;
         for (int i = 0; i < n; ++i) {
-                array->array->items[i] = value_apply_callable(&f, &array->array->items[i]);
+                struct value v = value_apply_callable(&f, &array->array->items[i]);
+                array->array->items[i] = v;
+                value_array_barrier(array->array);
         }
 
         return *array;
@@ -793,6 +797,7 @@ array_scan_left(struct value *array, value_vector *args)
         for (int i = start; i < n; ++i) {
                 v = vm_eval_function2(&f, &v, &array->array->items[i]);
                 array->array->items[i] = v;
+                value_array_barrier(array->array);
         }
 
         return *array;
@@ -828,6 +833,7 @@ array_scan_right(struct value *array, value_vector *args)
         for (int i = start; i >= 0; --i) {
                 v = vm_eval_function2(&f, &array->array->items[i], &v);
                 array->array->items[i] = v;
+                value_array_barrier(array->array);
         }
 
         return *array;
@@ -940,7 +946,7 @@ array_sort_by(struct value *array, value_vector *args)
 
         comparison_fn = &f;
 
-        if (f.type == VALUE_FUNCTION && f.param_symbols.count > 1) {
+        if (f.type == VALUE_FUNCTION && f.function->params > 1) {
                 qsort(array->array->items, array->array->count, sizeof (struct value), compare_by2);
         } else {
                 qsort(array->array->items, array->array->count, sizeof (struct value), compare_by);
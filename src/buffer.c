@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdbool.h>
 #include <errno.h>
@@ -5,9 +7,13 @@
 #include <stdnoreturn.h>
 #include <assert.h>
 #include <stdarg.h>
+#include <signal.h>
+#include <time.h>
+#include <malloc.h>
 
-#include <poll.h>
+#include <sys/epoll.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 
 #include <sys/mman.h>
 #ifndef MAP_ANONYMOUS
@@ -32,85 +38,123 @@
 #include "subprocess.h"
 #include "log.h"
 #include "vm.h"
+#include "tls.h"
+#include "gc.h"
 
-static char buffer[4096];
-static char shortpath[4096];
-static char fullpath[4096];
+static TLS char buffer[4096];
+static TLS char shortpath[4096];
+static TLS char fullpath[4096];
 
 enum {
         BUFFER_RENDERBUFFER_SIZE = 65536,
 };
 
-static struct tb data;
-static bool backgrounded;
+static TLS struct tb data;
+static TLS bool backgrounded;
 
 /*
  * Used to restart the command loop after a VM panic.
  */
-jmp_buf buffer_err_jb;
+TLS jmp_buf buffer_err_jb;
+
+/*
+ * Where a buffer thread goes when the editor shuts it down (see stop()).
+ */
+static TLS jmp_buf shutdown_jb;
 
-static char *rb1;
-static char *rb2;
-static bool *rb_idx;
-static bool *rb_changed;
-static pthread_mutex_t *rb_mtx;
-static bool rb_locked = false;
+static TLS char *rb1;
+static TLS char *rb2;
+static TLS bool *rb_idx;
+static TLS bool *rb_changed;
+static TLS pthread_mutex_t *rb_mtx;
+static TLS bool rb_locked = false;
 
-struct state state;
+TLS struct state state;
 
 /* read from this to receive data from the parent */
-static int read_fd;
+static TLS int read_fd;
 
 /* write to this to send data to the parent */
-static int write_fd;
+static TLS int write_fd;
 
 /* the id of this buffer process */
-static int bufid;
+static TLS int bufid;
+
+/*
+ * epoll instance for the main buffer loop.
+ * The fd for reading events from the editor (with a NULL
+ * pointer), and the fds for getting output from spawned
+ * subprocesses (with a pointer to their job) are in here.
+ */
+static TLS int epfd;
+
+/*
+ * Events from the editor which arrived while we were waiting for something else (e.g.
+ * the answer to a request). Each one is kept exactly as it came down the pipe, and the
+ * main loop handles them before reading anything new, so no event is ever handled from
+ * inside a builtin.
+ */
+struct deferred_event {
+        char *bytes;
+        int n;
+};
+
+static TLS vec(struct deferred_event) deferred;
+static TLS size_t deferred_head;
 
 /*
- * fds that we poll in the main buffer loop.
- * The fd for reading events from the editor,
- * and any fds for getting output from spawned
- * subprocesses are in here.
+ * The payload of the deferred event currently being handled.
  */
-static vec(struct pollfd) pollfds;
+static TLS char *replay;
+static TLS char const *replay_pos;
+static TLS int replay_left;
+
+/*
+ * Requests to the editor which are still waiting for an EVT_RESPONSE, along with the
+ * function to call with the result.
+ */
+struct request {
+        int id;
+        struct value callback;
+};
+
+static TLS vec(struct request) requests;
+static TLS int next_request;
+
+/*
+ * When this buffer has been in the background and idle for BUFFER_HIBERNATE_MS, the text
+ * and undo history are moved out to 'snapshot' and their memory is released. They are read
+ * back in as soon as anything happens in the buffer.
+ */
+static TLS FILE *snapshot;
+static TLS long long idle_since;
 
 /*
  * Dimensions of the window viewing this buffer.
  * If this buffer is backgrounded, these values have no meaning.
  */
-static int lines;
-static int cols;
+static TLS int lines;
+static TLS int cols;
 
 /*
  * Line and column offsets.
  */
-static struct location scroll = { 0, 0 };
+static TLS struct location scroll = { 0, 0 };
 
- /* remove the ith pollfd struct from the list of pollfds. */
+/* watch 'fd' in the main loop; 'job' is handed back to us whenever it's readable */
 inline static void
-rempollfd(int i)
+addpollfd(int fd, struct sp *job)
 {
-        pollfds.items[i] = *vec_last(pollfds);
-        --pollfds.count;
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = job };
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) != 0)
+                panic("epoll_ctl() failed: %s", strerror(errno));
 }
 
- /* remove the pollfd struct with fd 'fd' from the list of pollfds. */
-inline static int
-findpollfd(int fd)
-{
-        /* start at 1 since the main editor pipe fd will always be at index 0 */
-        for (int i = 1; i < pollfds.count; ++i)
-                if (pollfds.items[i].fd == fd)
-                        return i;
-        return -1;
-}
-
-/* add 'fd' to the list of fds to poll */
+/* stop watching 'fd' */
 inline static void
-addpollfd(int fd)
+rempollfd(int fd)
 {
-        vec_push(pollfds, ((struct pollfd){ .fd = fd, .events = POLLIN }));
+        epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
 }
 
 inline static void
@@ -218,7 +262,7 @@ echo(char const *fmt, ...)
 {
         int n;
         va_list args;
-        static char b[512];
+        static TLS char b[512];
 
         va_start(args, fmt);
         n = vsnprintf(b, cols, fmt, args);
@@ -296,50 +340,397 @@ source_init_files(void)
         }
 }
 
+inline static long long
+now_ms(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Move the text buffer out to a snapshot file and give back as much memory as we can.
+ */
+static void
+hibernate(void)
+{
+        FILE *f = tmpfile();
+        if (f == NULL || !tb_hibernate(&data, f)) {
+                LOG("failed to hibernate buffer: %s", strerror(errno));
+                if (f != NULL)
+                        fclose(f);
+                idle_since = now_ms();
+                return;
+        }
+
+        snapshot = f;
+
+        gc_collect();
+
+#ifndef PLUM_THREADED_BUFFERS
+        /*
+         * Nobody looks at the render buffers of a buffer without a window, and we
+         * render again before getting a window back.
+         */
+        rb_lock();
+        madvise(rb1, BUFFER_RENDERBUFFER_SIZE, MADV_REMOVE);
+        madvise(rb2, BUFFER_RENDERBUFFER_SIZE, MADV_REMOVE);
+        rb_unlock();
+#endif
+
+        malloc_trim(0);
+}
+
+/*
+ * Restore the text buffer if we're hibernating.
+ */
+static void
+wake(void)
+{
+        if (snapshot == NULL)
+                return;
+
+        rewind(snapshot);
+
+        if (!tb_wake(&data, snapshot))
+                panic("failed to restore buffer from its snapshot");
+
+        fclose(snapshot);
+        snapshot = NULL;
+}
+
+/*
+ * Read 'n' bytes of an editor event. This is the payload of the deferred event being
+ * replayed if there is one, and otherwise comes straight from the pipe.
+ */
+static void
+rdbytes(void *dst, int n)
+{
+        if (replay_left > 0) {
+                assert(n <= replay_left);
+                memcpy(dst, replay_pos, n);
+                replay_pos += n;
+                replay_left -= n;
+                return;
+        }
+
+        while (n > 0) {
+                int r = read(read_fd, dst, n);
+                if (r <= 0) {
+                        if (r == -1 && errno == EINTR)
+                                continue;
+                        panic("read() failed: %s", strerror(errno));
+                }
+                dst = (char *)dst + r;
+                n -= r;
+        }
+}
+
+inline static int
+rdint(void)
+{
+        int k;
+        rdbytes(&k, sizeof k);
+        return k;
+}
+
+/*
+ * Read a file descriptor (and the int sent along with it) which was passed to us
+ * with sendfd().
+ */
+inline static int
+rdfd(int *n)
+{
+        if (replay_left > 0) {
+                *n = rdint();
+                return rdint();
+        }
+
+        return recvfd(read_fd, n);
+}
+
+/*
+ * Get the 'n'-byte payload of a message from the memfd 'fd', and close it.
+ */
+static struct value
+mapped_payload(int fd, int n)
+{
+        if (n == 0) {
+                close(fd);
+                return STRING_CLONE("", 0);
+        }
+
+        /*
+         * The sender can't be trusted to have sealed it: if it could still shrink the file,
+         * reading the mapping could fault.
+         */
+        int const want = F_SEAL_SHRINK | F_SEAL_WRITE;
+        int seals = fcntl(fd, F_GET_SEALS);
+        struct stat st;
+
+        if (seals == -1 || (seals & want) != want || fstat(fd, &st) != 0 || st.st_size < n) {
+                close(fd);
+                vm_panic("message payload isn't sealed or is too short");
+        }
+
+        void *p = mmap(NULL, n, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+
+        if (p == MAP_FAILED)
+                vm_panic("failed to map message payload: %s", strerror(errno));
+
+        struct value payload = STRING_CLONE(p, n);
+
+        munmap(p, n);
+
+        return payload;
+}
+
+/*
+ * Deferred events are put together here before being added to the queue.
+ */
+static TLS vec(char) scratch;
+
+/* read an int from the pipe and append it to the event being deferred */
+inline static int
+deferint(void)
+{
+        int k = rdint();
+        vec_push_n(scratch, (char *)&k, sizeof k);
+        return k;
+}
+
+/* read 'n' bytes from the pipe and append them to the event being deferred */
+inline static void
+deferbytes(int n)
+{
+        vec_reserve(scratch, scratch.count + n);
+        rdbytes(scratch.items + scratch.count, n);
+        scratch.count += n;
+}
+
+inline static void
+pushdeferred(void)
+{
+        char *bytes = alloc(scratch.count);
+        memcpy(bytes, scratch.items, scratch.count);
+        vec_push(deferred, ((struct deferred_event){ .bytes = bytes, .n = scratch.count }));
+}
+
+/*
+ * Read the payload of 'ev' (whose code has already been read) from the pipe and
+ * put the whole thing at the end of the deferred events.
+ */
+static void
+defer_event(buffer_event_code ev)
+{
+        int bytes;
+
+        scratch.count = 0;
+        vec_push(scratch, ev);
+
+        switch (ev) {
+        case EVT_LOG:
+        case EVT_INPUT:
+        case EVT_RUN_PROGRAM:
+                deferbytes(deferint());
+                break;
+        case EVT_WINDOW_DIMENSIONS:
+        case EVT_RESPONSE:
+                deferint();
+                deferint();
+                break;
+        case EVT_MESSAGE:
+                deferint();
+                deferbytes(deferint());
+                if (bytes = deferint(), bytes == MESSAGE_FD) {
+                        /* the fd stays open until the message is handled */
+                        int fd = recvfd(read_fd, &bytes);
+                        vec_push_n(scratch, (char *)&bytes, sizeof bytes);
+                        vec_push_n(scratch, (char *)&fd, sizeof fd);
+                } else if (bytes != MESSAGE_NIL) {
+                        deferbytes(bytes);
+                }
+                break;
+        }
+
+        pushdeferred();
+}
+
+/*
+ * Take the oldest deferred event off the queue and return its code. Its payload is
+ * what rdbytes() reads until it has been consumed.
+ */
+static buffer_event_code
+undefer_event(void)
+{
+        struct deferred_event d = deferred.items[deferred_head++];
+
+        if (deferred_head == deferred.count)
+                deferred.count = deferred_head = 0;
+
+        free(replay);
+        replay = d.bytes;
+        replay_pos = replay + 1;
+        replay_left = d.n - 1;
+
+        return replay[0];
+}
+
+/*
+ * The editor is done with this buffer. A buffer process can just exit, but a buffer thread has to
+ * give back everything it has allocated first, since the editor carries on (see teardown()).
+ */
+noreturn static void
+stop(void)
+{
+#ifdef PLUM_THREADED_BUFFERS
+        longjmp(shutdown_jb, 1);
+#else
+        exit(EXIT_SUCCESS);
+#endif
+}
+
+/*
+ * Send the event 'ev' to the editor as a new request and return the request's id.
+ * The caller sends the rest of the request.
+ */
+static int
+request(buffer_event_code ev)
+{
+        int id = next_request++;
+
+        evt_send(write_fd, ev);
+        sendint(write_fd, id);
+
+        return id;
+}
+
+/*
+ * Wait for the response to the request with id 'id' and return its result.
+ */
+static int
+await(int id)
+{
+        for (;;) {
+                buffer_event_code ev = evt_recv(read_fd);
+                if (ev == EVT_SHUTDOWN) {
+                        stop();
+                }
+                if (ev != EVT_RESPONSE) {
+                        defer_event(ev);
+                        continue;
+                }
+
+                int rid = recvint(read_fd);
+                int result = recvint(read_fd);
+                if (rid == id)
+                        return result;
+
+                /* the response to some other request; its callback will be called from the main loop */
+                scratch.count = 0;
+                vec_push(scratch, ev);
+                vec_push_n(scratch, (char *)&rid, sizeof rid);
+                vec_push_n(scratch, (char *)&result, sizeof result);
+                pushdeferred();
+        }
+}
+
+/*
+ * If 'callback' is nil, wait for the response to request 'id' and return it. Otherwise,
+ * remember the callback so that it is called when the response arrives, and return -1.
+ */
+static int
+respond(int id, struct value callback)
+{
+        if (callback.type == VALUE_NIL)
+                return await(id);
+
+        vec_push(requests, ((struct request){ .id = id, .callback = callback }));
+
+        return -1;
+}
+
+static void
+handle_response(int id, int result)
+{
+        for (int i = 0; i < requests.count; ++i) {
+                if (requests.items[i].id == id) {
+                        struct request r;
+                        vec_pop_ith(requests, i, r);
+                        vm_eval_function(&r.callback, &INTEGER(result));
+                        return;
+                }
+        }
+
+        LOG("ERROR: response to unknown request: %d", id);
+}
+
 static void
 handle_editor_event(int ev)
 {
         int id;
         int bytes;
-        static char smallbuf[256];
-        static struct value type;
+        struct string *str;
+        static TLS char smallbuf[256];
+        static TLS vec(char) msgtype;
+        static TLS struct value type;
 
         switch (ev) {
         case EVT_LOG:
                 /*
                  * This event will only ever be received in the console buffer (for now).
                  */
-                bytes = recvint(read_fd);
-                read(read_fd, buffer, bytes);
+                bytes = rdint();
+                rdbytes(buffer, bytes);
                 tb_end(&data);
                 tb_insert(&data, buffer, bytes);
                 tb_insert(&data, "\n", 1);
                 break;
         case EVT_WINDOW_DIMENSIONS:
                 backgrounded = false;
-                lines = recvint(read_fd);
-                cols = recvint(read_fd);
+                lines = rdint();
+                cols = rdint();
                 adjust_cursor();
                 break;
         case EVT_BACKGROUNDED:
                 backgrounded = true;
+                idle_since = now_ms();
                 break;
+        case EVT_RESPONSE:
+                id = rdint();
+                handle_response(id, rdint());
+                break;
+        case EVT_SHUTDOWN:
+                stop();
         case EVT_MESSAGE:
-                id = recvint(read_fd);
-                bytes = recvint(read_fd);
-                read(read_fd, smallbuf, bytes);
-                type = STRING_NOGC(smallbuf, bytes);
-                bytes = recvint(read_fd);
-                if (bytes == -1) {
+                id = rdint();
+                bytes = rdint();
+                vec_reserve(msgtype, bytes);
+                rdbytes(msgtype.items, bytes);
+                /*
+                 * Handlers' types are interned when they're registered, so a type that isn't
+                 * can't have one, and interning it would only grow the table for good.
+                 */
+                if ((str = value_find_interned(msgtype.items, bytes)) != NULL) {
+                        type = STRING(str, bytes);
+                } else {
+                        type = STRING_CLONE(msgtype.items, bytes);
+                }
+                bytes = rdint();
+                if (bytes == MESSAGE_NIL) {
                         state_handle_message(&state, INTEGER(id), type, NIL);
+                } else if (bytes == MESSAGE_FD) {
+                        int fd = rdfd(&bytes);
+                        state_handle_message(&state, INTEGER(id), type, mapped_payload(fd, bytes));
                 } else {
-                        read(read_fd, buffer, bytes);
+                        rdbytes(buffer, bytes);
                         state_handle_message(&state, INTEGER(id), type, STRING_CLONE(buffer, bytes));
                 }
                 break;
         case EVT_RUN_PROGRAM:
-                bytes = recvint(read_fd);
-                read(read_fd, smallbuf, bytes);
+                bytes = rdint();
+                rdbytes(smallbuf, bytes);
                 snprintf(buffer, sizeof buffer - 1, "import %.*s\n", bytes, smallbuf);
                 /* TODO: maybe do something useful with the return value of vm_execute here? */
                 if (!vm_execute(buffer)) {
@@ -347,8 +738,8 @@ handle_editor_event(int ev)
                 }
                 break;
         case EVT_INPUT:
-                bytes = recvint(read_fd);
-                read(read_fd, buffer, bytes);
+                bytes = rdint();
+                rdbytes(buffer, bytes);
                 buffer[bytes] = '\0';
 
                 if (strcmp(buffer, "C-j") == 0) {
@@ -377,16 +768,58 @@ handle_editor_event(int ev)
         }
 }
 
-noreturn static void
+/*
+ * Free everything this buffer has allocated and close all of its fds, including the render
+ * buffer's mutex if we're holding it.
+ */
+static void
+teardown(void)
+{
+        rb_unlock();
+
+        sp_close_all();
+
+        close(epfd);
+        close(read_fd);
+        close(write_fd);
+
+        if (snapshot != NULL) {
+                fclose(snapshot);
+                snapshot = NULL;
+        }
+
+        tb_murder(&data);
+        state_free(&state);
+
+        for (size_t i = deferred_head; i < deferred.count; ++i)
+                free(deferred.items[i].bytes);
+        vec_empty(deferred);
+        deferred_head = 0;
+
+        free(replay);
+        replay = NULL;
+        replay_left = 0;
+
+        vec_empty(scratch);
+        vec_empty(requests);
+
+        vm_destroy();
+}
+
+static void
 buffer_main(void)
 {
         backgrounded = true;
+        idle_since = now_ms();
 
         /*
-         * Initialize the list of file descriptiors that we should poll
+         * Initialize the set of file descriptiors that we should poll
          * with the read-end of main editor process's pipe.
          */
-        addpollfd(read_fd);
+        if (epfd = epoll_create1(EPOLL_CLOEXEC), epfd == -1)
+                panic("epoll_create1() failed: %s", strerror(errno));
+
+        addpollfd(read_fd, NULL);
 
         /*
          * Render twice so that both renderbuffers contain valid data.
@@ -394,10 +827,11 @@ buffer_main(void)
         render();
         render();
 
-        /*
-         * Initialize the VM instance for this process.
-         */
-        vm_init();
+        if (setjmp(shutdown_jb) != 0) {
+                teardown();
+                return;
+        }
+
         source_init_files();
 
         /*
@@ -438,33 +872,66 @@ buffer_main(void)
                                 data.changed = false;
                         }
 
-                        int timeout = state_pending_input(&state) ? KEY_CHORD_TIMEOUT_MS : -1;
-                        int n = poll(pollfds.items, pollfds.count, timeout);
+                        /*
+                         * Handle anything that arrived while a builtin was waiting on the editor.
+                         */
+                        if (deferred_head < deferred.count) {
+                                handle_editor_event(undefer_event());
+                                goto next;
+                        }
+
+                        struct epoll_event events[BUFFER_MAX_EVENTS];
+                        int timeout;
+                        if (state_pending_input(&state))
+                                timeout = KEY_CHORD_TIMEOUT_MS;
+                        else if (gc_pending())
+                                timeout = 0;
+                        else if (backgrounded && snapshot == NULL)
+                                timeout = max(0, BUFFER_HIBERNATE_MS - (now_ms() - idle_since));
+                        else
+                                timeout = -1;
+
+                        int n = epoll_wait(epfd, events, BUFFER_MAX_EVENTS, timeout);
 
                         /*
-                         * If n is zero, that means we were waiting on user input, so all we
-                         * have to do is let the state machine know that it timed out.
+                         * If n is zero, either we were waiting on user input, so all we have to
+                         * do is let the state machine know that it timed out, or there's nothing
+                         * to do and the GC is in the middle of marking, so it gets a slice, or we
+                         * have been idle in the background for long enough to hibernate.
                          */
                         if (n == 0) {
-                                checkinput();
+                                if (state_pending_input(&state)) {
+                                        checkinput();
+                                } else if (gc_pending()) {
+                                        gc_idle();
+                                        continue;
+                                } else {
+                                        hibernate();
+                                }
                                 goto next;
                         }
 
-                        /* check for editor events */
-                        if (pollfds.items[0].revents & POLLIN)
-                                handle_editor_event(evt_recv(read_fd));
-
-                        /* check any subprocesses */
-                        for (int i = 1; i < pollfds.count; ++i) {
-                                if (pollfds.items[i].revents & (POLLIN | POLLHUP)) {
-                                        int r = read(pollfds.items[i].fd, buffer, sizeof buffer);
-                                        if (r == 0) {
-                                                int fd = pollfds.items[i].fd;
-                                                rempollfd(i--);
-                                                sp_on_exit(fd);
-                                        } else {
-                                                sp_on_output(pollfds.items[i].fd, buffer, r);
-                                        }
+                        wake();
+                        idle_since = now_ms();
+
+                        for (int i = 0; i < n; ++i) {
+                                struct sp *job = events[i].data.ptr;
+
+                                /* check for editor events */
+                                if (job == NULL) {
+                                        if ((events[i].events & EPOLLIN) && deferred_head == deferred.count)
+                                                handle_editor_event(evt_recv(read_fd));
+                                        continue;
+                                }
+
+                                /* output from (or the exit of) a subprocess */
+                                int fd = sp_output_fd(job);
+                                int r = read(fd, buffer, sizeof buffer);
+                                if (r <= 0) {
+                                        rempollfd(fd);
+                                        sp_on_exit(job);
+                                } else if (r > 0) {
+                                        sp_on_output(job, buffer, r);
                                 }
                         }
 next:
@@ -476,65 +943,152 @@ next:
         }
 }
 
-struct buffer
-buffer_new(unsigned id)
-{
-        void *rb1_mem = alloc(BUFFER_RENDERBUFFER_SIZE);
-        rb1 = mmap(rb1_mem, BUFFER_RENDERBUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_SHARED, -1, 0);
-        if (rb1 == MAP_FAILED) {
+/*
+ * Allocate memory which both the editor and the buffer can see. Buffers that run as threads
+ * share the editor's address space, so ordinary memory is enough for them.
+ */
+static void *
+sharedmem(size_t n)
+{
+#ifdef PLUM_THREADED_BUFFERS
+        return alloc(n);
+#else
+        void *mem = mmap(NULL, n, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_SHARED, -1, 0);
+        if (mem == MAP_FAILED) {
                 panic("mmap failed: %s", strerror(errno));
         }
 
-        void *rb2_mem = alloc(BUFFER_RENDERBUFFER_SIZE);
-        rb2 = mmap(rb2_mem, BUFFER_RENDERBUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_SHARED, -1, 0);
-        if (rb2 == MAP_FAILED) {
-                panic("mmap failed: %s", strerror(errno));
-        }
+        return mem;
+#endif
+}
 
-        void *mtx_mem = alloc(sizeof (pthread_mutex_t));
-        rb_mtx = mmap(mtx_mem, sizeof (pthread_mutex_t), PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_SHARED, -1, 0);
-        if (rb_mtx == MAP_FAILED) {
-                panic("mmap failed: %s", strerror(errno));
-        }
+/*
+ * Everything the buffer side needs to know to get started.
+ */
+struct child {
+        unsigned id;
+        int read_fd;
+        int write_fd;
+        char *rb1;
+        char *rb2;
+        bool *rb_idx;
+        bool *rb_changed;
+        pthread_mutex_t *rb_mtx;
+};
 
-        void *idx_mem = alloc(sizeof (bool));
-        rb_idx = mmap(idx_mem, sizeof (bool), PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_SHARED, -1, 0);
-        if (rb_idx == MAP_FAILED) {
-                panic("mmap failed: %s", strerror(errno));
-        }
+static void
+child_start(struct child const *c)
+{
+        rb1 = c->rb1;
+        rb2 = c->rb2;
+        rb_idx = c->rb_idx;
+        rb_changed = c->rb_changed;
+        rb_mtx = c->rb_mtx;
+        read_fd = c->read_fd;
+        write_fd = c->write_fd;
+        bufid = c->id;
+
+        // lock the renderbuffer mutex and tell the parent
+        rb_lock();
+        evt_send(write_fd, EVT_CHILD_LOCKED_MUTEX);
 
-        void *changed_mem = alloc(sizeof (bool));
-        rb_changed = mmap(changed_mem, sizeof (bool), PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_SHARED, -1, 0);
-        if (rb_changed == MAP_FAILED) {
-                panic("mmap failed: %s", strerror(errno));
-        }
+        /*
+         * The VM comes first, since resetting the GC would lose the objects state_new() makes.
+         */
+        vm_init();
+
+        data = tb_new();
+        state = state_new();
+
+        buffer_main();
+}
+
+#ifdef PLUM_THREADED_BUFFERS
+static void *
+buffer_thread(void *ctx)
+{
+        struct child c = *(struct child *)ctx;
+        free(ctx);
+        child_start(&c);
+        return NULL;
+}
+#endif
+
+struct buffer
+buffer_new(unsigned id)
+{
+        struct child c = {
+                .id = id,
+                .rb1 = sharedmem(BUFFER_RENDERBUFFER_SIZE),
+                .rb2 = sharedmem(BUFFER_RENDERBUFFER_SIZE),
+                .rb_mtx = sharedmem(sizeof (pthread_mutex_t)),
+                .rb_idx = sharedmem(sizeof (bool)),
+                .rb_changed = sharedmem(sizeof (bool)),
+        };
 
         /*
          * We start rb_idx as 'true', meaning the parent will read from rb2. When the buffer created, nothing
          * has been rendered yet, so we need to write a 0 to rb2 so that the parent knows not to try reading
          * anything.
          */
-        *rb_changed = true;
-        *rb_idx = true;
-        *(int *)rb2 = 0;
+        *c.rb_changed = true;
+        *c.rb_idx = true;
+        *(int *)c.rb2 = 0;
 
 
         pthread_mutexattr_t rb_mutexattr;
         pthread_mutexattr_init(&rb_mutexattr);
+#ifndef PLUM_THREADED_BUFFERS
         pthread_mutexattr_setpshared(&rb_mutexattr, PTHREAD_PROCESS_SHARED);
+#endif
 
-        if (pthread_mutex_init(rb_mtx, &rb_mutexattr) != 0) {
+        if (pthread_mutex_init(c.rb_mtx, &rb_mutexattr) != 0) {
                 panic("pthread_mutex_init failed: %s", strerror(errno));
         }
 
         pthread_mutexattr_destroy(&rb_mutexattr);
 
-        int p2c[2]; // parent to child pipe
-        int c2p[2]; // child to parent pipe
-        if (pipe(p2c) != 0 || pipe(c2p) != 0) {
-                panic("pipe() failed: %s", strerror(errno));
+        /*
+         * Unix sockets rather than pipes, so that large message payloads can be passed as fds.
+         */
+        int p2c[2]; // parent to child
+        int c2p[2]; // child to parent
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, p2c) != 0 || socketpair(AF_UNIX, SOCK_STREAM, 0, c2p) != 0) {
+                panic("socketpair() failed: %s", strerror(errno));
         }
 
+        c.read_fd = p2c[0];
+        c.write_fd = c2p[1];
+
+        struct buffer b = {
+                .id  = id,
+                .rb1 = c.rb1,
+                .rb2 = c.rb2,
+                .rb_mtx = c.rb_mtx,
+                .rb_idx = c.rb_idx,
+                .rb_changed = c.rb_changed,
+                .read_fd = c2p[0],
+                .write_fd = p2c[1],
+                .window = NULL,
+        };
+
+#ifdef PLUM_THREADED_BUFFERS
+        /*
+         * The fd table is shared with the buffer thread, so neither side closes anything here.
+         */
+        struct child *ctx = alloc(sizeof *ctx);
+        *ctx = c;
+
+        /*
+         * Joinable, so that the editor can wait for it to clean up after itself when it's
+         * destroyed (see editor_destroy_buffer()).
+         */
+        if (pthread_create(&b.thread, NULL, buffer_thread, ctx) != 0) {
+                panic("pthread_create() failed: %s", strerror(errno));
+        }
+
+        b.pid = getpid();
+#else
         pid_t pid;
         if (pid = fork(), pid == -1) {
                 panic("fork() failed: %s", strerror(errno));
@@ -543,38 +1097,47 @@ buffer_new(unsigned id)
         if (pid == 0) { // child
                 close(c2p[0]);
                 close(p2c[1]);
-
-                // lock the renderbuffer mutex and tell the parent
-                rb_lock();
-                evt_send(c2p[1], EVT_CHILD_LOCKED_MUTEX);
-
-                data = tb_new();
-                state = state_new();
-                read_fd = p2c[0];
-                write_fd = c2p[1];
-                bufid = id;
-
-                buffer_main();
-        } else {        // parent
-                close(c2p[1]);
-                close(p2c[0]);
-
-                // wait for the child to lock the renderbuffer mutex
-                assert(evt_recv(c2p[0]) == EVT_CHILD_LOCKED_MUTEX);
-
-                return (struct buffer) {
-                        .id  = id,
-                        .pid = pid,
-                        .rb1 = rb1,
-                        .rb2 = rb2,
-                        .rb_mtx = rb_mtx,
-                        .rb_idx = rb_idx,
-                        .rb_changed = rb_changed,
-                        .read_fd = c2p[0],
-                        .write_fd = p2c[1],
-                        .window = NULL,
-                };
+                child_start(&c);
+                exit(EXIT_SUCCESS);
         }
+
+        // parent
+        close(c2p[1]);
+        close(p2c[0]);
+
+        b.pid = pid;
+#endif
+
+        // wait for the child to lock the renderbuffer mutex
+        assert(evt_recv(b.read_fd) == EVT_CHILD_LOCKED_MUTEX);
+
+        return b;
+}
+
+static void
+freesharedmem(void *mem, size_t n)
+{
+#ifdef PLUM_THREADED_BUFFERS
+        (void) n;
+        free(mem);
+#else
+        munmap(mem, n);
+#endif
+}
+
+void
+buffer_free(struct buffer *b)
+{
+        pthread_mutex_destroy(b->rb_mtx);
+
+        freesharedmem(b->rb1, BUFFER_RENDERBUFFER_SIZE);
+        freesharedmem(b->rb2, BUFFER_RENDERBUFFER_SIZE);
+        freesharedmem(b->rb_mtx, sizeof (pthread_mutex_t));
+        freesharedmem(b->rb_idx, sizeof (bool));
+        freesharedmem(b->rb_changed, sizeof (bool));
+
+        close(b->read_fd);
+        close(b->write_fd);
 }
 
 char *
@@ -846,6 +1409,10 @@ void
 buffer_mark_values(void)
 {
         state_mark_actions(&state);
+        sp_mark();
+
+        for (int i = 0; i < requests.count; ++i)
+                value_mark(&requests.items[i].callback);
 }
 
 struct value
@@ -935,14 +1502,15 @@ int
 buffer_spawn(char *path, struct value_array *args, struct value on_output, struct value on_exit)
 {
         int fds[2];
+        struct sp *job;
 
-        if (!sp_tryspawn(path, args, on_output, on_exit, fds)) {
+        if (job = sp_tryspawn(path, args, on_output, on_exit, fds), job == NULL) {
                 echo("Failed to spawn process '%s': %s", path, strerror(errno));
                 free(path);
                 return -1;
         }
 
-        addpollfd(fds[1]);
+        addpollfd(fds[1], job);
 
         return fds[0];
 }
@@ -1072,52 +1640,29 @@ buffer_show_console(void)
 }
 
 int
-buffer_horizontal_split(int buf, int size)
+buffer_horizontal_split(int buf, int size, struct value callback)
 {
-        evt_send(write_fd, EVT_HSPLIT);
+        int id = request(EVT_HSPLIT);
         sendint(write_fd, buf);
         sendint(write_fd, size);
 
-        buffer_event_code ev;
-        for (;;) {
-                ev = evt_recv(read_fd);
-                if (ev == EVT_WINDOW_ID)
-                        return recvint(read_fd);
-                else
-                        handle_editor_event(ev);
-        }
+        return respond(id, callback);
 }
 
 int
-buffer_vertical_split(int buf, int size)
+buffer_vertical_split(int buf, int size, struct value callback)
 {
-        evt_send(write_fd, EVT_VSPLIT);
+        int id = request(EVT_VSPLIT);
         sendint(write_fd, buf);
         sendint(write_fd, size);
 
-        buffer_event_code ev;
-        for (;;) {
-                ev = evt_recv(read_fd);
-                if (ev == EVT_WINDOW_ID)
-                        return recvint(read_fd);
-                else
-                        handle_editor_event(ev);
-        }
+        return respond(id, callback);
 }
 
 int
 buffer_window_id(void)
 {
-        evt_send(write_fd, EVT_WINDOW_ID);
-
-        buffer_event_code ev;
-        for (;;) {
-                ev = evt_recv(read_fd);
-                if (ev == EVT_WINDOW_ID)
-                        return recvint(read_fd);
-                else
-                        handle_editor_event(ev);
-        }
+        return await(request(EVT_WINDOW_ID));
 }
 
 void
@@ -1126,9 +1671,43 @@ buffer_delete_window(void)
         evt_send(write_fd, EVT_WINDOW_DELETE);
 }
 
+/*
+ * Put a large message payload in a sealed memfd, so that it never goes through the pipes
+ * and the editor only has to pass the fd along.
+ */
+static int
+memfd_payload(char const *msg, int n)
+{
+        int fd = memfd_create("plum-message", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+        if (fd == -1)
+                vm_panic("memfd_create() failed: %s", strerror(errno));
+
+        for (int i = 0; i < n;) {
+                int w = write(fd, msg + i, n - i);
+                if (w == -1) {
+                        close(fd);
+                        vm_panic("failed to write message payload: %s", strerror(errno));
+                }
+                i += w;
+        }
+
+        if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) != 0) {
+                close(fd);
+                vm_panic("failed to seal message payload: %s", strerror(errno));
+        }
+
+        return fd;
+}
+
 void
 buffer_send_message(int id, char const *type, int tn, char const *msg, int mn)
 {
+        /*
+         * The payload is ready before anything is sent, so a failure can't leave half an
+         * event in the stream.
+         */
+        int fd = (mn > MESSAGE_INLINE_MAX) ? memfd_payload(msg, mn) : -1;
+
         evt_send(write_fd, EVT_MESSAGE);
 
         sendint(write_fd, id);
@@ -1136,9 +1715,15 @@ buffer_send_message(int id, char const *type, int tn, char const *msg, int mn)
         sendint(write_fd, tn);
         write(write_fd, type, tn);
 
-        sendint(write_fd, mn);
-        if (mn != -1) {
-                write(write_fd, msg, mn);
+        if (fd != -1) {
+                sendint(write_fd, MESSAGE_FD);
+                sendfd(write_fd, fd, mn);
+                close(fd);
+        } else {
+                sendint(write_fd, mn);
+                if (mn != -1) {
+                        write(write_fd, msg, mn);
+                }
         }
 }
 
@@ -1166,28 +1751,24 @@ buffer_cycle_window_color(void)
  *
  * Alternatively, n can be -1, and 'prog' will be ignored.
  *
- * example: buffer_create("foo::bar", 11);
+ * If 'callback' is nil, this waits for the new buffer's id and returns it. Otherwise
+ * it returns -1 right away and the callback is called with the id later.
+ *
+ * example: buffer_create("foo::bar", 8, NIL);
  *
  * will try to spawn a new buffer and in the new buffer, run
  * the program $HOME/.plum/foo/bar.plum
  */
 int
-buffer_create(char const *prog, int n)
+buffer_create(char const *prog, int n, struct value callback)
 {
-        evt_send(write_fd, EVT_NEW_BUFFER);
+        int id = request(EVT_NEW_BUFFER);
 
         sendint(write_fd, n);
         if (n != -1)
                 write(write_fd, prog, n);
 
-        buffer_event_code ev;
-        for (;;) {
-                ev = evt_recv(read_fd);
-                if (ev == EVT_NEW_BUFFER)
-                        return recvint(read_fd);
-                else
-                        handle_editor_event(ev);
-        }
+        return respond(id, callback);
 }
 
 int
@@ -1227,15 +1808,37 @@ buffer_get_char(void)
 {
         char b[16];
 
+        /*
+         * Input which arrived while we were waiting on the editor comes first.
+         */
+        for (size_t i = deferred_head; i < deferred.count; ++i) {
+                if (deferred.items[i].bytes[0] == EVT_INPUT) {
+                        struct deferred_event d;
+                        vec_pop_ith(deferred, i, d);
+                        if (deferred_head == deferred.count)
+                                deferred.count = deferred_head = 0;
+
+                        int n;
+                        memcpy(&n, d.bytes + 1, sizeof n);
+                        struct value c = STRING_CLONE(d.bytes + 1 + sizeof n, n);
+                        free(d.bytes);
+
+                        return c;
+                }
+        }
+
         buffer_event_code ev;
         for (;;) {
                 ev = evt_recv(read_fd);
+                if (ev == EVT_SHUTDOWN) {
+                        stop();
+                }
                 if (ev == EVT_INPUT) {
                         int n = recvint(read_fd);
                         read(read_fd, b, n);
                         return STRING_CLONE(b, n);
                 } else {
-                        handle_editor_event(ev);
+                        defer_event(ev);
                 }
         }
 }
@@ -1264,3 +1867,254 @@ blog(char const *fmt, ...)
 
         buffer_log(buffer);
 }
+
+TEST(deferred)
+{
+        vm_init();
+
+        int p[2];
+        claim(pipe(p) == 0);
+
+        read_fd = p[0];
+
+        evt_send(p[1], EVT_BACKGROUNDED);
+        evt_send(p[1], EVT_WINDOW_DIMENSIONS);
+        sendint(p[1], 24);
+        sendint(p[1], 80);
+        evt_send(p[1], EVT_RESPONSE);
+        sendint(p[1], 7);
+        sendint(p[1], 99);
+        evt_send(p[1], EVT_INPUT);
+        sendint(p[1], 1);
+        write(p[1], "x", 1);
+        evt_send(p[1], EVT_RESPONSE);
+        sendint(p[1], 5);
+        sendint(p[1], 42);
+
+        claim(await(5) == 42);
+
+        claim(undefer_event() == EVT_BACKGROUNDED);
+        claim(undefer_event() == EVT_WINDOW_DIMENSIONS);
+        claim(rdint() == 24);
+        claim(rdint() == 80);
+
+        struct value c = buffer_get_char();
+        claim(c.type == VALUE_STRING && c.bytes == 1 && c.string[0] == 'x');
+
+        claim(undefer_event() == EVT_RESPONSE);
+        claim(rdint() == 7);
+        claim(rdint() == 99);
+        claim(deferred.count == 0);
+
+        close(p[0]);
+        close(p[1]);
+}
+
+TEST(large_message)
+{
+        vm_init();
+
+        int s[2];
+        claim(socketpair(AF_UNIX, SOCK_STREAM, 0, s) == 0);
+
+        static char big[MESSAGE_INLINE_MAX * 4];
+        memset(big, 'z', sizeof big);
+
+        /*
+         * The editor forwards messages as-is, so we can read back what we send as if
+         * it were an event from the editor.
+         */
+        write_fd = s[0];
+        read_fd = s[1];
+
+        buffer_send_message(3, "file", 4, big, sizeof big);
+
+        claim(evt_recv(read_fd) == EVT_MESSAGE);
+        defer_event(EVT_MESSAGE);
+
+        char type[4];
+        claim(undefer_event() == EVT_MESSAGE);
+        claim(rdint() == 3);
+        claim(rdint() == 4);
+        rdbytes(type, 4);
+        claim(memcmp(type, "file", 4) == 0);
+        claim(rdint() == MESSAGE_FD);
+
+        int n;
+        int fd = rdfd(&n);
+        claim(n == sizeof big);
+        claim(fcntl(fd, F_GET_SEALS) & F_SEAL_WRITE);
+
+        struct value payload = mapped_payload(fd, n);
+        claim(payload.type == VALUE_STRING);
+        claim(payload.bytes == sizeof big);
+        claim(memcmp(payload.string, big, sizeof big) == 0);
+
+        /* an unsealed payload is refused rather than mapped */
+        fd = memfd_create("plum-message", MFD_CLOEXEC);
+        claim(write(fd, big, 16) == 16);
+
+        if (setjmp(buffer_err_jb) == 0) {
+                mapped_payload(fd, 16);
+                claim(!"unsealed payload was mapped");
+        }
+
+        close(s[0]);
+        close(s[1]);
+}
+
+static long
+rss_kb(pid_t pid)
+{
+        char path[64];
+        long pages = 0, resident = 0;
+
+        sprintf(path, "/proc/%d/statm", (int) pid);
+
+        FILE *f = fopen(path, "r");
+        if (f == NULL)
+                return 0;
+
+        if (fscanf(f, "%ld %ld", &pages, &resident) != 2)
+                resident = 0;
+
+        fclose(f);
+
+        return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static double
+now_us(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+TEST(each_line)
+{
+        vm_init();
+
+        data = tb_new();
+        buffer_insert_n("one\ntwo\nthree\n\nfive", 19);
+        tb_seek(&data, 5);
+
+        claim(vm_execute("import buffer\nlet ls = []; buffer::eachLine(function (l, n) { ls.push(l); ls.push(str(n)); });"));
+
+        gc_collect();
+        gc_collect();
+
+        vm_get_output();
+        claim(vm_execute("for (let i = 0; i < ls.len(); ++i) print(ls[i]);"));
+        claim(strcmp(vm_get_output(), "one\n0\ntwo\n1\nthree\n2\n\n3\nfive\n4\n") == 0);
+
+        /* an empty line is falsy, like any other empty string */
+        claim(vm_execute("let full = []; buffer::eachLine(function (l, n) { if (l) full.push(n); }); print(full);"));
+        claim(strcmp(vm_get_output(), "[0, 1, 2, 4]\n") == 0);
+}
+
+TEST(shutdown)
+{
+        char home[] = "/tmp/plum-test-XXXXXX";
+        char path[256];
+        char *old_home = sclone(getenv("HOME"));
+
+        /*
+         * The second time, the buffer's init file leaves it blocked in getChar(), which has to
+         * notice the shutdown event rather than defer it.
+         */
+        claim(mkdtemp(home) != NULL);
+        snprintf(path, sizeof path, "%s/.plum", home);
+        claim(mkdir(path, 0700) == 0);
+        snprintf(path, sizeof path, "%s/.plum/plum", home);
+        claim(mkdir(path, 0700) == 0);
+        snprintf(path, sizeof path, "%s/.plum/plum/start.plum", home);
+        FILE *f = fopen(path, "w");
+        fputs("import buffer\nbuffer::getChar();\n", f);
+        fclose(f);
+
+        for (int run = 0; run < 2; ++run) {
+                if (run == 1)
+                        setenv("HOME", home, 1);
+
+                /* the render after the init file never comes if it's blocked */
+                struct buffer b = buffer_new(run);
+                for (int r = 0; r < 3 - run; ++r)
+                        claim(evt_recv(b.read_fd) == EVT_RENDER);
+
+                evt_send(b.write_fd, EVT_SHUTDOWN);
+
+#ifdef PLUM_THREADED_BUFFERS
+                struct timespec deadline;
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                deadline.tv_sec += 5;
+                claim(pthread_timedjoin_np(b.thread, NULL, &deadline) == 0);
+                claim(pthread_mutex_trylock(b.rb_mtx) == 0);
+#else
+                int status;
+                claim(waitpid(b.pid, &status, 0) == b.pid);
+                claim(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+#endif
+
+                char c;
+                claim(read(b.read_fd, &c, 1) == 0);
+
+                buffer_free(&b);
+        }
+
+        unlink(path);
+        snprintf(path, sizeof path, "%s/.plum/plum", home);
+        rmdir(path);
+        snprintf(path, sizeof path, "%s/.plum", home);
+        rmdir(path);
+        rmdir(home);
+        setenv("HOME", old_home, 1);
+        free(old_home);
+}
+
+/*
+ * Spawn a bunch of buffers and report how much memory each one costs and how long a
+ * round-trip through the event protocol takes. Build with THREADED=1 to compare.
+ */
+TEST(spawn) // OFF
+{
+        enum { N = 100, ROUNDS = 100 };
+        static struct buffer bs[N];
+
+        long before = rss_kb(getpid());
+
+        for (int i = 0; i < N; ++i) {
+                bs[i] = buffer_new(i);
+                for (int r = 0; r < 3; ++r)
+                        claim(evt_recv(bs[i].read_fd) == EVT_RENDER);
+        }
+
+        long total = rss_kb(getpid()) - before;
+#ifndef PLUM_THREADED_BUFFERS
+        for (int i = 0; i < N; ++i)
+                total += rss_kb(bs[i].pid);
+#endif
+
+        double start = now_us();
+
+        for (int r = 0; r < ROUNDS; ++r) {
+                for (int i = 0; i < N; ++i) {
+                        evt_send(bs[i].write_fd, EVT_WINDOW_DIMENSIONS);
+                        sendint(bs[i].write_fd, 24);
+                        sendint(bs[i].write_fd, 80);
+                        claim(evt_recv(bs[i].read_fd) == EVT_RENDER);
+                }
+        }
+
+        double elapsed = now_us() - start;
+
+        printf("%ld KB per buffer, %.1f us per event ... ", total / N, elapsed / (N * ROUNDS));
+
+        for (int i = 0; i < N; ++i) {
+#ifdef PLUM_THREADED_BUFFERS
+                pthread_cancel(bs[i].thread);
+#else
+                kill(bs[i].pid, SIGTERM);
+#endif
+        }
+}
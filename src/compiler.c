@@ -7,6 +7,12 @@
 #include <setjmp.h>
 #include <stdarg.h>
 #include <stdnoreturn.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <pcre.h>
 
 #include "location.h"
 #include "log.h"
@@ -15,19 +21,21 @@
 #include "value.h"
 #include "ast.h"
 #include "object.h"
+#include "str.h"
+#include "array.h"
 #include "functions.h"
 #include "test.h"
 #include "lex.h"
 #include "parse.h"
 #include "tags.h"
 #include "vm.h"
+#include "tls.h"
 
 #define emit_instr(i) LOG("emitting instr: %s", #i); _emit_instr(i)
 
 #define PLACEHOLDER_JUMP(t, name) \
         emit_instr(t); \
-        size_t name = state.code.count; \
-        emit_int(0);
+        size_t name = jump_slot();
 
 #define PATCH_JUMP(name) \
         jumpdistance = state.code.count - name - sizeof (int); \
@@ -35,7 +43,8 @@
 
 #define JUMP(loc) \
         emit_instr(INSTR_JUMP); \
-        emit_int(loc - state.code.count - sizeof (int));
+        jumpdistance = loc - jump_slot() - sizeof (int); \
+        memcpy(state.code.items + state.code.count - sizeof (int), &jumpdistance, sizeof jumpdistance);
 
 /*
  * Flags for properties of lvalues.
@@ -56,7 +65,39 @@ struct eloc {
                 uintptr_t p;
                 size_t offset;
         };
-        struct expression const *e;
+        struct location loc;
+        char const *filename;
+};
+
+/*
+ * A jump operand and the instruction it belongs to.
+ */
+struct jump {
+        size_t instr;
+        size_t slot;
+};
+
+/*
+ * An operand whose value is only meaningful in the process that compiled it: a symbol or tag
+ * number, or a pointer. Module code is saved with a list of these so that it can be loaded
+ * back by a different process (see save_module() and load_cached_module()).
+ */
+enum {
+        RELOC_SYMBOL,
+        RELOC_TAG,
+        RELOC_STRING,
+        RELOC_MEMBER,
+        RELOC_METHODS,
+        RELOC_REGEX,
+        RELOC_MODULE,
+};
+
+struct reloc {
+        int kind;
+        size_t instr;
+        size_t offset;
+        char const *name;
+        int length;
 };
 
 struct scope {
@@ -69,23 +110,27 @@ struct scope {
         struct scope *func;
 };
 
-struct module {
-        char const *path;
-        char *code;
-        struct scope *scope;
-};
-
 struct import {
         char *name;
         struct scope *scope;
 };
 
 typedef vec(struct import)    import_vector;
-typedef vec(struct reference) reference_vector;
 typedef vec(struct eloc)      location_vector;
 typedef vec(int)              symbol_vector;
 typedef vec(size_t)           offset_vector;
 typedef vec(char)             byte_vector;
+typedef vec(struct jump)      jump_vector;
+typedef vec(struct reloc)     reloc_vector;
+
+struct module {
+        char const *path;
+        char *code;
+        struct scope *scope;
+        int symbols_begin;
+        int symbols_end;
+        symbol_vector tags;
+};
 
 /*
  * State which is local to a single compilation unit.
@@ -94,7 +139,7 @@ struct state {
         byte_vector code;
 
         symbol_vector bound_symbols;
-        reference_vector refs;
+        symbol_vector upvalues;
         
         offset_vector breaks;
         offset_vector continues;
@@ -111,25 +156,52 @@ struct state {
         struct location loc;
 
         location_vector expression_locations;
+
+        size_t last_instr;
+        jump_vector jumps;
+
+        reloc_vector relocs;
+        symbol_vector tags;
 };
 
-static jmp_buf jb;
-static char const *err_msg;
-static char err_buf[512];
+static TLS jmp_buf jb;
+static TLS char const *err_msg;
+static TLS char err_buf[512];
+
+static TLS int builtin_modules;
+static TLS int builtin_count;
+
+static TLS int symbol;
+static TLS int jumpdistance;
+static TLS vec(struct module) modules;
+static TLS struct state state;
+
+static TLS vec(location_vector) location_lists;
+static TLS symbol_vector public_symbols;
 
-static int builtin_modules;
-static int builtin_count;
+/*
+ * Everything that compiled code has been handed out in, so that it can all be freed by
+ * compiler_destroy(): the blocks the compiler emitted, and the maps of the cached modules.
+ */
+struct mapping {
+        void *p;
+        size_t n;
+};
 
-static int symbol;
-static int jumpdistance;
-static vec(struct module) modules;
-static struct state state;
+static TLS vec(char *) blocks;
+static TLS vec(struct mapping) maps;
+static TLS vec(struct scope *) scopes;
 
-static vec(location_vector) location_lists;
-static symbol_vector public_symbols;
+static TLS struct scope *global;
+static TLS int global_count;
 
-static struct scope *global;
-static int global_count;
+/*
+ * Indexed by symbol. Variables declared inside of a function live in a slot of that function's
+ * frame (slot is -1 for everything else) unless a nested function refers to them, in which
+ * case they are captured and have to be heap-allocated like globals.
+ */
+static TLS vec(int) slots;
+static TLS vec(bool) captured;
 
 static void
 symbolize_statement(struct scope *scope, struct statement *s);
@@ -147,7 +219,10 @@ static void
 emit_expression(struct expression const *e);
 
 static void
-emit_assignment(struct expression *target, struct expression const *e, int i);
+emit_assignment(struct expression *target, struct expression const *e, int i, bool keep);
+
+static void
+emit_discarded(struct expression const *e);
 
 static void
 import_module(char *name, char *as);
@@ -191,7 +266,8 @@ add_location(struct expression const *e)
                 state.expression_locations,
                 ((struct eloc){
                         .offset = state.code.count,
-                        .e = e
+                        .loc = (e == NULL) ? (struct location){ -1, -1 } : e->loc,
+                        .filename = state.filename
                 })
         );
 }
@@ -204,17 +280,35 @@ patch_location_info(void)
                 locs[i].p = (uintptr_t)(state.code.items + locs[i].offset);
 }
 
+/*
+ * Pad the code with zeros so that the next operand starts at an offset which is a multiple
+ * of its size. The VM does the same rounding when it reads it back (see READVALUE in vm.c).
+ */
 inline static void
-addref(int symbol)
+align_code(size_t n)
 {
-        LOG("adding reference: %d", symbol);
+        while (state.code.count % n != 0) {
+                vec_push(state.code, 0);
+        }
+}
 
-        struct reference r = {
-                .symbol = symbol,
-                .offset = state.code.count
-        };
+/*
+ * Get the index of 'symbol' in the environment of the function currently being compiled,
+ * adding it if this is the first reference to it.
+ */
+inline static int
+upvalue(int symbol)
+{
+        for (int i = 0; i < state.upvalues.count; ++i) {
+                if (state.upvalues.items[i] == symbol) {
+                        return i;
+                }
+        }
 
-        vec_push(state.refs, r);
+        LOG("adding upvalue: %d", symbol);
+        vec_push(state.upvalues, symbol);
+
+        return state.upvalues.count - 1;
 }
 
 /*
@@ -272,6 +366,7 @@ definetag(char const *tag)
                 fail("redeclaration of tag: %s", tag);
         }
 
+        vec_push(state.tags, state.global->identifiers.count);
         vec_push(state.global->identifiers, tag);
         vec_push(state.global->symbols, t);
 }
@@ -288,6 +383,15 @@ addsymbol(struct scope *scope, char const *name, bool pub)
         vec_push(scope->identifiers, name);
         vec_push(scope->symbols, symbol);
 
+        assert(slots.count == symbol);
+        if (scope->func != NULL && scope->func->function) {
+                vec_push(slots, scope->func->func_symbols.count);
+        } else {
+                vec_push(slots, -1);
+        }
+
+        vec_push(captured, false);
+
         if (scope->func != NULL) {
                 vec_push(scope->func->func_symbols, symbol);
         }
@@ -320,6 +424,9 @@ getsymbol(struct scope const *scope, char const *name, bool *local)
                                 if (scope->external && !ispublic(scope->symbols.items[i])) {
                                         fail("reference to non-public external variable: %s", name);
                                 }
+                                if (local != NULL && !*local) {
+                                        captured.items[scope->symbols.items[i]] = true;
+                                }
                                 return scope->symbols.items[i];
                         }
                 }
@@ -337,7 +444,7 @@ getsymbol(struct scope const *scope, char const *name, bool *local)
 inline static int
 tmpsymbol(int i)
 {
-        static char idbuf[8];
+        static TLS char idbuf[8];
         assert(i <= 9999999 && i >= 0);
 
         sprintf(idbuf, "%d", i);
@@ -363,6 +470,8 @@ newscope(struct scope *parent, bool function)
         vec_init(s->identifiers);
         vec_init(s->func_symbols);
 
+        vec_push(scopes, s);
+
         return s;
 }
 
@@ -373,7 +482,7 @@ freshstate(void)
 
         vec_init(s.code);
 
-        vec_init(s.refs);
+        vec_init(s.upvalues);
         vec_init(s.bound_symbols);
 
         vec_init(s.breaks);
@@ -390,6 +499,12 @@ freshstate(void)
 
         vec_init(s.expression_locations);
 
+        s.last_instr = 0;
+        vec_init(s.jumps);
+
+        vec_init(s.relocs);
+        vec_init(s.tags);
+
         return s;
 }
 
@@ -730,6 +845,7 @@ patch_loop_jumps(size_t begin, size_t end)
 inline static void
 _emit_instr(char c)
 {
+        state.last_instr = state.code.count;
         vec_push(state.code, c);
 }
 
@@ -737,6 +853,7 @@ inline static void
 emit_int(int k)
 {
         LOG("emitting int: %d", k);
+        align_code(sizeof k);
         char const *s = (char *) &k;
         for (int i = 0; i < sizeof (int); ++i) {
                 vec_push(state.code, s[i]);
@@ -744,20 +861,64 @@ emit_int(int k)
 }
 
 inline static void
-emit_symbol(uintptr_t sym)
+relocate(int kind, size_t offset, char const *name, int length)
 {
-        LOG("emitting symbol: %"PRIuPTR, sym);
-        char const *s = (char *) &sym;
+        vec_push(
+                state.relocs,
+                ((struct reloc){
+                        .kind = kind,
+                        .instr = state.last_instr,
+                        .offset = offset,
+                        .name = name,
+                        .length = length
+                })
+        );
+}
+
+inline static void
+emit_word(uintptr_t w)
+{
+        align_code(sizeof w);
+        char const *s = (char *) &w;
         for (int i = 0; i < sizeof (uintptr_t); ++i) {
                 vec_push(state.code, s[i]);
         }
 }
 
+inline static void
+emit_symbol(uintptr_t sym)
+{
+        LOG("emitting symbol: %"PRIuPTR, sym);
+        align_code(sizeof sym);
+        relocate(RELOC_SYMBOL, state.code.count, NULL, 0);
+        emit_word(sym);
+}
+
+/*
+ * 'name' and 'length' are whatever is needed to recreate the pointer in another process.
+ */
+inline static void
+emit_pointer(int kind, uintptr_t p, char const *name, int length)
+{
+        align_code(sizeof (uintptr_t));
+        relocate(kind, state.code.count, name, length);
+        emit_word(p);
+}
+
+inline static void
+emit_tag(int tag)
+{
+        align_code(sizeof tag);
+        relocate(RELOC_TAG, state.code.count, NULL, 0);
+        emit_int(tag);
+}
+
 inline static void
 emit_integer(intmax_t k)
 {
         
         LOG("emitting integer: %"PRIiMAX, k);
+        align_code(sizeof k);
         char const *s = (char *) &k;
         for (int i = 0; i < sizeof (intmax_t); ++i) {
                 vec_push(state.code, s[i]);
@@ -780,20 +941,333 @@ emit_float(float f)
 {
         
         LOG("emitting float: %f", f);
+        align_code(sizeof f);
         char const *s = (char *) &f;
         for (int i = 0; i < sizeof (float); ++i) {
                 vec_push(state.code, s[i]);
         }
 }
 
+/*
+ * Make room in the code for a zeroed object that the VM will fill in, and return its offset.
+ */
+inline static size_t
+emit_zeroed(size_t size, size_t align)
+{
+        align_code(align);
+        size_t offset = state.code.count;
+        for (size_t i = 0; i < size; ++i) {
+                vec_push(state.code, 0);
+        }
+
+        return offset;
+}
+
+/*
+ * Like emit_zeroed(), but for an object that the VM will treat like a GC-allocated one. Its
+ * mark (always the first member) is set from the start, and since it isn't on any chain it's
+ * never swept.
+ */
 inline static void
-emit_string(char const *s)
+emit_static_object(size_t size, size_t align)
 {
-        
-        LOG("emitting string: %s", s);
-        size_t n = strlen(s) + 1;
-        for (int i = 0; i < n; ++i) {
-                vec_push(state.code, s[i]);
+        size_t offset = emit_zeroed(size, align);
+        *(unsigned char *)(state.code.items + offset) = GC_STATIC;
+}
+
+/*
+ * Members are referred to by the instruction's inline cache (see struct member_cache), which
+ * holds the interned name.
+ */
+inline static void
+emit_member(char const *name)
+{
+        size_t offset = emit_zeroed(sizeof (struct member_cache), _Alignof (struct member_cache));
+        struct member_cache *cache = (struct member_cache *)(state.code.items + offset);
+        cache->length = strlen(name);
+        cache->name = value_intern_string(name, cache->length)->data;
+        relocate(RELOC_MEMBER, offset, cache->name, cache->length);
+}
+
+/*
+ * String literals are interned, and carry their length so that INSTR_STRING doesn't have to
+ * strlen() them.
+ */
+inline static void
+emit_string_literal(char const *s)
+{
+        int n = strlen(s);
+        struct string *str = value_intern_string(s, n);
+        emit_int(n);
+        emit_pointer(RELOC_STRING, (uintptr_t) str, str->data, n);
+}
+
+inline static void
+emit_regex(struct expression const *e)
+{
+        struct regex *r = alloc(sizeof *r);
+        r->re = e->regex;
+        r->extra = e->extra;
+        r->pattern = e->pattern;
+        emit_pointer(RELOC_REGEX, (uintptr_t) r, r->pattern, strlen(r->pattern));
+}
+
+static void
+emit_constant(struct value const *v)
+{
+        switch (v->type) {
+        case VALUE_INTEGER:
+                emit_instr(INSTR_INTEGER);
+                emit_integer(v->integer);
+                break;
+        case VALUE_REAL:
+                emit_instr(INSTR_REAL);
+                emit_float(v->real);
+                break;
+        case VALUE_BOOLEAN:
+                emit_instr(INSTR_BOOLEAN);
+                emit_boolean(v->boolean);
+                break;
+        case VALUE_STRING:
+                emit_instr(INSTR_STRING);
+                emit_int(v->bytes);
+                emit_pointer(RELOC_STRING, (uintptr_t) value_string_owner(v->string), v->string, v->bytes);
+                break;
+        default:
+                emit_instr(INSTR_NIL);
+        }
+}
+
+static bool
+fold_integers(int type, intmax_t a, intmax_t b, struct value *v)
+{
+        intmax_t k;
+
+        switch (type) {
+        case EXPRESSION_PLUS:    if (__builtin_add_overflow(a, b, &k)) return false; *v = INTEGER(k); break;
+        case EXPRESSION_MINUS:   if (__builtin_sub_overflow(a, b, &k)) return false; *v = INTEGER(k); break;
+        case EXPRESSION_STAR:    if (__builtin_mul_overflow(a, b, &k)) return false; *v = INTEGER(k); break;
+        case EXPRESSION_DIV:     if (b == 0 || (a == INTMAX_MIN && b == -1)) return false; *v = INTEGER(a / b); break;
+        case EXPRESSION_PERCENT: if (b == 0 || (a == INTMAX_MIN && b == -1)) return false; *v = INTEGER(a % b); break;
+        case EXPRESSION_LT:      *v = BOOLEAN(a < b);  break;
+        case EXPRESSION_LEQ:     *v = BOOLEAN(a <= b); break;
+        case EXPRESSION_GT:      *v = BOOLEAN(a > b);  break;
+        case EXPRESSION_GEQ:     *v = BOOLEAN(a >= b); break;
+        default:                 return false;
+        }
+
+        return true;
+}
+
+static bool
+fold_reals(int type, float a, float b, struct value *v)
+{
+        switch (type) {
+        case EXPRESSION_PLUS:    *v = REAL(a + b);     break;
+        case EXPRESSION_MINUS:   *v = REAL(a - b);     break;
+        case EXPRESSION_STAR:    *v = REAL(a * b);     break;
+        case EXPRESSION_DIV:     *v = REAL(a / b);     break;
+        case EXPRESSION_LT:      *v = BOOLEAN(a < b);  break;
+        case EXPRESSION_LEQ:     *v = BOOLEAN(a <= b); break;
+        case EXPRESSION_GT:      *v = BOOLEAN(a > b);  break;
+        case EXPRESSION_GEQ:     *v = BOOLEAN(a >= b); break;
+        default:                 return false;
+        }
+
+        return true;
+}
+
+static bool
+fold_strings(int type, struct value const *a, struct value const *b, struct value *v)
+{
+        if (type != EXPRESSION_PLUS) {
+                return false;
+        }
+
+        char *s = alloc(a->bytes + b->bytes);
+        memcpy(s, a->string, a->bytes);
+        memcpy(s + a->bytes, b->string, b->bytes);
+        *v = STRING_INTERN(s, a->bytes + b->bytes);
+        free(s);
+
+        return true;
+}
+
+/*
+ * If e is made up only of literals, evaluate it at compile time and store the result (which for
+ * a string is interned) in *v. Anything that would be an error at run time, like a type mismatch
+ * or a division by zero, is left for the VM to report.
+ */
+static bool
+constant(struct expression const *e, struct value *v)
+{
+        struct value left, right;
+
+        switch (e->type) {
+        case EXPRESSION_INTEGER: *v = INTEGER(e->integer);                           return true;
+        case EXPRESSION_REAL:    *v = REAL(e->real);                                 return true;
+        case EXPRESSION_BOOLEAN: *v = BOOLEAN(e->boolean);                           return true;
+        case EXPRESSION_NIL:     *v = NIL;                                           return true;
+        case EXPRESSION_STRING:  *v = STRING_INTERN(e->string, strlen(e->string));   return true;
+        case EXPRESSION_PREFIX_BANG:
+                if (!constant(e->operand, &left)) {
+                        return false;
+                }
+                *v = BOOLEAN(!value_truthy(&left));
+                return true;
+        case EXPRESSION_PREFIX_MINUS:
+                if (!constant(e->operand, &left)) {
+                        return false;
+                }
+                if (left.type == VALUE_INTEGER && left.integer != INTMAX_MIN) {
+                        *v = INTEGER(-left.integer);
+                } else if (left.type == VALUE_REAL) {
+                        *v = REAL(-left.real);
+                } else {
+                        return false;
+                }
+                return true;
+        case EXPRESSION_AND:
+        case EXPRESSION_OR:
+                if (!constant(e->left, &left)) {
+                        return false;
+                }
+                if (value_truthy(&left) == (e->type == EXPRESSION_OR)) {
+                        *v = left;
+                        return true;
+                }
+                return constant(e->right, v);
+        case EXPRESSION_PLUS:
+        case EXPRESSION_MINUS:
+        case EXPRESSION_STAR:
+        case EXPRESSION_DIV:
+        case EXPRESSION_PERCENT:
+        case EXPRESSION_LT:
+        case EXPRESSION_LEQ:
+        case EXPRESSION_GT:
+        case EXPRESSION_GEQ:
+        case EXPRESSION_DBL_EQ:
+        case EXPRESSION_NOT_EQ:
+                break;
+        default:
+                return false;
+        }
+
+        if (!constant(e->left, &left) || !constant(e->right, &right)) {
+                return false;
+        }
+
+        if (e->type == EXPRESSION_DBL_EQ || e->type == EXPRESSION_NOT_EQ) {
+                *v = BOOLEAN(value_test_equality(&left, &right) == (e->type == EXPRESSION_DBL_EQ));
+                return true;
+        }
+
+        if (left.type != right.type) {
+                return false;
+        }
+
+        switch (left.type) {
+        case VALUE_INTEGER: return fold_integers(e->type, left.integer, right.integer, v);
+        case VALUE_REAL:    return fold_reals(e->type, left.real, right.real, v);
+        case VALUE_STRING:  return fold_strings(e->type, &left, &right, v);
+        default:            return false;
+        }
+}
+
+/*
+ * Emit a placeholder jump distance for the last instruction and return its offset so it can be
+ * patched later.
+ */
+inline static size_t
+jump_slot(void)
+{
+        align_code(sizeof (int));
+        size_t offset = state.code.count;
+        emit_int(0);
+        vec_push(state.jumps, ((struct jump){ .instr = state.last_instr, .slot = offset }));
+        return offset;
+}
+
+static struct jump const *
+find_jump(size_t instr)
+{
+        int lo = 0,
+            hi = state.jumps.count - 1;
+
+        while (lo <= hi) {
+                int m = (lo + hi) / 2;
+                if      (instr < state.jumps.items[m].instr) hi = m - 1;
+                else if (instr > state.jumps.items[m].instr) lo = m + 1;
+                else                                         return &state.jumps.items[m];
+        }
+
+        return NULL;
+}
+
+/*
+ * Retarget every jump that lands on an unconditional jump to wherever that one goes. Only the
+ * distances change, so no code moves and the location info stays valid.
+ */
+static void
+thread_jumps(void)
+{
+        for (int i = 0; i < state.jumps.count; ++i) {
+                size_t slot = state.jumps.items[i].slot;
+                int distance;
+
+                memcpy(&distance, state.code.items + slot, sizeof distance);
+                size_t target = slot + sizeof (int) + distance;
+
+                /*
+                 * Bounded, since an empty infinite loop is a jump to itself.
+                 */
+                for (int hops = 0; hops < 8; ++hops) {
+                        struct jump const *j = find_jump(target);
+                        if (j == NULL || state.code.items[j->instr] != INSTR_JUMP) {
+                                break;
+                        }
+                        memcpy(&distance, state.code.items + j->slot, sizeof distance);
+                        target = j->slot + sizeof (int) + distance;
+                }
+
+                distance = target - slot - sizeof (int);
+                memcpy(state.code.items + slot, &distance, sizeof distance);
+        }
+}
+
+inline static bool
+inframe(int symbol)
+{
+        return slots.items[symbol] != -1 && !captured.items[symbol];
+}
+
+static void
+emit_load(int symbol, bool local)
+{
+        if (!local) {
+                emit_instr(INSTR_LOAD_UPVALUE);
+                emit_int(upvalue(symbol));
+        } else if (inframe(symbol)) {
+                emit_instr(INSTR_LOAD_LOCAL);
+                emit_int(slots.items[symbol]);
+        } else {
+                emit_instr(INSTR_LOAD_VAR);
+                emit_symbol(symbol);
+        }
+}
+
+static void
+emit_target_symbol(int symbol, bool local)
+{
+        if (!local) {
+                emit_instr(INSTR_TARGET_UPVALUE);
+                emit_int(upvalue(symbol));
+        } else if (inframe(symbol)) {
+                emit_instr(INSTR_TARGET_LOCAL);
+                emit_int(slots.items[symbol]);
+        } else {
+                emit_instr(INSTR_TARGET_VAR);
+                emit_symbol(symbol);
         }
 }
 
@@ -803,34 +1277,48 @@ emit_function(struct expression const *e)
         assert(e->type == EXPRESSION_FUNCTION);
         
         /*
-         * Save the current reference and bound-symbols vectors so we can
+         * Save the current upvalue and bound-symbols vectors so we can
          * restore them after compiling the current function.
          */
-        reference_vector refs_save = state.refs;
+        symbol_vector upvalues_save = state.upvalues;
         symbol_vector syms_save = state.bound_symbols;
-        vec_init(state.refs);
-        state.bound_symbols.items = e->bound_symbols.items;
-        state.bound_symbols.count = e->bound_symbols.count;
+        vec_init(state.upvalues);
+        vec_init(state.bound_symbols);
         ++state.function_depth;
 
-
-        emit_int(e->bound_symbols.count);
+        /*
+         * Only the captured variables need to be bound to heap-allocated variables when the
+         * function is called; everything else lives in the frame.
+         */
         for (int i = 0; i < e->bound_symbols.count; ++i) {
-                LOG("bound sym: %d", e->bound_symbols.items[i]);
-                emit_symbol(e->bound_symbols.items[i]);
+                if (captured.items[e->bound_symbols.items[i]]) {
+                        vec_push(state.bound_symbols, e->bound_symbols.items[i]);
+                }
+        }
+
+        emit_int(state.bound_symbols.count);
+        for (int i = 0; i < state.bound_symbols.count; ++i) {
+                LOG("bound sym: %d", state.bound_symbols.items[i]);
+                emit_symbol(state.bound_symbols.items[i]);
         }
 
         /*
-         * Write an int to the emitted code just to make some room.
+         * Make room for the size of the function's code.
          */
-        size_t size_offset = state.code.count;
-        emit_int(0);
+        size_t size_offset = emit_zeroed(sizeof (int), sizeof (int));
 
         /*
-         * Remember where in the code this function's code begins so that we can compute
-         * the relative offset of references to non-local variables.
+         * Arguments are always passed in the first slots of the frame, so captured parameters
+         * have to be copied out into their variables.
          */
-        size_t start_offset = state.code.count;
+        for (int i = 0; i < e->param_symbols.count; ++i) {
+                if (captured.items[e->param_symbols.items[i]]) {
+                        emit_instr(INSTR_LOAD_LOCAL);
+                        emit_int(i);
+                        emit_instr(INSTR_STORE_VAR);
+                        emit_symbol(e->param_symbols.items[i]);
+                }
+        }
 
         emit_statement(e->body);
 
@@ -844,32 +1332,72 @@ emit_function(struct expression const *e)
         memcpy(state.code.items + size_offset, &bytes, sizeof (int));
 
         emit_int(e->param_symbols.count);
-        for (int i = 0; i < e->param_symbols.count; ++i) {
-                emit_symbol(e->param_symbols.items[i]);
+        emit_int(e->bound_symbols.count);
+
+        emit_int(state.upvalues.count);
+        for (int i = 0; i < state.upvalues.count; ++i) {
+                emit_symbol(state.upvalues.items[i]);
         }
 
-        emit_int(state.refs.count);
-        for (int i = 0; i < state.refs.count; ++i) {
-                emit_symbol(state.refs.items[i].symbol);
-                emit_symbol(state.refs.items[i].offset - start_offset);
+        /*
+         * Every evaluation of a function that captures nothing would produce the same closure,
+         * so INSTR_FUNCTION fills this one in the first time and then keeps pushing it.
+         */
+        if (state.upvalues.count == 0) {
+                emit_static_object(sizeof (struct function), _Alignof (struct function));
         }
 
-        state.refs = refs_save;
+        state.upvalues = upvalues_save;
         state.bound_symbols = syms_save;
         --state.function_depth;
 
         if (e->function_symbol != -1) {
-                emit_instr(INSTR_TARGET_VAR);
-                emit_symbol(e->function_symbol);
+                emit_target_symbol(e->function_symbol, true);
                 emit_instr(INSTR_ASSIGN);
         }
 }
 
-static void
-emit_conditional_statement(struct statement const *s)
+/*
+ * Emit a test of e followed by a jump which is taken if its truthiness is 'when'. A negated
+ * condition is tested directly with the opposite jump.
+ */
+static size_t
+emit_jump_on(struct expression const *e, bool when)
 {
-        emit_expression(s->conditional.cond);
-        PLACEHOLDER_JUMP(INSTR_JUMP_IF, then_branch);
+        while (e->type == EXPRESSION_PREFIX_BANG) {
+                e = e->operand;
+                when = !when;
+        }
+
+        emit_expression(e);
+
+        if (when) {
+                emit_instr(INSTR_JUMP_IF);
+        } else {
+                emit_instr(INSTR_JUMP_IF_NOT);
+        }
+
+        return jump_slot();
+}
+
+static void
+emit_conditional_statement(struct statement const *s)
+{
+        struct value cond;
+
+        /*
+         * Only the branch that can be taken is emitted.
+         */
+        if (constant(s->conditional.cond, &cond)) {
+                if (value_truthy(&cond)) {
+                        emit_statement(s->conditional.then_branch);
+                } else if (s->conditional.else_branch != NULL) {
+                        emit_statement(s->conditional.else_branch);
+                }
+                return;
+        }
+
+        size_t then_branch = emit_jump_on(s->conditional.cond, true);
 
         if (s->conditional.else_branch != NULL) {
                 emit_statement(s->conditional.else_branch);
@@ -887,9 +1415,14 @@ emit_conditional_statement(struct statement const *s)
 static void
 emit_conditional_expression(struct expression const *e)
 {
-        emit_expression(e->cond);
+        struct value cond;
 
-        PLACEHOLDER_JUMP(INSTR_JUMP_IF_NOT, false_branch);
+        if (constant(e->cond, &cond)) {
+                emit_expression(value_truthy(&cond) ? e->then : e->otherwise);
+                return;
+        }
+
+        size_t false_branch = emit_jump_on(e->cond, false);
 
         emit_expression(e->then);
 
@@ -905,6 +1438,13 @@ emit_conditional_expression(struct expression const *e)
 static void
 emit_and(struct expression const *left, struct expression const *right)
 {
+        struct value v;
+
+        if (constant(left, &v)) {
+                emit_expression(value_truthy(&v) ? right : left);
+                return;
+        }
+
         emit_expression(left);
         emit_instr(INSTR_DUP);
 
@@ -919,6 +1459,13 @@ emit_and(struct expression const *left, struct expression const *right)
 static void
 emit_or(struct expression const *left, struct expression const *right)
 {
+        struct value v;
+
+        if (constant(left, &v)) {
+                emit_expression(value_truthy(&v) ? left : right);
+                return;
+        }
+
         emit_expression(left);
         emit_instr(INSTR_DUP);
 
@@ -930,21 +1477,31 @@ emit_or(struct expression const *left, struct expression const *right)
         PATCH_JUMP(left_true);
 }
 
+/*
+ * Empty pieces are left out, and there's nothing to concatenate if only one is left.
+ */
 static void
 emit_special_string(struct expression const *e)
 {
-        emit_instr(INSTR_STRING);
-        emit_string(e->strings.items[0]);
+        int n = 0;
 
-        for (int i = 0; i < e->expressions.count; ++i) {
-                emit_expression(e->expressions.items[i]);
-                emit_instr(INSTR_TO_STRING);
-                emit_instr(INSTR_STRING);
-                emit_string(e->strings.items[i + 1]);
+        for (int i = 0; i <= e->expressions.count; ++i) {
+                if (i > 0) {
+                        emit_expression(e->expressions.items[i - 1]);
+                        emit_instr(INSTR_TO_STRING);
+                        n += 1;
+                }
+                if (e->strings.items[i][0] != '\0' || (n == 0 && i == e->expressions.count)) {
+                        emit_instr(INSTR_STRING);
+                        emit_string_literal(e->strings.items[i]);
+                        n += 1;
+                }
         }
 
-        emit_instr(INSTR_CONCAT_STRINGS);
-        emit_int(2 * e->expressions.count + 1);
+        if (n > 1) {
+                emit_instr(INSTR_CONCAT_STRINGS);
+                emit_int(n);
+        }
 }
 
 static void
@@ -955,16 +1512,29 @@ emit_while_loop(struct statement const *s)
         vec_init(state.continues);
         vec_init(state.breaks);
 
+        struct value cond;
+        bool forever = constant(s->while_loop.cond, &cond);
+
+        if (forever && !value_truthy(&cond)) {
+                state.continues = cont_save;
+                state.breaks = brk_save;
+                return;
+        }
+
         size_t begin = state.code.count;
+        size_t end;
 
-        emit_expression(s->while_loop.cond);
-        PLACEHOLDER_JUMP(INSTR_JUMP_IF_NOT, end);
+        if (!forever) {
+                end = emit_jump_on(s->while_loop.cond, false);
+        }
 
         emit_statement(s->while_loop.body);
 
         JUMP(begin);
 
-        PATCH_JUMP(end);
+        if (!forever) {
+                PATCH_JUMP(end);
+        }
 
         patch_loop_jumps(begin, state.code.count);
 
@@ -984,23 +1554,38 @@ emit_for_loop(struct statement const *s)
                 emit_statement(s->for_loop.init);
         }
 
+        struct value cond = BOOLEAN(true);
+        bool forever = s->for_loop.cond == NULL || constant(s->for_loop.cond, &cond);
+
+        if (forever && !value_truthy(&cond)) {
+                state.continues = cont_save;
+                state.breaks = brk_save;
+                return;
+        }
+
         PLACEHOLDER_JUMP(INSTR_JUMP, skip_next);
 
         size_t begin = state.code.count;
 
-        emit_expression(s->for_loop.next);
-        emit_instr(INSTR_POP);
+        if (s->for_loop.next != NULL) {
+                emit_discarded(s->for_loop.next);
+        }
 
         PATCH_JUMP(skip_next);
 
-        emit_expression(s->for_loop.cond);
-        PLACEHOLDER_JUMP(INSTR_JUMP_IF_NOT, end_jump);
+        size_t end_jump;
+
+        if (!forever) {
+                end_jump = emit_jump_on(s->for_loop.cond, false);
+        }
 
         emit_statement(s->for_loop.body);
 
         JUMP(begin);
 
-        PATCH_JUMP(end_jump);
+        if (!forever) {
+                PATCH_JUMP(end_jump);
+        }
 
         patch_loop_jumps(begin, state.code.count);
 
@@ -1020,10 +1605,9 @@ emit_try_match(struct expression const *pattern)
                 if (strcmp(pattern->identifier, "_") == 0) {
                         /* nothing to do */
                 } else {
+                        emit_target_symbol(pattern->symbol, true);
                         emit_instr(INSTR_TRY_ASSIGN_NON_NIL);
-                        emit_symbol(pattern->symbol);
-                        vec_push(state.match_fails, state.code.count);
-                        emit_int(0);
+                        vec_push(state.match_fails, jump_slot());
                 }
                 break;
         case EXPRESSION_VIEW_PATTERN:
@@ -1037,11 +1621,10 @@ emit_try_match(struct expression const *pattern)
         case EXPRESSION_ARRAY:
                 for (int i = 0; i < pattern->elements.count; ++i) {
                         if (pattern->elements.items[i]->type == EXPRESSION_MATCH_REST) {
+                                emit_target_symbol(pattern->elements.items[i]->symbol, true);
                                 emit_instr(INSTR_ARRAY_REST);
-                                emit_symbol(pattern->elements.items[i]->symbol);
                                 emit_int(i);
-                                vec_push(state.match_fails, state.code.count);
-                                emit_int(0);
+                                vec_push(state.match_fails, jump_slot());
 
                                 if (i + 1 != pattern->elements.count) {
                                         fail("the *<id> array-matching pattern must be the last pattern in the array");
@@ -1049,8 +1632,7 @@ emit_try_match(struct expression const *pattern)
                         } else {
                                 emit_instr(INSTR_TRY_INDEX);
                                 emit_int(i);
-                                vec_push(state.match_fails, state.code.count);
-                                emit_int(0);
+                                vec_push(state.match_fails, jump_slot());
 
                                 emit_try_match(pattern->elements.items[i]);
 
@@ -1061,17 +1643,15 @@ emit_try_match(struct expression const *pattern)
                 if (pattern->elements.count == 0 || pattern->elements.items[pattern->elements.count - 1]->type != EXPRESSION_MATCH_REST) {
                         emit_instr(INSTR_ENSURE_LEN);
                         emit_int(pattern->elements.count);
-                        vec_push(state.match_fails, state.code.count);
-                        emit_int(0);
+                        vec_push(state.match_fails, jump_slot());
                 }
 
                 break;
         case EXPRESSION_TAG_APPLICATION:
                 emit_instr(INSTR_DUP);
                 emit_instr(INSTR_TRY_TAG_POP);
-                emit_int(pattern->tag);
-                vec_push(state.match_fails, state.code.count);
-                emit_int(0);
+                emit_tag(pattern->tag);
+                vec_push(state.match_fails, jump_slot());
 
                 emit_try_match(pattern->tagged);
 
@@ -1079,18 +1659,15 @@ emit_try_match(struct expression const *pattern)
                 break;
         case EXPRESSION_REGEX:
                 emit_instr(INSTR_TRY_REGEX);
-                emit_symbol((uintptr_t) pattern->regex);
-                emit_symbol((uintptr_t) pattern->extra);
-                vec_push(state.match_fails, state.code.count);
-                emit_int(0);
+                emit_regex(pattern);
+                vec_push(state.match_fails, jump_slot());
                 break;
         default:
                 emit_instr(INSTR_DUP);
                 emit_expression(pattern);
                 emit_instr(INSTR_EQ);
                 emit_instr(INSTR_JUMP_IF_NOT);
-                vec_push(state.match_fails, state.code.count);
-                emit_int(0);
+                vec_push(state.match_fails, jump_slot());
         }
 }
 
@@ -1107,8 +1684,7 @@ emit_case(struct expression const *pattern, struct expression const *condition,
         if (condition != NULL) {
                 emit_expression(condition);
                 emit_instr(INSTR_JUMP_IF_NOT);
-                failcond = state.code.count;
-                emit_int(0);
+                failcond = jump_slot();
         }
 
         emit_instr(INSTR_RESTORE_STACK_POS);
@@ -1116,8 +1692,7 @@ emit_case(struct expression const *pattern, struct expression const *condition,
         emit_statement(s);
 
         emit_instr(INSTR_JUMP);
-        vec_push(state.match_successes, state.code.count);
-        emit_int(0);
+        vec_push(state.match_successes, jump_slot());
 
         if (condition != NULL) {
                 PATCH_JUMP(failcond);
@@ -1142,8 +1717,7 @@ emit_expression_case(struct expression const *pattern, struct expression const *
         if (condition != NULL) {
                 emit_expression(condition);
                 emit_instr(INSTR_JUMP_IF_NOT);
-                failcond = state.code.count;
-                emit_int(0);
+                failcond = jump_slot();
         }
 
         /*
@@ -1159,8 +1733,7 @@ emit_expression_case(struct expression const *pattern, struct expression const *
          * to the end of the match expression. i.e., there is no fallthrough.
          */
         emit_instr(INSTR_JUMP);
-        vec_push(state.match_successes, state.code.count);
-        emit_int(0);
+        vec_push(state.match_successes, jump_slot());
 
         if (condition != NULL) {
                 PATCH_JUMP(failcond);
@@ -1344,20 +1917,16 @@ emit_each_loop(struct statement const *s)
         emit_instr(INSTR_PUSH_VAR);
         emit_symbol(counter_sym);
 
-        emit_instr(INSTR_TARGET_VAR);
+        emit_instr(INSTR_STORE_VAR);
         emit_symbol(array_sym);
-        emit_instr(INSTR_ASSIGN);
-        emit_instr(INSTR_POP);
 
         emit_instr(INSTR_INTEGER);
         emit_integer(-1);
 
         assert(array_sym != counter_sym);
 
-        emit_instr(INSTR_TARGET_VAR);
+        emit_instr(INSTR_STORE_VAR);
         emit_symbol(counter_sym);
-        emit_instr(INSTR_ASSIGN);
-        emit_instr(INSTR_POP);
 
         size_t begin = state.code.count;
 
@@ -1376,8 +1945,7 @@ emit_each_loop(struct statement const *s)
         struct expression array = { .type = EXPRESSION_IDENTIFIER, .symbol = array_sym, .local = true };
         struct expression index = { .type = EXPRESSION_IDENTIFIER, .symbol = counter_sym, .local = true };
         struct expression subscript = { .type = EXPRESSION_SUBSCRIPT, .container = &array, .subscript = &index };
-        emit_assignment(s->each.target, &subscript, 2);
-        emit_instr(INSTR_POP);
+        emit_assignment(s->each.target, &subscript, 2, false);
         emit_statement(s->each.body);
 
         JUMP(begin);
@@ -1395,18 +1963,12 @@ emit_target(struct expression *target)
 {
         switch (target->type) {
         case EXPRESSION_IDENTIFIER:
-                if (target->local) {
-                        emit_instr(INSTR_TARGET_VAR);
-                } else {
-                        emit_instr(INSTR_TARGET_REF);
-                        addref(target->symbol);
-                }
-                emit_symbol(target->symbol);
+                emit_target_symbol(target->symbol, target->local);
                 break;
         case EXPRESSION_MEMBER_ACCESS:
                 emit_expression(target->object);
                 emit_instr(INSTR_TARGET_MEMBER);
-                emit_string(target->member_name);
+                emit_member(target->member_name);
                 break;
         case EXPRESSION_SUBSCRIPT:
                 emit_expression(target->container);
@@ -1418,8 +1980,31 @@ emit_target(struct expression *target)
         }
 }
 
+/*
+ * Assign the value on top of the stack to target and pop it.
+ */
+static void
+emit_store(struct expression *target)
+{
+        if (target->type == EXPRESSION_IDENTIFIER && target->local) {
+                if (inframe(target->symbol)) {
+                        emit_instr(INSTR_STORE_LOCAL);
+                        emit_int(slots.items[target->symbol]);
+                } else {
+                        emit_instr(INSTR_STORE_VAR);
+                        emit_symbol(target->symbol);
+                }
+        } else {
+                emit_target(target);
+                emit_instr(INSTR_ASSIGN_POP);
+        }
+}
+
+/*
+ * Unless 'keep' is set, the assigned value isn't left on the stack.
+ */
 static void
-emit_assignment(struct expression *target, struct expression const *e, int i)
+emit_assignment(struct expression *target, struct expression const *e, int i, bool keep)
 {
         int tmp;
         struct expression container, subscript;
@@ -1430,14 +2015,18 @@ emit_assignment(struct expression *target, struct expression const *e, int i)
                 emit_expression(e);
                 emit_instr(INSTR_PUSH_VAR);
                 emit_symbol(tmp);
-                emit_instr(INSTR_TARGET_VAR);
-                emit_symbol(tmp);
-                emit_instr(INSTR_ASSIGN);
+                if (keep) {
+                        emit_instr(INSTR_TARGET_VAR);
+                        emit_symbol(tmp);
+                        emit_instr(INSTR_ASSIGN);
+                } else {
+                        emit_instr(INSTR_STORE_VAR);
+                        emit_symbol(tmp);
+                }
                 container = (struct expression){ .type = EXPRESSION_IDENTIFIER, .symbol = tmp, .local = true, .loc = {42, 42} };
                 for (int j = 0; j < target->elements.count; ++j) {
                         subscript = (struct expression){ .type = EXPRESSION_INTEGER, .integer = j, .loc = {42, 42} };
-                        emit_assignment(target->elements.items[j], &(struct expression){ .type = EXPRESSION_SUBSCRIPT, .container = &container, .subscript = &subscript, .loc = {42, 42}}, i + 1);
-                        emit_instr(INSTR_POP);
+                        emit_assignment(target->elements.items[j], &(struct expression){ .type = EXPRESSION_SUBSCRIPT, .container = &container, .subscript = &subscript, .loc = {42, 42}}, i + 1, false);
                 }
                 emit_instr(INSTR_POP_VAR);
                 emit_symbol(tmp);
@@ -1445,32 +2034,98 @@ emit_assignment(struct expression *target, struct expression const *e, int i)
         case EXPRESSION_TAG_APPLICATION:
                 emit_expression(e);
                 emit_instr(INSTR_UNTAG_OR_DIE);
-                emit_int(target->tag);
-                emit_target(target->tagged);
-                emit_instr(INSTR_ASSIGN);
+                emit_tag(target->tag);
+                if (keep) {
+                        emit_target(target->tagged);
+                        emit_instr(INSTR_ASSIGN);
+                } else {
+                        emit_store(target->tagged);
+                }
                 break;
         default:
                 emit_expression(e);
-                emit_target(target);
-                emit_instr(INSTR_ASSIGN);
+                if (keep) {
+                        emit_target(target);
+                        emit_instr(INSTR_ASSIGN);
+                } else {
+                        emit_store(target);
+                }
+        }
+}
+
+/*
+ * Emit e for its side effects only. Assignments store without leaving their value on the
+ * stack, and incrementing or decrementing a frame slot happens in place.
+ */
+static void
+emit_discarded(struct expression const *e)
+{
+        struct expression *target;
+
+        switch (e->type) {
+        case EXPRESSION_EQ:
+                state.loc = e->loc;
+                add_location(e);
+                emit_assignment(e->target, e->value, 0, false);
+                return;
+        case EXPRESSION_PREFIX_INC:
+        case EXPRESSION_POSTFIX_INC:
+        case EXPRESSION_PREFIX_DEC:
+        case EXPRESSION_POSTFIX_DEC:
+                target = e->operand;
+                if (target->type == EXPRESSION_IDENTIFIER && target->local && inframe(target->symbol)) {
+                        state.loc = e->loc;
+                        add_location(e);
+                        if (e->type == EXPRESSION_PREFIX_INC || e->type == EXPRESSION_POSTFIX_INC) {
+                                emit_instr(INSTR_INC_LOCAL);
+                        } else {
+                                emit_instr(INSTR_DEC_LOCAL);
+                        }
+                        emit_int(slots.items[target->symbol]);
+                        return;
+                }
+                break;
+        default:
+                break;
+        }
+
+        emit_expression(e);
+        emit_instr(INSTR_POP);
+}
+
+/*
+ * x + k for an integer constant k, which is usually a counter being bumped.
+ */
+static void
+emit_add_integer(struct expression const *x, intmax_t k)
+{
+        if (x->type == EXPRESSION_IDENTIFIER && x->local && inframe(x->symbol)) {
+                emit_instr(INSTR_ADD_LOCAL_INT);
+                emit_int(slots.items[x->symbol]);
+        } else {
+                emit_expression(x);
+                emit_instr(INSTR_ADD_INT);
         }
+
+        emit_integer(k);
 }
 
 static void
 emit_expression(struct expression const *e)
 {
+        struct value v;
+
         state.loc = e->loc;
         add_location(e);
 
+        if (constant(e, &v)) {
+                emit_constant(&v);
+                return;
+        }
+
         switch (e->type) {
         case EXPRESSION_IDENTIFIER:
-                if (e->local) {
-                        emit_instr(INSTR_LOAD_VAR);
-                } else {
-                        emit_instr(INSTR_LOAD_REF);
-                        addref(e->symbol);
-                }
-                emit_symbol(e->symbol);
+                emit_load(e->symbol, e->local);
                 break;
         case EXPRESSION_MATCH:
                 emit_match_expression(e);
@@ -1478,7 +2133,7 @@ emit_expression(struct expression const *e)
         case EXPRESSION_TAG_APPLICATION:
                 emit_expression(e->tagged);
                 emit_instr(INSTR_TAG_PUSH);
-                emit_int(e->tag);
+                emit_tag(e->tag);
                 break;
         case EXPRESSION_RANGE:
                 emit_expression(e->low);
@@ -1488,7 +2143,7 @@ emit_expression(struct expression const *e)
                 emit_int((e->flags & RANGE_EXCLUDE_RIGHT) ? -1 : 0);
                 break;
         case EXPRESSION_EQ:
-                emit_assignment(e->target, e->value, 0);
+                emit_assignment(e->target, e->value, 0, true);
                 break;
         case EXPRESSION_INTEGER:
                 emit_instr(INSTR_INTEGER);
@@ -1504,20 +2159,18 @@ emit_expression(struct expression const *e)
                 break;
         case EXPRESSION_STRING:
                 emit_instr(INSTR_STRING);
-                emit_string(e->string);
+                emit_string_literal(e->string);
                 break;
         case EXPRESSION_SPECIAL_STRING:
                 emit_special_string(e);
                 break;
         case EXPRESSION_TAG:
                 emit_instr(INSTR_TAG);
-                emit_int(e->tag);
+                emit_tag(e->tag);
                 break;
         case EXPRESSION_REGEX:
                 emit_instr(INSTR_REGEX);
-                emit_symbol((uintptr_t) e->regex);
-                emit_symbol((uintptr_t) e->extra);
-                emit_symbol((uintptr_t) e->pattern);
+                emit_regex(e);
                 break;
         case EXPRESSION_ARRAY:
                 for (int i = e->elements.count - 1; i >= 0; --i) {
@@ -1540,7 +2193,7 @@ emit_expression(struct expression const *e)
         case EXPRESSION_MEMBER_ACCESS:
                 emit_expression(e->object);
                 emit_instr(INSTR_MEMBER_ACCESS);
-                emit_string(e->member_name);
+                emit_member(e->member_name);
                 break;
         case EXPRESSION_SUBSCRIPT:
                 emit_expression(e->container);
@@ -1561,7 +2214,9 @@ emit_expression(struct expression const *e)
                 }
                 emit_expression(e->object);
                 emit_instr(INSTR_CALL_METHOD);
-                emit_string(e->method_name);
+                emit_member(e->method_name);
+                emit_pointer(RELOC_METHODS, (uintptr_t) get_string_method(e->method_name), e->method_name, strlen(e->method_name));
+                emit_word((uintptr_t) get_array_method(e->method_name));
                 emit_int(e->method_args.count);
                 break;
         case EXPRESSION_FUNCTION:
@@ -1572,6 +2227,10 @@ emit_expression(struct expression const *e)
                 emit_conditional_expression(e);
                 break;
         case EXPRESSION_PLUS:
+                if (constant(e->right, &v) && v.type == VALUE_INTEGER) {
+                        emit_add_integer(e->left, v.integer);
+                        break;
+                }
                 emit_expression(e->left);
                 emit_expression(e->right);
                 emit_instr(INSTR_ADD);
@@ -1660,24 +2319,28 @@ emit_expression(struct expression const *e)
                 emit_target(e->operand);
                 emit_instr(INSTR_POST_DEC);
                 break;
+        /*
+         * As with plain assignment, the value comes first: evaluating it could move the storage
+         * that the target points into (e.g. by adding a member to the same object).
+         */
         case EXPRESSION_PLUS_EQ:
-                emit_target(e->target);
                 emit_expression(e->value);
+                emit_target(e->target);
                 emit_instr(INSTR_MUT_ADD);
                 break;
         case EXPRESSION_STAR_EQ:
-                emit_target(e->target);
                 emit_expression(e->value);
+                emit_target(e->target);
                 emit_instr(INSTR_MUT_MUL);
                 break;
         case EXPRESSION_DIV_EQ:
-                emit_target(e->target);
                 emit_expression(e->value);
+                emit_target(e->target);
                 emit_instr(INSTR_MUT_DIV);
                 break;
         case EXPRESSION_MINUS_EQ:
-                emit_target(e->target);
                 emit_expression(e->value);
+                emit_target(e->target);
                 emit_instr(INSTR_MUT_SUB);
                 break;
         case EXPRESSION_LIST:
@@ -1722,12 +2385,10 @@ emit_statement(struct statement const *s)
                 emit_if_let(s);
                 break;
         case STATEMENT_EXPRESSION:
-                emit_expression(s->expression);
-                emit_instr(INSTR_POP);
+                emit_discarded(s->expression);
                 break;
         case STATEMENT_DEFINITION:
-                emit_assignment(s->target, s->value, 0);
-                emit_instr(INSTR_POP);
+                emit_assignment(s->target, s->value, 0, false);
                 break;
         case STATEMENT_RETURN:
                 if (state.function_depth == 0) {
@@ -1746,13 +2407,11 @@ emit_statement(struct statement const *s)
                 break;
         case STATEMENT_BREAK:
                 emit_instr(INSTR_JUMP);
-                vec_push(state.breaks, state.code.count);
-                emit_int(0);
+                vec_push(state.breaks, jump_slot());
                 break;
         case STATEMENT_CONTINUE:
                 emit_instr(INSTR_JUMP);
-                vec_push(state.continues, state.code.count);
-                emit_int(0);
+                vec_push(state.continues, jump_slot());
                 break;
         }
 }
@@ -1782,123 +2441,975 @@ get_module_scope(char const *name)
         return NULL;
 }
 
-static void
-import_module(char *name, char *as)
-{
-        LOG("IMPORTING %s AS %s", name, as);
-
-        struct scope *module_scope = get_module_scope(name);
+/*
+ * Compiled modules are cached next to their source (~/.plum/foo.plum is cached in
+ * ~/.plum/foo.plumc), and a cache is only used if it was written by this build of the compiler
+ * for exactly the same source.
+ *
+ * The file is the header, then a number of sections which describe the module's symbols,
+ * tags, scope, relocations and location info, and then the code itself. The file is mapped
+ * privately so that the code can be patched and run in place.
+ */
+#define CACHE_MAGIC      "plumc\0\0\1"
+#define CACHE_COMPILER   __DATE__ " " __TIME__
+#define CACHE_CODE_ALIGN 64
+
+struct cache_header {
+        char magic[8];
+        char compiler[24];
+        uint64_t builtins;
+        int64_t mtime;
+        int64_t mtime_ns;
+        int64_t size;
+        uint64_t hash;
+};
 
-        /* First make sure we haven't already imported this module, or imported another module
-         * with the same local alias.
-         *
-         * e.g.,
-         *
-         * import foo
-         * import foo
-         *
-         * and
-         *
-         * import foo as bar
-         * import baz as bar
-         *
-         * are both errors.
-         */
-        for (int i = 0; i < state.imports.count; ++i) {
-                if (strcmp(as, state.imports.items[i].name) == 0) {
-                        fail("there is already a module imported under the name '%s'", as);
-                }
-                if (state.imports.items[i].scope == module_scope) {
-                        fail("the module '%s' has already been imported", name);
-                }
-        }
+/*
+ * How a symbol or tag operand in cached code is resolved when the code is loaded.
+ */
+enum {
+        CACHED_OWN,
+        CACHED_EXTERNAL,
+};
 
-        /*
-         * If we've already generated code to load this module, we can skip to the part of the code
-         * where we add the module to the current scope.
-         */
-        if (module_scope != NULL) {
-                goto import;
-        }
+struct cached_symbol {
+        int slot;
+        int captured;
+        int public;
+};
 
-        char pathbuf[512];
-        char const *home = getenv("HOME");
-        if (home == NULL) {
-                fail("unable to get $HOME from the environment");
-        }
+struct cached_scope_entry {
+        char const *identifier;
+        int tag;
+        int index;
+};
 
-        snprintf(pathbuf, sizeof pathbuf, "%s/.plum/%s.plum", home, name);
+struct cached_reloc {
+        int kind;
+        int mode;
+        size_t offset;
+        int index;
+        char const *module;
+        char const *name;
+        int length;
+        uintptr_t value;
+};
 
-        char *source = slurp(pathbuf);
-        if (source == NULL) {
-                fail("failed to read file: %s", pathbuf);
-        }
+struct reader {
+        char const *p;
+        char const *end;
+        bool ok;
+};
 
-        struct statement **p = parse(source);
-        if (p == NULL) {
-                fail("while importing module %s: %s", name, parse_error());
+inline static uint64_t
+fnv1a(uint64_t h, void const *p, size_t n)
+{
+        unsigned char const *s = p;
+        while (n --> 0) {
+                h ^= *s++;
+                h *= 1099511628211ULL;
         }
 
-        /*
-         * Save the current compiler state so we can restore it after compiling
-         * this module.
-         */
-        struct state save = state;
-        state = freshstate();
+        return h;
+}
 
-        for (size_t i = 0; p[i] != NULL; ++i) {
-                symbolize_statement(state.global, p[i]);
-        }
+#define FNV_OFFSET 14695981039346656037ULL
 
-        emit_new_globals();
+/*
+ * Builtin symbols are saved as-is, so a cache is only good for a binary with the same builtins.
+ */
+static uint64_t
+builtins_fingerprint(void)
+{
+        uint64_t h = fnv1a(FNV_OFFSET, &builtin_count, sizeof builtin_count);
 
-        for (size_t i = 0; p[i] != NULL; ++i) {
-                emit_statement(p[i]);
+        for (int i = 0; i < global->identifiers.count; ++i) {
+                if (i < tagcount || global->symbols.items[i] < builtin_count) {
+                        char const *id = global->identifiers.items[i];
+                        h = fnv1a(h, id, strlen(id) + 1);
+                }
         }
 
-        emit_instr(INSTR_HALT);
-
-        /*
-         * Add all of the location information from this module to the
-         * global list.
-         */
-        patch_location_info();
-        vec_push(location_lists, state.expression_locations);
+        for (int i = 0; i < modules.count; ++i) {
+                if (modules.items[i].code != NULL) {
+                        continue;
+                }
+                h = fnv1a(h, modules.items[i].path, strlen(modules.items[i].path) + 1);
+                for (int j = 0; j < modules.items[i].scope->identifiers.count; ++j) {
+                        char const *id = modules.items[i].scope->identifiers.items[j];
+                        h = fnv1a(h, id, strlen(id) + 1);
+                }
+        }
 
-        module_scope = state.global;
-        
-        /*
-         * Mark it as external so that only public symbols can be used by other modules.
-         */
-        module_scope->external = true;
+        return h;
+}
 
-        struct module m = {
-                .path = name,
-                .code = state.code.items,
-                .scope = module_scope
+static struct cache_header
+cache_header(struct stat const *st, char const *source)
+{
+        struct cache_header h = {
+                .builtins = builtins_fingerprint(),
+                .mtime = st->st_mtim.tv_sec,
+                .mtime_ns = st->st_mtim.tv_nsec,
+                .size = st->st_size,
+                .hash = fnv1a(FNV_OFFSET, source, strlen(source))
         };
 
-        vec_push(modules, m);
-
-        state = save;
-
-        emit_instr(INSTR_EXEC_CODE);
-        emit_symbol((uintptr_t) m.code);
-
-import:
+        memcpy(h.magic, CACHE_MAGIC, sizeof h.magic);
+        strncpy(h.compiler, CACHE_COMPILER, sizeof h.compiler);
 
-        LOG("ADDING IMPORT WITH NAME: %s", as);
-        vec_push(state.imports, ((struct import){ .name = as, .scope = module_scope }));
+        return h;
 }
 
-char const *
-compiler_error(void)
+inline static void
+put_int(byte_vector *out, int k)
 {
-        return err_msg;
+        vec_push_n(*out, (char *) &k, sizeof k);
 }
 
-void
-compiler_init(void)
+inline static void
+put_string(byte_vector *out, char const *s, int n)
+{
+        put_int(out, n);
+        vec_push_n(*out, s, n);
+        vec_push(*out, '\0');
+}
+
+inline static int
+get_int(struct reader *r)
+{
+        int k = 0;
+
+        if (r->end - r->p < sizeof k) {
+                r->ok = false;
+                return 0;
+        }
+
+        memcpy(&k, r->p, sizeof k);
+        r->p += sizeof k;
+
+        return k;
+}
+
+inline static char const *
+get_string(struct reader *r, int *n)
+{
+        int k = get_int(r);
+
+        if (!r->ok || k < 0 || r->end - r->p <= k || r->p[k] != '\0') {
+                r->ok = false;
+                return "";
+        }
+
+        char const *s = r->p;
+        r->p += k + 1;
+
+        if (n != NULL) {
+                *n = k;
+        }
+
+        return s;
+}
+
+inline static bool
+istag(symbol_vector const *tags, int i)
+{
+        for (int j = 0; j < tags->count; ++j) {
+                if (tags->items[j] == i) {
+                        return true;
+                }
+        }
+
+        return false;
+}
+
+/*
+ * Find the global temporary or module-level name which refers to the symbol (or tag) 'value'.
+ */
+static bool
+find_external(int value, bool tag, char const **module, char const **name)
+{
+        for (int i = tagcount; !tag && i < global->identifiers.count; ++i) {
+                if (global->symbols.items[i] == value) {
+                        *module = "";
+                        *name = global->identifiers.items[i];
+                        return true;
+                }
+        }
+
+        for (int i = 0; i < modules.count; ++i) {
+                struct module const *m = &modules.items[i];
+                if (m->code == NULL) {
+                        continue;
+                }
+                for (int j = 0; j < m->scope->identifiers.count; ++j) {
+                        if (m->scope->symbols.items[j] == value && istag(&m->tags, j) == tag) {
+                                *module = m->path;
+                                *name = m->scope->identifiers.items[j];
+                                return true;
+                        }
+                }
+        }
+
+        return false;
+}
+
+/*
+ * The inverse of find_external().
+ */
+static bool
+resolve_external(char const *module, char const *name, bool tag, int *value)
+{
+        if (*module == '\0') {
+                if (tag) {
+                        return false;
+                }
+                if (locallydefined(global, name)) {
+                        *value = getsymbol(global, name, NULL);
+                } else {
+                        *value = addsymbol(global, sclone(name), false);
+                }
+                return true;
+        }
+
+        for (int i = 0; i < modules.count; ++i) {
+                struct module const *m = &modules.items[i];
+                if (m->code == NULL || strcmp(m->path, module) != 0) {
+                        continue;
+                }
+                for (int j = 0; j < m->scope->identifiers.count; ++j) {
+                        if (strcmp(m->scope->identifiers.items[j], name) != 0 || istag(&m->tags, j) != tag) {
+                                continue;
+                        }
+                        *value = m->scope->symbols.items[j];
+                        return tag || ispublic(*value);
+                }
+        }
+
+        return false;
+}
+
+static void
+put_operand(byte_vector *out, int mode, int index, char const *module, char const *name)
+{
+        put_int(out, mode);
+        if (mode == CACHED_OWN) {
+                put_int(out, index);
+        } else {
+                put_string(out, module, strlen(module));
+                put_string(out, name, strlen(name));
+        }
+}
+
+/*
+ * Write the cache for the module which has just been compiled into 'state'. This is best-effort:
+ * if anything about the module can't be expressed in the cache, or it can't be written, the
+ * module is simply compiled again next time.
+ */
+static void
+save_module(char const *path, char const *source, struct stat const *st, int begin)
+{
+        int end = symbol;
+        bool saved = false;
+
+        byte_vector out, relocs;
+        vec_init(out);
+        vec_init(relocs);
+
+        char *code = alloc(state.code.count);
+        memcpy(code, state.code.items, state.code.count);
+
+        /*
+         * Symbols allocated while this module was being compiled belong to it, unless they are
+         * global temporaries or belong to a module that it imported.
+         */
+        symbol_vector own;
+        vec_init(own);
+        for (int s = begin; s < end; ++s) {
+                vec_push(own, 0);
+        }
+        for (int i = tagcount; i < global->identifiers.count; ++i) {
+                int s = global->symbols.items[i];
+                if (s >= begin && s < end) {
+                        own.items[s - begin] = -1;
+                }
+        }
+        for (int i = 0; i < modules.count; ++i) {
+                for (int s = modules.items[i].symbols_begin; s < modules.items[i].symbols_end; ++s) {
+                        if (s >= begin && s < end) {
+                                own.items[s - begin] = -1;
+                        }
+                }
+        }
+
+        int nown = 0;
+        for (int i = 0; i < own.count; ++i) {
+                if (own.items[i] == 0) {
+                        own.items[i] = nown++;
+                }
+        }
+
+        struct cache_header h = cache_header(st, source);
+        vec_push_n(out, (char *) &h, sizeof h);
+
+        put_int(&out, state.imports.count);
+        for (int i = 0; i < state.imports.count; ++i) {
+                char const *dep = "";
+                for (int j = 0; j < modules.count; ++j) {
+                        if (modules.items[j].scope == state.imports.items[i].scope && modules.items[j].code != NULL) {
+                                dep = modules.items[j].path;
+                        }
+                }
+                put_string(&out, dep, strlen(dep));
+        }
+
+        put_int(&out, nown);
+        for (int s = begin; s < end; ++s) {
+                if (own.items[s - begin] != -1) {
+                        put_int(&out, slots.items[s]);
+                        put_int(&out, captured.items[s]);
+                        put_int(&out, ispublic(s));
+                }
+        }
+
+        put_int(&out, state.tags.count);
+        for (int i = 0; i < state.tags.count; ++i) {
+                char const *tag = state.global->identifiers.items[state.tags.items[i]];
+                put_string(&out, tag, strlen(tag));
+        }
+
+        put_int(&out, state.global->identifiers.count);
+        for (int i = 0; i < state.global->identifiers.count; ++i) {
+                char const *id = state.global->identifiers.items[i];
+                int value = state.global->symbols.items[i];
+                int index = -1;
+                for (int j = 0; j < state.tags.count; ++j) {
+                        if (state.tags.items[j] == i) {
+                                index = j;
+                        }
+                }
+                put_string(&out, id, strlen(id));
+                put_int(&out, index != -1);
+                put_int(&out, (index != -1) ? index : own.items[value - begin]);
+        }
+
+        int nrelocs = 0;
+        for (int i = 0; i < state.relocs.count; ++i) {
+                struct reloc const *r = &state.relocs.items[i];
+                char const *module, *name;
+                uintptr_t word;
+                int value, index, jump;
+
+                switch (r->kind) {
+                case RELOC_SYMBOL:
+                        memcpy(&word, code + r->offset, sizeof word);
+                        value = word;
+                        if (value < builtin_count) {
+                                continue;
+                        }
+                        put_int(&relocs, r->kind);
+                        put_int(&relocs, r->offset);
+                        if (value >= begin && value < end && own.items[value - begin] != -1) {
+                                put_operand(&relocs, CACHED_OWN, own.items[value - begin], NULL, NULL);
+                        } else if (find_external(value, false, &module, &name)) {
+                                put_operand(&relocs, CACHED_EXTERNAL, 0, module, name);
+                        } else {
+                                LOG("can't cache module %s: unknown symbol %d", path, value);
+                                goto end;
+                        }
+                        break;
+                case RELOC_TAG:
+                        memcpy(&value, code + r->offset, sizeof value);
+                        if (value <= tagcount) {
+                                continue;
+                        }
+                        put_int(&relocs, r->kind);
+                        put_int(&relocs, r->offset);
+                        for (index = 0; index < state.tags.count; ++index) {
+                                if (state.global->symbols.items[state.tags.items[index]] == value) {
+                                        break;
+                                }
+                        }
+                        if (index < state.tags.count) {
+                                put_operand(&relocs, CACHED_OWN, index, NULL, NULL);
+                        } else if (find_external(value, true, &module, &name)) {
+                                put_operand(&relocs, CACHED_EXTERNAL, 0, module, name);
+                        } else {
+                                LOG("can't cache module %s: unknown tag %d", path, value);
+                                goto end;
+                        }
+                        break;
+                case RELOC_STRING:
+                case RELOC_MEMBER:
+                case RELOC_METHODS:
+                        put_int(&relocs, r->kind);
+                        put_int(&relocs, r->offset);
+                        put_string(&relocs, r->name, r->length);
+                        memset(code + r->offset, 0, sizeof (uintptr_t) * (1 + (r->kind == RELOC_METHODS)));
+                        break;
+                case RELOC_REGEX:
+                        memcpy(&word, code + r->offset, sizeof word);
+                        unsigned long options;
+                        pcre_fullinfo(((struct regex *) word)->re, NULL, PCRE_INFO_OPTIONS, &options);
+                        put_int(&relocs, r->kind);
+                        put_int(&relocs, r->offset);
+                        put_string(&relocs, r->name, r->length);
+                        put_int(&relocs, options);
+                        memset(code + r->offset, 0, sizeof word);
+                        break;
+                case RELOC_MODULE:
+                        /*
+                         * Imported modules are loaded (and run) before this one when it's loaded
+                         * from the cache, so their INSTR_EXEC_CODE becomes a jump over its operand.
+                         */
+                        code[r->instr] = INSTR_JUMP;
+                        jump = (r->instr + sizeof (int)) & ~(sizeof (int) - 1);
+                        value = r->offset + sizeof (uintptr_t) - jump - sizeof (int);
+                        memcpy(code + jump, &value, sizeof value);
+                        continue;
+                }
+
+                ++nrelocs;
+        }
+
+        put_int(&out, nrelocs);
+        vec_push_n(out, relocs.items, relocs.count);
+
+        put_int(&out, state.expression_locations.count);
+        for (int i = 0; i < state.expression_locations.count; ++i) {
+                struct eloc const *loc = &state.expression_locations.items[i];
+                put_int(&out, loc->offset);
+                put_int(&out, loc->loc.line);
+                put_int(&out, loc->loc.col);
+        }
+
+        put_int(&out, state.code.count);
+        while (out.count % CACHE_CODE_ALIGN != 0) {
+                vec_push(out, 0);
+        }
+        vec_push_n(out, code, state.code.count);
+
+        char cachepath[512 + 1], tmppath[512 + 8];
+        snprintf(cachepath, sizeof cachepath, "%sc", path);
+        snprintf(tmppath, sizeof tmppath, "%s.XXXXXX", cachepath);
+
+        /*
+         * Other buffers may be loading the same module, so the cache is replaced atomically.
+         */
+        int fd = mkstemp(tmppath);
+        if (fd == -1) {
+                LOG("failed to create %s", tmppath);
+                goto end;
+        }
+
+        saved = write(fd, out.items, out.count) == out.count;
+        close(fd);
+
+        if (!saved || rename(tmppath, cachepath) != 0) {
+                unlink(tmppath);
+        }
+
+end:
+        LOG("%s cache for %s", saved ? "wrote" : "didn't write", path);
+        free(code);
+        vec_empty(own);
+        vec_empty(out);
+        vec_empty(relocs);
+}
+
+static struct module
+load_module(char const *name);
+
+/*
+ * Try to load the module 'name' from its cache. Nothing is changed until the whole cache has been
+ * read and checked, except that any modules it imports are loaded (and run) first.
+ */
+static bool
+load_cached_module(char const *name, char const *path, struct module *m)
+{
+        struct stat st, cst;
+        if (stat(path, &st) != 0) {
+                return false;
+        }
+
+        char cachepath[512 + 1];
+        snprintf(cachepath, sizeof cachepath, "%sc", path);
+
+        int fd = open(cachepath, O_RDONLY);
+        if (fd == -1) {
+                return false;
+        }
+
+        if (fstat(fd, &cst) != 0 || cst.st_size < sizeof (struct cache_header)) {
+                close(fd);
+                return false;
+        }
+
+        char *map = mmap(NULL, cst.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) {
+                return false;
+        }
+
+        vec(char const *) deps;
+        vec(struct cached_symbol) own;
+        vec(char const *) tags;
+        vec(struct cached_scope_entry) entries;
+        vec(struct cached_reloc) relocs;
+        location_vector locs;
+
+        vec_init(deps);
+        vec_init(own);
+        vec_init(tags);
+        vec_init(entries);
+        vec_init(relocs);
+        vec_init(locs);
+
+        struct reader r = { .p = map + sizeof (struct cache_header), .end = map + cst.st_size, .ok = true };
+        struct cache_header h;
+        memcpy(&h, map, sizeof h);
+
+        if (h.mtime != st.st_mtim.tv_sec || h.mtime_ns != st.st_mtim.tv_nsec || h.size != st.st_size) {
+                goto stale;
+        }
+
+        char *source = slurp(path);
+        if (source == NULL) {
+                goto stale;
+        }
+
+        struct cache_header expected = cache_header(&st, source);
+        free(source);
+
+        if (memcmp(&h, &expected, sizeof h) != 0) {
+                goto stale;
+        }
+
+        for (int i = 0, n = get_int(&r); r.ok && i < n; ++i) {
+                vec_push(deps, get_string(&r, NULL));
+        }
+
+        for (int i = 0, n = get_int(&r); r.ok && i < n; ++i) {
+                struct cached_symbol s;
+                s.slot = get_int(&r);
+                s.captured = get_int(&r);
+                s.public = get_int(&r);
+                vec_push(own, s);
+        }
+
+        for (int i = 0, n = get_int(&r); r.ok && i < n; ++i) {
+                vec_push(tags, get_string(&r, NULL));
+        }
+
+        for (int i = 0, n = get_int(&r); r.ok && i < n; ++i) {
+                struct cached_scope_entry e;
+                e.identifier = get_string(&r, NULL);
+                e.tag = get_int(&r);
+                e.index = get_int(&r);
+                if (e.index < 0 || e.index >= (e.tag ? tags.count : own.count)) {
+                        r.ok = false;
+                }
+                vec_push(entries, e);
+        }
+
+        for (int i = 0, n = get_int(&r); r.ok && i < n; ++i) {
+                struct cached_reloc c = { .kind = get_int(&r), .offset = get_int(&r) };
+                switch (c.kind) {
+                case RELOC_SYMBOL:
+                case RELOC_TAG:
+                        c.mode = get_int(&r);
+                        if (c.mode == CACHED_OWN) {
+                                c.index = get_int(&r);
+                                r.ok &= c.index >= 0 && c.index < (c.kind == RELOC_TAG ? tags.count : own.count);
+                        } else {
+                                c.module = get_string(&r, NULL);
+                                c.name = get_string(&r, NULL);
+                        }
+                        break;
+                case RELOC_REGEX:
+                        c.name = get_string(&r, &c.length);
+                        c.index = get_int(&r);
+                        break;
+                case RELOC_STRING:
+                case RELOC_MEMBER:
+                case RELOC_METHODS:
+                        c.name = get_string(&r, &c.length);
+                        break;
+                default:
+                        r.ok = false;
+                }
+                vec_push(relocs, c);
+        }
+
+        for (int i = 0, n = get_int(&r); r.ok && i < n; ++i) {
+                struct eloc loc = { .offset = get_int(&r), .filename = NULL };
+                loc.loc.line = get_int(&r);
+                loc.loc.col = get_int(&r);
+                vec_push(locs, loc);
+        }
+
+        int size = get_int(&r);
+        r.p = map + ((r.p - map + CACHE_CODE_ALIGN - 1) & ~(CACHE_CODE_ALIGN - 1));
+        if (!r.ok || size <= 0 || r.p > r.end || r.end - r.p != size) {
+                goto stale;
+        }
+
+        char *code = (char *) r.p;
+
+        for (int i = 0; i < relocs.count; ++i) {
+                size_t width;
+                switch (relocs.items[i].kind) {
+                case RELOC_TAG:     width = sizeof (int);                 break;
+                case RELOC_MEMBER:  width = sizeof (struct member_cache); break;
+                case RELOC_METHODS: width = 2 * sizeof (uintptr_t);       break;
+                default:            width = sizeof (uintptr_t);           break;
+                }
+                if (relocs.items[i].offset + width > size) {
+                        goto stale;
+                }
+        }
+
+        for (int i = 0; i < locs.count; ++i) {
+                if (locs.items[i].offset > size) {
+                        goto stale;
+                }
+        }
+
+        /*
+         * The cache is intact, so now load whatever it depends on. Those modules are run by the
+         * importing code, just before this one.
+         */
+        for (int i = 0; i < deps.count; ++i) {
+                if (*deps.items[i] != '\0' && get_module_scope(deps.items[i]) == NULL) {
+                        struct module d = load_module(sclone(deps.items[i]));
+                        emit_instr(INSTR_EXEC_CODE);
+                        emit_pointer(RELOC_MODULE, (uintptr_t) d.code, d.path, 0);
+                }
+        }
+
+        /*
+         * The names it refers to in other modules might not exist anymore, in which case it has to
+         * be compiled again to report the error.
+         */
+        for (int i = 0; i < relocs.count; ++i) {
+                struct cached_reloc *c = &relocs.items[i];
+                int value;
+
+                if ((c->kind != RELOC_SYMBOL && c->kind != RELOC_TAG) || c->mode != CACHED_EXTERNAL) {
+                        continue;
+                }
+
+                if (!resolve_external(c->module, c->name, c->kind == RELOC_TAG, &value)) {
+                        LOG("stale module cache %s: can't resolve %s::%s", cachepath, c->module, c->name);
+                        goto stale;
+                }
+
+                c->value = value;
+        }
+
+        /*
+         * The regexes come last, since they're the only thing here that has to be freed if the
+         * cache can't be used after all.
+         */
+        for (int i = 0; i < relocs.count; ++i) {
+                struct cached_reloc *c = &relocs.items[i];
+                char const *err;
+                int offset;
+
+                if (c->kind != RELOC_REGEX) {
+                        continue;
+                }
+
+                pcre *p = pcre_compile(c->name, c->index, &err, &offset, NULL);
+                if (p == NULL) {
+                        goto stale;
+                }
+
+                pcre_extra *extra = pcre_study(p, PCRE_STUDY_EXTRA_NEEDED | PCRE_STUDY_JIT_COMPILE, &err);
+                if (extra == NULL) {
+                        pcre_free(p);
+                        goto stale;
+                }
+
+                struct regex *re = alloc(sizeof *re);
+                re->re = p;
+                re->extra = extra;
+                re->pattern = sclone(c->name);
+                c->value = (uintptr_t) re;
+        }
+
+        int base = symbol;
+        for (int i = 0; i < own.count; ++i) {
+                vec_push(slots, own.items[i].slot);
+                vec_push(captured, own.items[i].captured);
+                if (own.items[i].public) {
+                        vec_push(public_symbols, base + i);
+                }
+                ++symbol;
+        }
+
+        symbol_vector newtags;
+        vec_init(newtags);
+        for (int i = 0; i < tags.count; ++i) {
+                vec_push(newtags, tags_new(tags.items[i]));
+        }
+
+        m->path = name;
+        m->code = code;
+        m->scope = newscope(global, false);
+        m->scope->external = true;
+        m->symbols_begin = base;
+        m->symbols_end = symbol;
+        vec_init(m->tags);
+
+        for (int i = 0; i < entries.count; ++i) {
+                struct cached_scope_entry const *e = &entries.items[i];
+                if (e->tag) {
+                        vec_push(m->tags, i);
+                }
+                vec_push(m->scope->identifiers, e->identifier);
+                vec_push(m->scope->symbols, e->tag ? newtags.items[e->index] : base + e->index);
+        }
+
+        for (int i = 0; i < relocs.count; ++i) {
+                struct cached_reloc const *c = &relocs.items[i];
+                struct member_cache *cache;
+                uintptr_t word;
+                int value;
+
+                switch (c->kind) {
+                case RELOC_SYMBOL:
+                        word = (c->mode == CACHED_OWN) ? base + c->index : c->value;
+                        memcpy(code + c->offset, &word, sizeof word);
+                        break;
+                case RELOC_TAG:
+                        value = (c->mode == CACHED_OWN) ? newtags.items[c->index] : c->value;
+                        memcpy(code + c->offset, &value, sizeof value);
+                        break;
+                case RELOC_STRING:
+                        word = (uintptr_t) value_intern_string(c->name, c->length);
+                        memcpy(code + c->offset, &word, sizeof word);
+                        break;
+                case RELOC_MEMBER:
+                        cache = (struct member_cache *)(code + c->offset);
+                        cache->name = value_intern_string(c->name, c->length)->data;
+                        cache->length = c->length;
+                        break;
+                case RELOC_METHODS:
+                        word = (uintptr_t) get_string_method(c->name);
+                        memcpy(code + c->offset, &word, sizeof word);
+                        word = (uintptr_t) get_array_method(c->name);
+                        memcpy(code + c->offset + sizeof word, &word, sizeof word);
+                        break;
+                case RELOC_REGEX:
+                        memcpy(code + c->offset, &c->value, sizeof c->value);
+                        break;
+                }
+        }
+
+        for (int i = 0; i < locs.count; ++i) {
+                locs.items[i].p = (uintptr_t)(code + locs.items[i].offset);
+        }
+        vec_push(location_lists, locs);
+
+        vec_push(modules, *m);
+        vec_push(maps, ((struct mapping){ .p = map, .n = cst.st_size }));
+
+        LOG("loaded %s from %s", name, cachepath);
+
+        vec_empty(newtags);
+        vec_empty(deps);
+        vec_empty(own);
+        vec_empty(tags);
+        vec_empty(entries);
+        vec_empty(relocs);
+
+        return true;
+
+stale:
+        LOG("not using module cache %s", cachepath);
+
+        for (int i = 0; i < relocs.count; ++i) {
+                struct cached_reloc const *c = &relocs.items[i];
+                if (c->kind == RELOC_REGEX && c->value != 0) {
+                        struct regex *re = (struct regex *) c->value;
+                        pcre_free_study(re->extra);
+                        pcre_free(re->re);
+                        free((char *) re->pattern);
+                        free(re);
+                }
+        }
+
+        munmap(map, cst.st_size);
+
+        vec_empty(deps);
+        vec_empty(own);
+        vec_empty(tags);
+        vec_empty(entries);
+        vec_empty(relocs);
+        vec_empty(locs);
+
+        return false;
+}
+
+static struct module
+compile_module(char const *name, char const *path)
+{
+        struct stat st;
+        bool cacheable = stat(path, &st) == 0;
+
+        char *source = slurp(path);
+        if (source == NULL) {
+                fail("failed to read file: %s", path);
+        }
+
+        struct statement **p = parse(source);
+        if (p == NULL) {
+                fail("while importing module %s: %s", name, parse_error());
+        }
+
+        /*
+         * Save the current compiler state so we can restore it after compiling
+         * this module.
+         */
+        struct state save = state;
+        state = freshstate();
+
+        int begin = symbol;
+
+        for (size_t i = 0; p[i] != NULL; ++i) {
+                symbolize_statement(state.global, p[i]);
+        }
+
+        emit_new_globals();
+
+        for (size_t i = 0; p[i] != NULL; ++i) {
+                emit_statement(p[i]);
+        }
+
+        emit_instr(INSTR_HALT);
+
+        thread_jumps();
+
+        if (cacheable) {
+                save_module(path, source, &st, begin);
+        }
+
+        /*
+         * Add all of the location information from this module to the
+         * global list.
+         */
+        patch_location_info();
+        vec_push(location_lists, state.expression_locations);
+
+        struct scope *module_scope = state.global;
+        
+        /*
+         * Mark it as external so that only public symbols can be used by other modules.
+         */
+        module_scope->external = true;
+
+        struct module m = {
+                .path = name,
+                .code = state.code.items,
+                .scope = module_scope,
+                .symbols_begin = begin,
+                .symbols_end = symbol,
+                .tags = state.tags
+        };
+
+        vec_push(modules, m);
+        vec_push(blocks, state.code.items);
+
+        state = save;
+
+        return m;
+}
+
+static struct module
+load_module(char const *name)
+{
+        char pathbuf[512];
+        char const *home = getenv("HOME");
+        if (home == NULL) {
+                fail("unable to get $HOME from the environment");
+        }
+
+        snprintf(pathbuf, sizeof pathbuf, "%s/.plum/%s.plum", home, name);
+
+        struct module m;
+        if (load_cached_module(name, pathbuf, &m)) {
+                return m;
+        }
+
+        return compile_module(name, pathbuf);
+}
+
+static void
+import_module(char *name, char *as)
+{
+        LOG("IMPORTING %s AS %s", name, as);
+
+        struct scope *module_scope = get_module_scope(name);
+
+        /* First make sure we haven't already imported this module, or imported another module
+         * with the same local alias.
+         *
+         * e.g.,
+         *
+         * import foo
+         * import foo
+         *
+         * and
+         *
+         * import foo as bar
+         * import baz as bar
+         *
+         * are both errors.
+         */
+        for (int i = 0; i < state.imports.count; ++i) {
+                if (strcmp(as, state.imports.items[i].name) == 0) {
+                        fail("there is already a module imported under the name '%s'", as);
+                }
+                if (state.imports.items[i].scope == module_scope) {
+                        fail("the module '%s' has already been imported", name);
+                }
+        }
+
+        /*
+         * If we've already generated code to load this module, we can skip to the part of the code
+         * where we add the module to the current scope.
+         */
+        if (module_scope != NULL) {
+                goto import;
+        }
+
+        /*
+         * Create the variables for the globals declared so far here, rather than in the module's
+         * code, so that the module only refers to its own.
+         */
+        emit_new_globals();
+
+        struct module m = load_module(name);
+        module_scope = m.scope;
+
+        emit_instr(INSTR_EXEC_CODE);
+        emit_pointer(RELOC_MODULE, (uintptr_t) m.code, name, 0);
+
+import:
+
+        LOG("ADDING IMPORT WITH NAME: %s", as);
+        vec_push(state.imports, ((struct import){ .name = as, .scope = module_scope }));
+}
+
+char const *
+compiler_error(void)
+{
+        return err_msg;
+}
+
+void
+compiler_init(void)
 {
         symbol = 0;
         builtin_count = 0;
@@ -1906,6 +3417,8 @@ compiler_init(void)
         global = newscope(NULL, false);
         vec_init(public_symbols);
         vec_init(modules);
+        vec_init(slots);
+        vec_init(captured);
 
         tags_init();
         for (int i = 0; i < tagcount; ++i) {
@@ -1916,6 +3429,48 @@ compiler_init(void)
         state = freshstate();
 }
 
+/*
+ * Free all of the compiled code, which must never be run again, along with the module table, the
+ * scopes and the tags.
+ */
+void
+compiler_destroy(void)
+{
+        for (int i = 0; i < blocks.count; ++i) {
+                free(blocks.items[i]);
+        }
+
+        for (int i = 0; i < maps.count; ++i) {
+                munmap(maps.items[i].p, maps.items[i].n);
+        }
+
+        for (int i = 0; i < location_lists.count; ++i) {
+                vec_empty(location_lists.items[i]);
+        }
+
+        for (int i = 0; i < modules.count; ++i) {
+                vec_empty(modules.items[i].tags);
+        }
+
+        for (int i = 0; i < scopes.count; ++i) {
+                vec_empty(scopes.items[i]->symbols);
+                vec_empty(scopes.items[i]->identifiers);
+                vec_empty(scopes.items[i]->func_symbols);
+                free(scopes.items[i]);
+        }
+
+        tags_destroy();
+
+        vec_empty(blocks);
+        vec_empty(maps);
+        vec_empty(scopes);
+        vec_empty(location_lists);
+        vec_empty(modules);
+        vec_empty(public_symbols);
+        vec_empty(slots);
+        vec_empty(captured);
+}
+
 /*
  * This name kind of sucks.
  */
@@ -1947,8 +3502,10 @@ char *
 compiler_compile_source(char const *source, int *symbols, char const *filename)
 {
         vec_init(state.code);
-        vec_init(state.refs);
+        vec_init(state.upvalues);
         vec_init(state.expression_locations);
+        vec_init(state.jumps);
+        vec_empty(state.relocs);
 
         state.filename = filename;
 
@@ -1976,9 +3533,12 @@ compiler_compile_source(char const *source, int *symbols, char const *filename)
 
         emit_instr(INSTR_HALT);
 
+        thread_jumps();
+
         add_location(NULL);
         patch_location_info();
         vec_push(location_lists, state.expression_locations);
+        vec_push(blocks, state.code.items);
 
         *symbols = symbol;
         return state.code.items;
@@ -2004,8 +3564,10 @@ compiler_get_location(char const *code, char const **file)
                 break;
         }
 
-        if (locs == NULL)
+        if (locs == NULL) {
+                *file = NULL;
                 return (struct location) { -1, -1 };
+        }
 
         /*
          * Now do a binary search within this group of locations.
@@ -2023,6 +3585,6 @@ compiler_get_location(char const *code, char const **file)
         while (lo > 0 && (lo >= locs->count || locs->items[lo].p >= c))
                 --lo;
 
-        *file = locs->items[lo].e->filename;
-        return locs->items[lo].e->loc;
+        *file = locs->items[lo].filename;
+        return locs->items[lo].loc;
 }
@@ -1,9 +1,15 @@
+#define _GNU_SOURCE
+
 #include <assert.h>
 #include <signal.h>
 #include <unistd.h>
 
 #include <ncurses.h>
-#include <poll.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/epoll.h>
 
 #include "editor.h"
 #include "buffer.h"
@@ -36,7 +42,13 @@ newbuffer(struct editor *e)
         *b = buffer_new(e->nbufs++);
         vec_push(e->buffers, b);
 
-        vec_push(e->pollfds, ((struct pollfd){ .fd = b->read_fd, .events = POLLIN }));
+        /*
+         * The buffer itself is stored with its fd, so that when it has something for us
+         * we know who sent it without having to look it up.
+         */
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = b };
+        if (epoll_ctl(e->epfd, EPOLL_CTL_ADD, b->read_fd, &ev) != 0)
+                panic("epoll_ctl() failed: %s", strerror(errno));
 
         return b;
 }
@@ -77,27 +89,14 @@ findbuffer(struct editor *e, unsigned id)
 }
 
 /*
- * Binary search for a buffer given a buffer fd.
+ * Send the result of the request with id 'request' back to the buffer 'b'.
  */
-static struct buffer *
-findbyfd(struct editor *e, int fd)
+inline static void
+respond(struct buffer *b, int request, int result)
 {
-        int lo = 0;
-        int hi = vec_len(e->buffers) - 1;
-
-        while (lo <= hi) {
-                int mid = lo/2 + hi/2 + (hi & lo & 1);
-                struct buffer *b = *vec_get(e->buffers, mid);
-                if (b->read_fd > fd) {
-                        hi = mid - 1;
-                } else if (b->read_fd < fd) {
-                        lo = mid + 1;
-                } else {
-                        return b;
-                }
-        }
-
-        return NULL;
+        evt_send(b->write_fd, EVT_RESPONSE);
+        sendint(b->write_fd, request);
+        sendint(b->write_fd, result);
 }
 
 /*
@@ -108,12 +107,14 @@ handle_event(struct editor *e, buffer_event_code c, struct buffer *b)
 {
         static struct window *window;
         static struct buffer *buffer;
-        static char buf[4096];
-        static char msgbuf[256];
-        static int bytes, msgbytes;
+        static char buf[MESSAGE_INLINE_MAX];
+        static vec(char) msgtype;
+        static int bytes, msgbytes, msglen;
+        static int fd;
         static int amount;
         static int id;
         static int size;
+        static int request;
 
         void (*split)(struct window *, struct buffer *, int);
 
@@ -177,29 +178,23 @@ handle_event(struct editor *e, buffer_event_code c, struct buffer *b)
         if (0)
         case EVT_VSPLIT:
                 split = window_vsplit;
+                request = recvint(b->read_fd);
+                id = recvint(b->read_fd);
+                size = recvint(b->read_fd);
+                buffer = NULL;
                 if (b->window != NULL) {
-                        id = recvint(b->read_fd);
-                        size = recvint(b->read_fd);
                         buffer = (id == -1) ? newbuffer(e) : findbuffer(e, id);
-
-                        if (buffer == NULL) {
-                                evt_send(b->write_fd, EVT_WINDOW_ID);
-                                sendint(b->write_fd, -1);
-                        } else {
+                        if (buffer != NULL) {
                                 split(b->window, buffer, size);
                                 e->current_window = b->window;
-                                evt_send(b->write_fd, EVT_WINDOW_ID);
-                                sendint(b->write_fd, WINDOW_SIBLING(b->window)->id);
                         }
                 }
+                respond(b, request, (buffer == NULL) ? -1 : (int) WINDOW_SIBLING(b->window)->id);
                 ++e->render;
                 break;
         case EVT_WINDOW_ID:
-                evt_send(b->write_fd, EVT_WINDOW_ID);
-                if (b->window == NULL)
-                        sendint(b->write_fd, -1);
-                else
-                        sendint(b->write_fd, b->window->id);
+                request = recvint(b->read_fd);
+                respond(b, request, (b->window == NULL) ? -1 : (int) b->window->id);
                 break;
         case EVT_WINDOW_DELETE:
                 deletewindow(e, b->window);
@@ -224,12 +219,22 @@ handle_event(struct editor *e, buffer_event_code c, struct buffer *b)
         case EVT_MESSAGE:
                 id = recvint(b->read_fd);
                 msgbytes = recvint(b->read_fd);
-                read(b->read_fd, msgbuf, msgbytes);
+                vec_reserve(msgtype, msgbytes);
+                read(b->read_fd, msgtype.items, msgbytes);
+
+                /*
+                 * Large payloads arrive as a memfd, and all we do is pass the fd along.
+                 */
                 bytes = recvint(b->read_fd);
-                if (bytes != -1)
+                if (bytes == MESSAGE_FD)
+                        fd = recvfd(b->read_fd, &msglen);
+                else if (bytes != MESSAGE_NIL)
                         read(b->read_fd, buf, bytes);
+
                 buffer = findbuffer(e, id);
                 if (buffer == NULL) {
+                        if (bytes == MESSAGE_FD)
+                                close(fd);
                         evt_send(e->console->write_fd, EVT_LOG);
                         bytes = sprintf(buf, "Invalid buffer ID used as message target: %d", id);
                         sendint(e->console->write_fd, bytes);
@@ -240,24 +245,28 @@ handle_event(struct editor *e, buffer_event_code c, struct buffer *b)
                         sendint(buffer->write_fd, b->id);
 
                         sendint(buffer->write_fd, msgbytes);
-                        write(buffer->write_fd, msgbuf, msgbytes);
+                        write(buffer->write_fd, msgtype.items, msgbytes);
 
                         sendint(buffer->write_fd, bytes);
-                        if (bytes != -1)
+                        if (bytes == MESSAGE_FD) {
+                                sendfd(buffer->write_fd, fd, msglen);
+                                close(fd);
+                        } else if (bytes != MESSAGE_NIL) {
                                 write(buffer->write_fd, buf, bytes);
+                        }
                 }
                 break;
         case EVT_NEW_BUFFER:
-                buffer = newbuffer(e);
+                request = recvint(b->read_fd);
+                bytes = recvint(b->read_fd);
+                if (bytes != -1)
+                        read(b->read_fd, buf, bytes);
 
-                evt_send(b->write_fd, EVT_NEW_BUFFER);
-                sendint(b->write_fd, buffer->id);
+                buffer = newbuffer(e);
+                respond(b, request, buffer->id);
 
-                bytes = recvint(b->read_fd);
                 if (bytes == -1)
                         break;
-                else
-                        read(b->read_fd, buf, bytes);
 
                 evt_send(buffer->write_fd, EVT_RUN_PROGRAM);
                 sendint(buffer->write_fd, bytes);
@@ -290,9 +299,19 @@ editor_init(struct editor *e, int lines, int cols)
 {
         e->nbufs = 0;
         vec_init(e->buffers);
+#ifdef PLUM_THREADED_BUFFERS
+        vec_init(e->zombies);
+#endif
+
+        /*
+         * stdin is the only thing in the epoll set which isn't a buffer, so it gets a NULL pointer.
+         */
+        if (e->epfd = epoll_create1(EPOLL_CLOEXEC), e->epfd == -1)
+                panic("epoll_create1() failed: %s", strerror(errno));
 
-        vec_init(e->pollfds);
-        vec_push(e->pollfds, ((struct pollfd){ .fd = 0, .events = POLLIN }));
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+        if (epoll_ctl(e->epfd, EPOLL_CTL_ADD, 0, &ev) != 0)
+                panic("epoll_ctl() failed: %s", strerror(errno));
 
         e->root_window = window_root(0, 1, cols, lines - 1);
         e->current_window = e->root_window;
@@ -308,25 +327,110 @@ editor_init(struct editor *e, int lines, int cols)
         e->background = false;
 }
 
+#ifdef PLUM_THREADED_BUFFERS
+/*
+ * Wait until 'deadline' for the thread running 'b' to finish, and then free 'b'. A buffer thread
+ * can't be killed like a process can, so one that's still busy running a script becomes a zombie
+ * until it gets around to the shutdown event, and update() keeps trying to join it.
+ */
+static void
+reap(struct editor *e, struct buffer *b, struct timespec const *deadline)
+{
+        if (pthread_timedjoin_np(b->thread, NULL, deadline) == 0) {
+                buffer_free(b);
+                free(b);
+        } else {
+                vec_push(e->zombies, b);
+        }
+}
+
+static void
+reap_zombies(struct editor *e)
+{
+        struct buffer *b;
+
+        for (size_t i = 0; i < e->zombies.count;) {
+                b = e->zombies.items[i];
+                if (pthread_tryjoin_np(b->thread, NULL) == 0) {
+                        vec_pop_ith(e->zombies, i, b);
+                        buffer_free(b);
+                        free(b);
+                } else {
+                        ++i;
+                }
+        }
+}
+
+static struct timespec
+shutdown_deadline(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+
+        ts.tv_sec += BUFFER_SHUTDOWN_MS / 1000;
+        ts.tv_nsec += (BUFFER_SHUTDOWN_MS % 1000) * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+                ts.tv_sec += 1;
+                ts.tv_nsec -= 1000000000L;
+        }
+
+        return ts;
+}
+#endif
+
 /*
- * Kill the process running the buffer whose id is 'buf_id'.
+ * Stop the process (or thread) running the buffer whose id is 'buf_id', and forget about it. A
+ * buffer thread gets EVT_SHUTDOWN, and frees everything it has and closes its fds before it
+ * returns. The buffer mustn't be in a window, since its render buffers go with it.
  */
 void
 editor_destroy_buffer(struct editor *e, unsigned buf_id)
 {
         struct buffer *b = findbuffer(e, buf_id);
         assert(b != NULL);
+        assert(b->window == NULL);
 
+        for (size_t i = 0; i < e->buffers.count; ++i) {
+                if (e->buffers.items[i] == b) {
+                        vec_pop_ith(e->buffers, i, b);
+                        break;
+                }
+        }
+
+        epoll_ctl(e->epfd, EPOLL_CTL_DEL, b->read_fd, NULL);
+
+#ifdef PLUM_THREADED_BUFFERS
+        evt_send(b->write_fd, EVT_SHUTDOWN);
+        struct timespec deadline = shutdown_deadline();
+        reap(e, b, &deadline);
+#else
         kill(b->pid, SIGTERM);
+        buffer_free(b);
+        free(b);
+#endif
 }
 
 void
 editor_destroy_all_buffers(struct editor *e)
 {
         struct buffer **b;
+
+#ifdef PLUM_THREADED_BUFFERS
+        vec_for_each(e->buffers, _, b) {
+                evt_send(b[0]->write_fd, EVT_SHUTDOWN);
+        }
+
+        struct timespec deadline = shutdown_deadline();
+        vec_for_each(e->buffers, _, b) {
+                reap(e, b[0], &deadline);
+        }
+
+        vec_empty(e->buffers);
+#else
         vec_for_each(e->buffers, _, b) {
                 kill(b[0]->pid, SIGTERM);
         }
+#endif
 }
 
 void
@@ -346,37 +450,51 @@ void
 editor_background(struct editor *e)
 {
         e->background = true;
-        e->pollfds.items[0].events &= ~POLLIN;
-        e->pollfds.items[0].revents = 0;
+        epoll_ctl(e->epfd, EPOLL_CTL_MOD, 0, &(struct epoll_event){ .events = 0, .data.ptr = NULL });
 }
 
 void
 editor_foreground(struct editor *e)
 {
         e->background = false;
-        e->pollfds.items[0].events |= POLLIN;
+        epoll_ctl(e->epfd, EPOLL_CTL_MOD, 0, &(struct epoll_event){ .events = EPOLLIN, .data.ptr = NULL });
         window_touch(e->root_window);
         render(e);
 }
 
 /*
- * Check the pipe of each buffer process to see if any of them have
- * sent any data to us.
+ * Wait until the terminal or some buffer processes have
+ * sent any data to us, and handle it.
  */
 inline static void
 update(struct editor *e)
 {
-        int const n = e->pollfds.count;
+        struct epoll_event events[EDITOR_MAX_EVENTS];
+        int timeout = -1;
 
-        poll(e->pollfds.items, n, -1);
-
-        if (e->pollfds.items[0].revents & POLLIN)
-                term_handle_input();
-
-        for (int i = 1; i < n; ++i) {
-                if (e->pollfds.items[i].revents & POLLIN) {
-                        int fd = e->pollfds.items[i].fd;
-                        handle_event(e, evt_recv(fd), findbyfd(e, fd));
+#ifdef PLUM_THREADED_BUFFERS
+        if (e->zombies.count != 0) {
+                reap_zombies(e);
+                timeout = BUFFER_SHUTDOWN_MS;
+        }
+#endif
+
+        int n = epoll_wait(e->epfd, events, EDITOR_MAX_EVENTS, timeout);
+
+        for (int i = 0; i < n; ++i) {
+                if (!(events[i].events & EPOLLIN))
+                        continue;
+
+                /*
+                 * An earlier event in this batch may have backgrounded the editor, in
+                 * which case stdin belongs to someone else now.
+                 */
+                struct buffer *b = events[i].data.ptr;
+                if (b == NULL) {
+                        if (!e->background)
+                                term_handle_input();
+                } else {
+                        handle_event(e, evt_recv(b->read_fd), b);
                 }
         }
 }
@@ -6,13 +6,17 @@
 
 #include "tags.h"
 #include "value.h"
+#include "object.h"
 #include "vm.h"
 #include "buffer.h"
 #include "log.h"
 #include "util.h"
+#include "alloc.h"
 #include "json.h"
+#include "gc.h"
+#include "tls.h"
 
-static char buffer[1024];
+static TLS char buffer[1024];
 
 #define ASSERT_ARGC(func, argc) \
         if (args->count != (argc)) { \
@@ -155,7 +159,7 @@ builtin_str(value_vector *args)
         ASSERT_ARGC_2("str()", 0, 1);
 
         if (args->count == 0) {
-                return STRING_NOGC(NULL, 0);
+                return STRING_CLONE("", 0);
         }
 
         struct value arg = args->items[0];
@@ -202,11 +206,12 @@ builtin_regex(value_vector *args)
         if (extra == NULL)
                 return NIL;
 
-        struct value regex = REGEX(re);
-        regex.extra = extra;
-        regex.pattern = sclone(buffer);
+        struct regex *r = alloc(sizeof *r);
+        r->re = re;
+        r->extra = extra;
+        r->pattern = sclone(buffer);
 
-        return regex;
+        return REGEX(r);
 }
 
 struct value
@@ -273,7 +278,7 @@ builtin_getenv(value_vector *args)
         if (val == NULL)
                 return NIL;
         else
-                return STRING_NOGC(val, strlen(val));
+                return STRING_CLONE(val, strlen(val));
 }
 
 struct value
@@ -288,6 +293,65 @@ builtin_json_parse(value_vector *args)
         return json_parse(json.string, json.bytes);
 }
 
+struct value
+builtin_gc_set_max_pause(value_vector *args)
+{
+        ASSERT_ARGC("gc::setMaxPause()", 1);
+
+        struct value us = args->items[0];
+
+        if (us.type != VALUE_INTEGER || us.integer <= 0)
+                vm_panic("gc::setMaxPause() expects a positive number of microseconds");
+
+        gc_set_max_pause(us.integer);
+
+        return NIL;
+}
+
+/*
+ * Element i of the result is the number of GC pauses which lasted less than 2^i microseconds
+ * (and at least 2^(i - 1)).
+ */
+struct value
+builtin_gc_pauses(value_vector *args)
+{
+        ASSERT_ARGC("gc::pauses()", 0);
+
+        int n;
+        unsigned const *pauses = gc_pauses(&n);
+        struct value result = ARRAY(value_array_new());
+
+        for (int i = 0; i < n; ++i) {
+                value_array_push(result.array, INTEGER(pauses[i]));
+        }
+
+        return result;
+}
+
+struct value
+builtin_gc_stats(value_vector *args)
+{
+        ASSERT_ARGC("gc::stats()", 0);
+
+        struct gc_stats stats = gc_stats();
+        struct value result = OBJECT(object_new());
+
+        object_put_member(result.object, "minor",          INTEGER(stats.minor));
+        object_put_member(result.object, "major",          INTEGER(stats.major));
+        object_put_member(result.object, "parallel",       INTEGER(stats.parallel));
+        object_put_member(result.object, "pauseTotal",     INTEGER(stats.pause_total));
+        object_put_member(result.object, "pauseMax",       INTEGER(stats.pause_max));
+        object_put_member(result.object, "live",           INTEGER(stats.live));
+        object_put_member(result.object, "promoted",       INTEGER(stats.promoted));
+        object_put_member(result.object, "nursery",        INTEGER(stats.nursery));
+        object_put_member(result.object, "allocated",      INTEGER(stats.allocated));
+        object_put_member(result.object, "allocationRate", REAL(stats.allocation_rate));
+        object_put_member(result.object, "marking",        BOOLEAN(stats.marking));
+        object_put_member(result.object, "unswept",        INTEGER(stats.unswept));
+
+        return result;
+}
+
 struct value
 builtin_editor_insert(value_vector *args)
 {
@@ -864,7 +928,7 @@ builtin_editor_next_match(value_vector *args)
         struct value pattern = args->items[0];
 
         if (pattern.type == VALUE_REGEX)
-                return BOOLEAN(buffer_next_match_regex(pattern.regex, pattern.extra));
+                return BOOLEAN(buffer_next_match_regex(pattern.regex->re, pattern.regex->extra));
         else if (pattern.type == VALUE_STRING)
                 return BOOLEAN(buffer_next_match_string(pattern.string, pattern.bytes));
         else
@@ -1056,10 +1120,11 @@ builtin_editor_show_console(value_vector *args)
 struct value
 builtin_editor_horizontal_split(value_vector *args)
 {
-        ASSERT_ARGC_3("window::horizontalSplit()", 0, 1, 2);
+        if (args->count > 3)
+                vm_panic("window::horizontalSplit() expects 0, 1, 2, or 3 argument(s) but got %zu", args->count);
 
         if (args->count == 0)
-                return INTEGER(buffer_horizontal_split(-1, -1));
+                return INTEGER(buffer_horizontal_split(-1, -1, NIL));
 
         struct value buffer = args->items[0];
         if (buffer.type == VALUE_NIL)
@@ -1067,27 +1132,38 @@ builtin_editor_horizontal_split(value_vector *args)
         else if (buffer.type != VALUE_INTEGER)
                 vm_panic("non-integer passed as first argument to window::horizontalSplit()");
 
-        int size;
-        if (args->count == 2) {
+        int size = -1;
+        if (args->count >= 2 && args->items[1].type != VALUE_NIL) {
                 struct value sz = args->items[1];
                 if (sz.type != VALUE_INTEGER)
                         vm_panic("non-integer passed as second argument to window::horizontalSplit()");
                 size = sz.integer;
-        } else {
-                size = -1;
         }
 
-        return INTEGER(buffer_horizontal_split(buffer.integer, size));
+        /*
+         * With a callback, don't wait for the new window: return nil, and call the callback
+         * with the window's id once the editor has created it.
+         */
+        struct value callback = NIL;
+        if (args->count == 3) {
+                callback = args->items[2];
+                if (callback.type != VALUE_FUNCTION && callback.type != VALUE_BUILTIN_FUNCTION)
+                        vm_panic("non-function passed as third argument to window::horizontalSplit()");
+                buffer_horizontal_split(buffer.integer, size, callback);
+                return NIL;
+        }
 
+        return INTEGER(buffer_horizontal_split(buffer.integer, size, NIL));
 }
 
 struct value
 builtin_editor_vertical_split(value_vector *args)
 {
-        ASSERT_ARGC_3("window::verticalSplit()", 0, 1, 2);
+        if (args->count > 3)
+                vm_panic("window::verticalSplit() expects 0, 1, 2, or 3 argument(s) but got %zu", args->count);
 
         if (args->count == 0)
-                return INTEGER(buffer_vertical_split(-1, -1));
+                return INTEGER(buffer_vertical_split(-1, -1, NIL));
 
         struct value buffer = args->items[0];
         if (buffer.type == VALUE_NIL)
@@ -1095,17 +1171,28 @@ builtin_editor_vertical_split(value_vector *args)
         else if (buffer.type != VALUE_INTEGER)
                 vm_panic("non-integer passed as first argument to window::verticalSplit()");
 
-        int size;
-        if (args->count == 2) {
+        int size = -1;
+        if (args->count >= 2 && args->items[1].type != VALUE_NIL) {
                 struct value sz = args->items[1];
                 if (sz.type != VALUE_INTEGER)
                         vm_panic("non-integer passed as second argument to window::verticalSplit()");
                 size = sz.integer;
-        } else {
-                size = -1;
         }
 
-        return INTEGER(buffer_vertical_split(buffer.integer, size));
+        /*
+         * With a callback, don't wait for the new window: return nil, and call the callback
+         * with the window's id once the editor has created it.
+         */
+        struct value callback = NIL;
+        if (args->count == 3) {
+                callback = args->items[2];
+                if (callback.type != VALUE_FUNCTION && callback.type != VALUE_BUILTIN_FUNCTION)
+                        vm_panic("non-function passed as third argument to window::verticalSplit()");
+                buffer_vertical_split(buffer.integer, size, callback);
+                return NIL;
+        }
+
+        return INTEGER(buffer_vertical_split(buffer.integer, size, NIL));
 }
 
 struct value
@@ -1197,12 +1284,12 @@ builtin_editor_buffer_id(value_vector *args)
 struct value
 builtin_editor_buffer_new(value_vector *args)
 {
-        ASSERT_ARGC_2("buffer::new()", 0, 1);
+        ASSERT_ARGC_3("buffer::new()", 0, 1, 2);
         
         char const *prog;
         int n;
 
-        if (args->count == 1) {
+        if (args->count >= 1 && args->items[0].type != VALUE_NIL) {
                 struct value program = args->items[0];
                 if (program.type != VALUE_STRING)
                         vm_panic("non-string passed to buffer::new()");
@@ -1213,7 +1300,18 @@ builtin_editor_buffer_new(value_vector *args)
                 n = -1;
         }
 
-        return INTEGER(buffer_create(prog, n));
+        /*
+         * With a callback, return nil right away and pass the new buffer's id to the callback later.
+         */
+        if (args->count == 2) {
+                struct value callback = args->items[1];
+                if (callback.type != VALUE_FUNCTION && callback.type != VALUE_BUILTIN_FUNCTION)
+                        vm_panic("non-function passed as second argument to buffer::new()");
+                buffer_create(prog, n, callback);
+                return NIL;
+        }
+
+        return INTEGER(buffer_create(prog, n, NIL));
 }
 
 struct value
@@ -1,45 +1,1023 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <limits.h>
 #include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <unistd.h>
 
+#include "config.h"
+#include "panic.h"
 #include "value.h"
 #include "object.h"
 #include "vm.h"
 #include "log.h"
+#include "tls.h"
+#include "test.h"
 
+/*
+ * The heap has two generations. Everything is allocated young (see gc_new()), and a minor
+ * collection only traces and sweeps the young objects: it treats the variables and the old
+ * containers which have had something stored in them since (the remembered set) as roots, and
+ * doesn't look inside any other old object. An object which survives two collections becomes
+ * old, and old objects are only swept by a major collection, which happens once the old
+ * generation has grown to twice its live size (counted in bytes, including the storage owned by
+ * arrays and objects) after the last one. The nursery grows along with the old generation, so
+ * that a big heap isn't collected every few megabytes.
+ *
+ * Marking never recurses: a marked object is pushed onto the mark stack ('grays'), and popping it
+ * and marking its children is what traces it. In the usual tri-color terms, the objects on the
+ * stack are gray and the ones which have been traced are black.
+ *
+ * The old generation is marked incrementally, a slice at a time, mostly while the buffer is idle.
+ * Only old objects are marked in the slices, and the gray ones stay on the stack between them.
+ * The remembered set doubles as the write barrier: every old container which has been stored
+ * into since marking started stays in it until the end, when it is traced again along with the
+ * roots, the young objects and anything still gray.
+ *
+ * Once the heap is big enough, the tracing (both the slices and the end of a major collection) is
+ * shared with a few helper threads. Each thread has its own deque of gray objects, takes its work
+ * from the bottom of it, and steals half of another thread's deque from the top when it runs out.
+ * The buffer itself is stopped until they're all done, so the only thing that needs to be atomic
+ * is the mark bits (see gc_set_mark()).
+ *
+ * A major collection only sweeps the young objects. The old ones are set aside and swept a batch
+ * at a time afterwards: every so often as memory is allocated, whenever a size class runs out of
+ * room, and while the buffer is idle. Whatever is left is swept before the next collection, which
+ * is what lets the mark bits of the unswept objects be trusted until then.
+ */
 enum {
-        GC_ALLOC_THRESHOLD = (1 << 22) // ~ 4 MB
+        GC_NURSERY_SIZE  = (1 << 22), // ~ 4 MB allocated between minor collections, at least
+        GC_NURSERY_MAX   = (1 << 26), // and at most 64 MB
+        GC_NURSERY_RATIO = 4,         // otherwise a quarter of the live size of the old generation
+        GC_MAJOR_MIN     = (1 << 23), // bytes promoted before the first major collection
+        GC_PAGE_SIZE    = (1 << 16), // GC objects live in aligned pages of this many bytes
+        GC_PARALLEL_MIN  = (1 << 25), // heap size above which marking uses the helper threads
+        GC_STEAL_MAX     = 256,       // most gray objects taken from another thread at once
+        GC_SWEEP_STEP    = (1 << 16), // bytes allocated between batches of lazy sweeping
+        GC_SWEEP_MIN     = 256,       // fewest old objects swept in a batch
+        GC_PAUSE_BUCKETS = 24,
 };
 
-static size_t allocated = 0;
-int gc_prevent = 0;
+/*
+ * With PLUM_THREADED_BUFFERS, what the marking code reads (gc_skip, the object shapes, ...) is
+ * thread-local, so another thread can't help mark.
+ */
+#ifdef PLUM_THREADED_BUFFERS
+#define MARK_HELPERS 0
+#else
+#define MARK_HELPERS GC_MARK_THREADS
+#endif
+
+/*
+ * Each page holds cells of a single size class. Freed cells go on the page's free list, and the
+ * ones past 'top' have never been used. A page with any room in it is on its class's list of
+ * available pages, and it's given back as soon as it's empty. Objects too big for any class get
+ * a page (or several) of their own, with a class of -1.
+ *
+ * Pages are aligned to GC_PAGE_SIZE, so the page that an object is in can be found from its
+ * address alone.
+ */
+struct page {
+        struct page *prev;
+        struct page *next;
+        void *free;
+        char *top;
+        size_t size;
+        int class;
+        int live;
+};
+
+#define PAGE(p)  ((struct page *)((uintptr_t)(p) & ~(uintptr_t)(GC_PAGE_SIZE - 1)))
+#define HEADER   ((sizeof (struct page) + 15) & ~(size_t)15)
+#define CELLS(p) ((char *)(p) + HEADER)
+
+static size_t const classes[] = {
+        16, 32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 448, 512,
+        640, 768, 1024, 1280, 1536, 2048, 3072, 4096
+};
+
+enum { GC_CLASSES = sizeof classes / sizeof classes[0] };
+
+static TLS struct page *available[GC_CLASSES];
+
+static TLS size_t allocated = 0;
+static TLS size_t nursery = GC_NURSERY_SIZE;
+static TLS size_t live = 0;
+static TLS size_t promoted = 0;
+
+static TLS struct gc_stats stats;
+static TLS long long started;
+
+static TLS vec(struct value) remembered;
+
+static TLS bool marking = false;
+static TLS bool sweeping = false;
+static TLS int sweep_batch;
+static TLS size_t sweep_debt;
+static TLS vec(struct value) grays;
+static TLS long max_pause = GC_MAX_PAUSE_US;
+
+/*
+ * pauses[i] counts the pauses of at least 2^(i - 1) but less than 2^i microseconds.
+ */
+static TLS unsigned pauses[GC_PAUSE_BUCKETS];
+
+TLS int gc_prevent = 0;
+TLS unsigned char gc_skip = GC_MARK;
+TLS bool gc_incremental = false;
+
+bool gc_parallel = false;
+
+/*
+ * A thread's deque of gray objects: the owner pushes and pops at 'count', and thieves take from
+ * 'head'. workers[0] belongs to whichever thread is collecting.
+ */
+static struct worker {
+        pthread_mutex_t lock;
+        vec(struct value) stack;
+        size_t head;
+        unsigned round;
+} workers[MARK_HELPERS + 1];
+
+static _Thread_local struct worker *worker;
+
+static pthread_mutex_t helpers_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t helpers_wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t helpers_done = PTHREAD_COND_INITIALIZER;
+static int helpers;
+static pid_t helpers_pid;
+static unsigned round;
+static int busy;
+
+static int idle;
+static bool stop;
+static long long deadline;
+
+inline static long long
+now_us(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+inline static unsigned char *
+markbits(struct value const *v)
+{
+        switch (v->type & ~VALUE_TAGGED) {
+        case VALUE_ARRAY:  return &v->array->mark;
+        case VALUE_OBJECT: return &v->object->mark;
+        default:           return &v->function->mark;
+        }
+}
+
+static bool
+young_children(struct value const *v)
+{
+        if (v->type == VALUE_ARRAY) {
+                for (size_t i = 0; i < v->array->count; ++i) {
+                        if (value_is_young(&v->array->items[i])) {
+                                return true;
+                        }
+                }
+                return false;
+        }
+
+        return object_has_young(v->object);
+}
+
+/*
+ * After a minor collection, an old container only has to stay in the remembered set for as long
+ * as it refers to something young, unless the old generation is being marked.
+ */
+static void
+review_remembered(void)
+{
+        size_t n = 0;
+
+        for (size_t i = 0; i < remembered.count; ++i) {
+                struct value v = remembered.items[i];
+                unsigned char *mark = markbits(&v);
+
+                *mark &= ~GC_MARK;
+
+                if (marking || young_children(&v)) {
+                        remembered.items[n++] = v;
+                } else {
+                        *mark &= ~GC_REMEMBERED;
+                }
+        }
+
+        remembered.count = n;
+}
+
+static void
+forget_remembered(void)
+{
+        for (size_t i = 0; i < remembered.count; ++i) {
+                *markbits(&remembered.items[i]) &= ~GC_REMEMBERED;
+        }
+
+        remembered.count = 0;
+}
+
+static void
+push(struct worker *w, struct value v)
+{
+        pthread_mutex_lock(&w->lock);
+        vec_push(w->stack, v);
+        pthread_mutex_unlock(&w->lock);
+}
+
+static bool
+pop(struct worker *w, struct value *v)
+{
+        bool found = false;
+
+        pthread_mutex_lock(&w->lock);
+
+        if (w->stack.count > w->head) {
+                *v = w->stack.items[--w->stack.count];
+                found = true;
+        }
+
+        if (w->stack.count == w->head) {
+                w->stack.count = w->head = 0;
+        }
+
+        pthread_mutex_unlock(&w->lock);
+
+        return found;
+}
+
+/*
+ * Take up to half of another thread's gray objects. Since this is only called by an idle thread,
+ * it stops being idle before the objects leave the victim's deque; that way, whenever every
+ * thread is idle, there's nothing left to mark.
+ */
+static bool
+steal(struct worker *self, int nworkers)
+{
+        static _Thread_local struct value taken[GC_STEAL_MAX];
+        int start = self - workers;
+
+        for (int i = 1; i < nworkers; ++i) {
+                struct worker *w = &workers[(start + i) % nworkers];
+                size_t n = 0;
+
+                pthread_mutex_lock(&w->lock);
+
+                if (w->stack.count > w->head) {
+                        n = (w->stack.count - w->head + 1) / 2;
+                        n = n > GC_STEAL_MAX ? GC_STEAL_MAX : n;
+                        memcpy(taken, w->stack.items + w->head, n * sizeof (struct value));
+                        w->head += n;
+                        __atomic_sub_fetch(&idle, 1, __ATOMIC_SEQ_CST);
+                }
+
+                pthread_mutex_unlock(&w->lock);
+
+                if (n != 0) {
+                        pthread_mutex_lock(&self->lock);
+                        vec_push_n(self->stack, taken, n);
+                        pthread_mutex_unlock(&self->lock);
+                        return true;
+                }
+        }
+
+        return false;
+}
+
+/*
+ * Mark until there's nothing left to mark anywhere, or until the deadline.
+ */
+static void
+work(struct worker *self, int nworkers)
+{
+        struct value v;
+
+        worker = self;
+
+        for (int n = 1; !__atomic_load_n(&stop, __ATOMIC_RELAXED); ++n) {
+                if (pop(self, &v)) {
+                        value_mark_children(&v);
+                        if (n % 64 == 0 && now_us() >= deadline) {
+                                __atomic_store_n(&stop, true, __ATOMIC_RELAXED);
+                        }
+                        continue;
+                }
+
+                __atomic_add_fetch(&idle, 1, __ATOMIC_SEQ_CST);
+
+                while (!steal(self, nworkers)) {
+                        if (__atomic_load_n(&idle, __ATOMIC_SEQ_CST) == nworkers || __atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+                                worker = NULL;
+                                return;
+                        }
+                        sched_yield();
+                }
+        }
+
+        worker = NULL;
+}
+
+static void *
+helper(void *arg)
+{
+        struct worker *self = arg;
+
+        pthread_mutex_lock(&helpers_lock);
+
+        for (;;) {
+                while (self->round == round) {
+                        pthread_cond_wait(&helpers_wake, &helpers_lock);
+                }
+
+                self->round = round;
+
+                pthread_mutex_unlock(&helpers_lock);
+                work(self, helpers + 1);
+                pthread_mutex_lock(&helpers_lock);
+
+                if (--busy == 0) {
+                        pthread_cond_signal(&helpers_done);
+                }
+        }
+
+        return NULL;
+}
+
+/*
+ * Whether the heap is big enough to be worth marking on more than one thread, starting the
+ * helpers if it is and they aren't running yet. They don't survive a fork, hence the pid.
+ */
+static bool
+parallel(void)
+{
+        if (MARK_HELPERS == 0 || live + promoted + allocated < GC_PARALLEL_MIN)
+                return false;
+
+        if (helpers_pid == getpid())
+                return helpers > 0;
+
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        int want = (cpus - 1 < MARK_HELPERS) ? cpus - 1 : MARK_HELPERS;
+
+        helpers = 0;
+        helpers_pid = getpid();
+
+        for (int i = 0; i <= MARK_HELPERS; ++i) {
+                pthread_mutex_init(&workers[i].lock, NULL);
+                vec_init(workers[i].stack);
+                workers[i].head = 0;
+        }
+
+        while (helpers < want) {
+                pthread_t t;
+                struct worker *w = &workers[helpers + 1];
+                w->round = round;
+                if (pthread_create(&t, NULL, helper, w) != 0) {
+                        break;
+                }
+                pthread_detach(t);
+                ++helpers;
+        }
+
+        return helpers > 0;
+}
+
+/*
+ * Trace the gray objects on every thread until they're all black or it's 'until'. Whatever is
+ * still gray by then ends up back on the mark stack.
+ */
+static void
+mark_parallel(long long until)
+{
+        int nworkers = helpers + 1;
+
+        for (size_t i = 0; i < grays.count; ++i) {
+                vec_push(workers[i % nworkers].stack, grays.items[i]);
+        }
+
+        grays.count = 0;
+
+        idle = 0;
+        stop = false;
+        deadline = until;
+        gc_parallel = true;
+
+        pthread_mutex_lock(&helpers_lock);
+        busy = helpers;
+        round += 1;
+        pthread_cond_broadcast(&helpers_wake);
+        pthread_mutex_unlock(&helpers_lock);
+
+        work(&workers[0], nworkers);
+
+        pthread_mutex_lock(&helpers_lock);
+        while (busy > 0) {
+                pthread_cond_wait(&helpers_done, &helpers_lock);
+        }
+        pthread_mutex_unlock(&helpers_lock);
+
+        gc_parallel = false;
+
+        for (int i = 0; i < nworkers; ++i) {
+                struct worker *w = &workers[i];
+                if (w->stack.count > w->head) {
+                        vec_push_n(grays, w->stack.items + w->head, w->stack.count - w->head);
+                }
+                w->stack.count = w->head = 0;
+        }
+
+        stats.parallel += 1;
+}
+
+/*
+ * Trace the gray objects until there are only 'base' of them left.
+ */
+static void
+drain(size_t base)
+{
+        if (base == 0 && grays.count > 0 && parallel()) {
+                mark_parallel(LLONG_MAX);
+                return;
+        }
+
+        while (grays.count > base) {
+                struct value v = *vec_pop(grays);
+                value_mark_children(&v);
+        }
+}
+
+static void
+schedule(void)
+{
+        nursery = live / GC_NURSERY_RATIO;
+        nursery = nursery < GC_NURSERY_SIZE ? GC_NURSERY_SIZE : nursery;
+        nursery = nursery > GC_NURSERY_MAX ? GC_NURSERY_MAX : nursery;
+}
+
+/*
+ * Sweep at most 'budget' of the old objects left over from the last major collection, and say
+ * whether they've all been swept. The live size of the old generation is only known once they
+ * have.
+ */
+static bool
+sweep(int budget)
+{
+        live += object_sweep_old(&budget);
+        live += value_array_sweep_old(&budget);
+        live += value_function_sweep_old(&budget);
+        live += value_string_sweep_old(&budget);
+
+        if (budget > 0) {
+                sweeping = false;
+                schedule();
+        }
+
+        return !sweeping;
+}
+
+static void
+finish_sweep(void)
+{
+        while (sweeping) {
+                sweep(INT_MAX);
+        }
+}
+
+static void
+collect(bool major)
+{
+        LOG("%s collection: %zu bytes allocated, %zu promoted", major ? "major" : "minor", allocated, promoted);
+
+        /*
+         * A minor collection in the middle of incremental marking mustn't trace the old objects
+         * which are still gray, since it would skip their old children.
+         */
+        size_t base = major ? 0 : grays.count;
+
+        finish_sweep();
+
+        gc_skip = major ? GC_MARK : (GC_MARK | GC_OLD);
+
+        vm_mark();
+        value_mark_fresh();
+        object_mark_fresh();
+
+        /*
+         * A minor collection has to trace the remembered containers, since they might refer to
+         * young objects, and so does the end of incremental marking, since they might have had
+         * white objects stored in them after they were traced. Captured variables have no write
+         * barrier at all, so they're treated the same way.
+         */
+        if (!major || marking) {
+                vm_mark_captured();
+                for (size_t i = 0; i < remembered.count; ++i) {
+                        value_mark_children(&remembered.items[i]);
+                }
+        }
+
+        drain(base);
+
+        if (major) {
+                marking = false;
+
+                /*
+                 * Everything that survives is about to be old, so nothing needs remembering.
+                 */
+                forget_remembered();
+        }
+
+        size_t n = object_sweep(major)
+                 + value_array_sweep(major)
+                 + value_function_sweep(major)
+                 + value_string_sweep(major);
+
+        if (major) {
+                vm_sweep_variables();
+                live = n;
+                promoted = 0;
+                stats.major += 1;
+
+                /*
+                 * Sweep fast enough to be done (on allocation alone) about halfway to the next
+                 * minor collection.
+                 */
+                size_t unswept = object_unswept() + value_unswept();
+                size_t batch = unswept * 2 * GC_SWEEP_STEP / nursery;
+                sweep_batch = batch < GC_SWEEP_MIN ? GC_SWEEP_MIN : batch > INT_MAX ? INT_MAX : batch;
+                sweep_debt = 0;
+                sweeping = true;
+        } else {
+                review_remembered();
+                promoted += n;
+                stats.minor += 1;
+        }
+
+        gc_skip = GC_MARK;
+        allocated = 0;
+}
+
+static void
+record(long long us)
+{
+        int i = 0;
+
+        while (i + 1 < GC_PAUSE_BUCKETS && us >= (1LL << i)) {
+                ++i;
+        }
+
+        ++pauses[i];
+
+        stats.pause_total += us;
+        if (us > stats.pause_max) {
+                stats.pause_max = us;
+        }
+}
+
+/*
+ * Gray the old objects that the roots refer to directly. Any that are only reachable through
+ * young objects will be found at the end.
+ */
+static void
+start_marking(void)
+{
+        LOG("starting incremental marking: %zu live, %zu promoted", live, promoted);
+
+        marking = true;
+
+        gc_incremental = true;
+        vm_mark();
+        gc_incremental = false;
+}
+
+/*
+ * Trace gray objects until there are none left or the pause started at 'start' has gone on for
+ * long enough, and say whether marking is finished.
+ */
+static bool
+mark_slice(long long start)
+{
+        gc_incremental = true;
+
+        if (grays.count > 0 && parallel()) {
+                mark_parallel(start + max_pause);
+        } else {
+                for (int n = 1; grays.count > 0; ++n) {
+                        struct value v = *vec_pop(grays);
+                        value_mark_children(&v);
+                        if (n % 64 == 0 && now_us() - start >= max_pause) {
+                                break;
+                        }
+                }
+        }
+
+        gc_incremental = false;
+
+        return grays.count == 0;
+}
+
+inline static void
+account(size_t n)
+{
+        allocated += n;
+        stats.allocated += n;
+
+        if (sweeping && gc_prevent == 0 && (sweep_debt += n) >= GC_SWEEP_STEP) {
+                sweep_debt = 0;
+                sweep(sweep_batch);
+        }
+
+        if (allocated <= nursery || gc_prevent != 0)
+                return;
+
+        long long start = now_us();
+
+        if (!marking) {
+                collect(false);
+                if (promoted > (live > GC_MAJOR_MIN ? live : GC_MAJOR_MIN)) {
+                        start_marking();
+                }
+        } else if (mark_slice(start)) {
+                collect(true);
+        } else {
+                collect(false);
+        }
+
+        record(now_us() - start);
+}
 
 void *
 gc_alloc(size_t n)
 {
         void *mem = alloc(n);
 
-        allocated += n;
+        account(n);
 
-        if (allocated <= GC_ALLOC_THRESHOLD || gc_prevent != 0)
-                return mem;
+        return mem;
+}
 
-        vm_mark();        
+/*
+ * Charge n bytes of storage that was allocated (or grown in place) outside of gc_alloc()
+ * against the nursery. This may collect, so the caller must already have stored the new block
+ * wherever the collector will look for it.
+ */
+void
+gc_account(size_t n)
+{
+        account(n);
+}
 
-        object_sweep();
-        value_array_sweep();
-        value_ref_vector_sweep();
-        value_string_sweep();
-        vm_sweep_variables();
+static struct page *
+newpage(int class, size_t size)
+{
+        struct page *p = aligned_alloc(GC_PAGE_SIZE, size);
+        if (p == NULL) {
+                panic("out of memory");
+        }
 
-        allocated = 0;
+        p->prev = NULL;
+        p->next = NULL;
+        p->free = NULL;
+        p->top = CELLS(p);
+        p->size = size;
+        p->class = class;
+        p->live = 0;
 
-        return mem;
+        return p;
+}
+
+inline static bool
+hasroom(struct page const *p)
+{
+        return p->free != NULL || p->top + classes[p->class] <= (char *)p + GC_PAGE_SIZE;
+}
+
+inline static void
+unlink_page(struct page *p)
+{
+        if (p->prev != NULL) {
+                p->prev->next = p->next;
+        } else {
+                available[p->class] = p->next;
+        }
+
+        if (p->next != NULL) {
+                p->next->prev = p->prev;
+        }
+}
+
+inline static void
+link_page(struct page *p)
+{
+        p->prev = NULL;
+        p->next = available[p->class];
+        if (p->next != NULL) {
+                p->next->prev = p;
+        }
+        available[p->class] = p;
+}
+
+/*
+ * Allocate a GC object, which must only ever be freed with gc_free().
+ */
+void *
+gc_new(size_t n)
+{
+        struct page *p;
+        void *cell;
+        int class = 0;
+
+        if (n > classes[GC_CLASSES - 1]) {
+                size_t size = (HEADER + n + GC_PAGE_SIZE - 1) & ~(size_t)(GC_PAGE_SIZE - 1);
+                p = newpage(-1, size);
+                p->live = 1;
+                account(n);
+                return CELLS(p);
+        }
+
+        while (classes[class] < n) {
+                ++class;
+        }
+
+        /*
+         * Rather than start a new page, see if sweeping frees up a cell of the right size.
+         */
+        if (available[class] == NULL && sweeping && gc_prevent == 0) {
+                sweep(sweep_batch);
+        }
+
+        if ((p = available[class]) == NULL) {
+                p = newpage(class, GC_PAGE_SIZE);
+                link_page(p);
+        }
+
+        if (p->free != NULL) {
+                cell = p->free;
+                p->free = *(void **)cell;
+        } else {
+                cell = p->top;
+                p->top += classes[class];
+        }
+
+        p->live += 1;
+
+        if (!hasroom(p)) {
+                unlink_page(p);
+        }
+
+        /*
+         * Only now can there be a collection, since the sweep may call gc_free().
+         */
+        account(classes[class]);
+
+        return cell;
+}
+
+/*
+ * The number of bytes actually taken up by a GC object.
+ */
+size_t
+gc_size(void const *cell)
+{
+        struct page const *p = PAGE(cell);
+        return (p->class == -1) ? p->size - HEADER : classes[p->class];
+}
+
+void
+gc_free(void *cell)
+{
+        struct page *p = PAGE(cell);
+
+        if (p->class == -1) {
+                free(p);
+                return;
+        }
+
+        bool full = !hasroom(p);
+
+        *(void **)cell = p->free;
+        p->free = cell;
+
+        if (--p->live == 0) {
+                if (!full) {
+                        unlink_page(p);
+                }
+                free(p);
+        } else if (full) {
+                link_page(p);
+        }
+}
+
+/*
+ * The slow path of the write barrier (value_array_barrier() and object_barrier()): the old
+ * container v has just had something stored in it which may be young.
+ */
+void
+gc_remember(struct value v)
+{
+        *markbits(&v) |= GC_REMEMBERED;
+        vec_push(remembered, v);
+}
+
+void
+gc_gray(struct value v)
+{
+        if (worker != NULL) {
+                push(worker, v);
+        } else {
+                vec_push(grays, v);
+        }
+}
+
+void
+gc_collect(void)
+{
+        long long start = now_us();
+
+        collect(true);
+        finish_sweep();
+
+        record(now_us() - start);
+}
+
+bool
+gc_pending(void)
+{
+        return marking || sweeping;
+}
+
+/*
+ * Do a slice of sweeping or marking, finishing the collection if there's nothing left to mark.
+ * This is called whenever the buffer would otherwise be waiting for something to happen.
+ */
+void
+gc_idle(void)
+{
+        if (!(marking || sweeping) || gc_prevent != 0)
+                return;
+
+        long long start = now_us();
+
+        if (sweeping) {
+                while (!sweep(GC_SWEEP_MIN) && now_us() - start < max_pause) {
+                        continue;
+                }
+        } else if (mark_slice(start)) {
+                collect(true);
+        }
+
+        record(now_us() - start);
+}
+
+void
+gc_set_max_pause(long us)
+{
+        max_pause = us;
+}
+
+unsigned const *
+gc_pauses(int *n)
+{
+        *n = GC_PAUSE_BUCKETS;
+        return pauses;
+}
+
+struct gc_stats
+gc_stats(void)
+{
+        struct gc_stats s = stats;
+        long long elapsed = now_us() - started;
+
+        s.live = live;
+        s.promoted = promoted;
+        s.nursery = nursery;
+        s.allocation_rate = (elapsed > 0) ? stats.allocated * 1e6 / elapsed : 0;
+        s.marking = marking;
+        s.unswept = object_unswept() + value_unswept();
+
+        return s;
 }
 
 void
 gc_reset(void)
 {
         gc_prevent = 0;
+        gc_skip = GC_MARK;
+        gc_incremental = false;
+        marking = false;
+        sweeping = false;
+        sweep_debt = 0;
+        vec_init(grays);
+        memset(pauses, 0, sizeof pauses);
+        memset(available, 0, sizeof available);
         allocated = 0;
+        nursery = GC_NURSERY_SIZE;
+        live = 0;
+        promoted = 0;
+        memset(&stats, 0, sizeof stats);
+        started = now_us();
+        vec_init(remembered);
         value_gc_reset();
         object_gc_reset();
 }
+
+/*
+ * Free every GC object and give back all of the pages. Nothing may refer to any of them
+ * afterwards, so this is only for a buffer that's going away.
+ */
+void
+gc_destroy(void)
+{
+        value_gc_destroy();
+        object_gc_destroy();
+        vec_empty(grays);
+        vec_empty(remembered);
+        gc_reset();
+}
+
+TEST(destroy)
+{
+        vm_init();
+
+        claim(vm_execute("let xs = []; for (let i = 0; i < 10000; ++i) xs.push({'s': str(i) + '!', 'a': [i]});"));
+
+        vm_destroy();
+
+        for (int i = 0; i < GC_CLASSES; ++i) {
+                claim(available[i] == NULL);
+        }
+}
+
+TEST(pages)
+{
+        gc_reset();
+
+        ++gc_prevent;
+
+        char *a = gc_new(20);
+        char *b = gc_new(24);
+        char *c = gc_new(40);
+
+        claim(PAGE(a) == PAGE(b));
+        claim(PAGE(a) != PAGE(c));
+        claim(b - a == 32);
+        claim(((uintptr_t)a & 15) == 0);
+
+        gc_free(a);
+        claim(gc_new(17) == a);
+
+        char *big = gc_new(GC_PAGE_SIZE);
+        claim(PAGE(big)->class == -1);
+        gc_free(big);
+
+        gc_free(a);
+        gc_free(b);
+        gc_free(c);
+
+        claim(available[1] == NULL);
+        claim(available[2] == NULL);
+
+        --gc_prevent;
+}
+
+TEST(lazy_sweep)
+{
+        vm_init();
+
+        ++gc_prevent;
+
+        for (int i = 0; i < 10000; ++i) {
+                value_array_new();
+        }
+
+        --gc_prevent;
+
+        collect(true);
+        collect(true);
+
+        size_t unswept = gc_stats().unswept;
+
+        claim(sweeping);
+        claim(unswept >= 10000);
+
+        claim(!sweep(100));
+        claim(gc_stats().unswept == unswept - 100);
+
+        ++gc_prevent;
+        value_array_new();
+        claim(gc_stats().unswept == unswept - 100);
+        --gc_prevent;
+
+        while (sweeping) {
+                value_array_new();
+        }
+
+        claim(gc_stats().unswept == 0);
+        claim(live < 10000 * sizeof (struct value_array));
+}
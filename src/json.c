@@ -9,14 +9,15 @@
 #include "util.h"
 #include "vec.h"
 #include "vm.h"
+#include "tls.h"
 
 #define KW_DELIM(c) (strchr(" \n}],", c) != NULL)
 
 #define FAIL longjmp(jb, 1)
 
-static jmp_buf jb;
-static char const *json;
-static int len;
+static TLS jmp_buf jb;
+static TLS char const *json;
+static TLS int len;
 
 inline static char
 peek(void)
@@ -175,7 +176,7 @@ string(void)
 
         vec_empty(str);
 
-        return STRING(s->data, n, s);
+        return STRING(s, n);
 }
 
 static struct value
@@ -187,7 +188,7 @@ array(void)
         struct value_array *a = value_array_new();
 
         while (peek() != '\0' && peek() != ']') {
-                vec_push(*a, value());
+                value_array_push(a, value());
                 space();
                 if (peek() != ']' && next() != ',')
                         FAIL;
@@ -14,22 +14,23 @@
 #include "util.h"
 #include "lex.h"
 #include "log.h"
+#include "tls.h"
 
 enum {
         MAX_OP_LEN   = 8,
         MAX_ERR_LEN  = 2048
 };
 
-struct location startloc;
-struct location loc;
+TLS struct location startloc;
+TLS struct location loc;
 
-jmp_buf jb;
-bool keep_next_newline;
+TLS jmp_buf jb;
+TLS bool keep_next_newline;
 
-char errbuf[MAX_ERR_LEN + 1];
+TLS char errbuf[MAX_ERR_LEN + 1];
 
-static vec(char const *) states;
-static char const *chars;
+static TLS vec(char const *) states;
+static TLS char const *chars;
 
 static char const *opchars = "/=<~|!@$%^&*-+>";
 
@@ -9,70 +9,310 @@
 #include "object.h"
 #include "log.h"
 #include "gc.h"
+#include "tls.h"
 
 enum {
-        OBJECT_NUM_BUCKETS = 128,
+        OBJECT_MAX_SHAPE_MEMBERS = 32,
+        OBJECT_MAX_SHAPES = 4096,
+        OBJECT_MAX_UNINDEXED = 8,
 };
 
-struct object_hashmap_node {
+struct object_entry {
         struct value key;
         struct value value;
-        struct object_hashmap_node *next;
+        unsigned long hash;
 };
 
-struct object {
-        struct object_hashmap_node *buckets[OBJECT_NUM_BUCKETS];
-        size_t count;
-
-        unsigned char mark;
-        struct object *next;
+/*
+ * Shapes form a tree rooted at the shape of the empty object, each one adding a single key to
+ * its parent. They're never freed, which is why there can only be so many of them.
+ */
+struct shape {
+        struct shape *parent;
+        struct value key;
+        unsigned long hash;
+        int count;
+        vec(struct shape *) transitions;
 };
 
-static struct value nil = { .type = VALUE_NIL };
+static TLS struct { struct object *fresh, *aging, *old, *unswept; size_t nold, nunswept; } objects;
 
-static struct object *object_chain = NULL;
+static TLS struct shape *root;
+static TLS struct shape *dictionary;
+static TLS int shapecount;
 
-static struct object_hashmap_node *
-mknode(struct value key, struct value value, struct object_hashmap_node *next)
+static void
+freeobj(struct object *obj)
 {
-        struct object_hashmap_node *node = gc_alloc(sizeof *node);
+        LOG("FREEING OBJECT");
 
-        node->key = key;
-        node->value = value;
-        node->next = next;
+        if (obj->shape == dictionary) {
+                free(obj->entries);
+                free(obj->index);
+        } else {
+                free(obj->slots);
+        }
+
+        gc_free(obj);
+}
+
+inline static void
+index_add(struct object *obj, int i)
+{
+        int mask = 2 * obj->capacity - 1;
+        int b = obj->entries[i].hash & mask;
+
+        while (obj->index[b] != -1) {
+                b = (b + 1) & mask;
+        }
 
-        return node;
+        obj->index[b] = i;
 }
 
+/*
+ * The index maps hashes to positions in 'entries' using linear probing over twice as many
+ * buckets as there is room for entries, so it's never more than half full. Empty buckets are -1.
+ */
 static void
-freeobj(struct object *obj)
+reindex(struct object *obj)
 {
-        for (int i = 0; i < OBJECT_NUM_BUCKETS; ++i) {
-                for (struct object_hashmap_node *node = obj->buckets[i]; node != NULL;) {
-                        struct object_hashmap_node *next = node->next;
-                        LOG("FREEING OBJECT NODE");
-                        free(node);
-                        node = next;
+        int n = 2 * obj->capacity;
+
+        resize(obj->index, n * sizeof *obj->index);
+        for (int i = 0; i < n; ++i) {
+                obj->index[i] = -1;
+        }
+
+        for (int i = 0; i < obj->count; ++i) {
+                index_add(obj, i);
+        }
+}
+
+static struct value *
+entry_find(struct object const *obj, struct value const *key, unsigned long hash)
+{
+        if (obj->index == NULL) {
+                for (int i = 0; i < obj->count; ++i) {
+                        struct object_entry *e = &obj->entries[i];
+                        if (e->hash == hash && value_test_equality(&e->key, key)) {
+                                return &e->value;
+                        }
                 }
+                return NULL;
         }
 
-        LOG("FREEING OBJECT");
+        int mask = 2 * obj->capacity - 1;
+        for (int b = hash & mask; obj->index[b] != -1; b = (b + 1) & mask) {
+                struct object_entry *e = &obj->entries[obj->index[b]];
+                if (e->hash == hash && value_test_equality(&e->key, key)) {
+                        return &e->value;
+                }
+        }
 
-        free(obj);
+        return NULL;
 }
 
 static struct value *
-bucket_find(struct object_hashmap_node *node, struct value const *key)
+add_entry(struct object *obj, struct value key, unsigned long hash)
 {
-        while (node != NULL) {
-                if (value_test_equality(&node->key, key)) {
-                        return &node->value;
-                } else {
-                        node = node->next;
+        if (obj->count == obj->capacity) {
+                int capacity = obj->capacity * 2;
+                struct object_entry *entries = gc_alloc(capacity * sizeof *entries);
+
+                memcpy(entries, obj->entries, obj->count * sizeof *entries);
+                free(obj->entries);
+
+                obj->entries = entries;
+                obj->capacity = capacity;
+
+                if (obj->index != NULL) {
+                        reindex(obj);
                 }
         }
 
-        return NULL;
+        int i = obj->count++;
+        obj->entries[i] = (struct object_entry){ .key = key, .value = NIL, .hash = hash };
+
+        if (obj->index != NULL) {
+                index_add(obj, i);
+        } else if (obj->count > OBJECT_MAX_UNINDEXED) {
+                reindex(obj);
+        }
+
+        return &obj->entries[i].value;
+}
+
+static struct shape *
+shape_new(struct shape *parent, struct value const *key, unsigned long hash)
+{
+        struct shape *s = alloc(sizeof *s);
+
+        s->parent = parent;
+        s->hash = hash;
+        s->count = (parent == NULL) ? 0 : parent->count + 1;
+        vec_init(s->transitions);
+
+        /*
+         * The key outlives any string the program has, so it's interned.
+         */
+        if (key != NULL) {
+                s->key = STRING_INTERN(key->string, key->bytes);
+        }
+
+        ++shapecount;
+
+        return s;
+}
+
+/*
+ * Shape keys are interned, so an interned key can only match by pointer.
+ */
+inline static bool
+shape_key_is(struct shape const *s, struct value const *key, bool interned, unsigned long hash)
+{
+        if (interned) {
+                return s->key.string == key->string;
+        }
+
+        return s->hash == hash && s->key.bytes == key->bytes && memcmp(s->key.string, key->string, key->bytes) == 0;
+}
+
+/*
+ * Returns the slot index of 'key' in objects of shape s, or -1.
+ */
+static int
+shape_find(struct shape const *s, struct value const *key, unsigned long hash)
+{
+        bool interned = value_string_owner(key->string)->interned;
+
+        for (; s->parent != NULL; s = s->parent) {
+                if (shape_key_is(s, key, interned, hash)) {
+                        return s->count - 1;
+                }
+        }
+
+        return -1;
+}
+
+/*
+ * Returns the shape that objects of shape s get when 'key' is added to them, or NULL if
+ * they're too big or there are too many shapes already.
+ */
+static struct shape *
+shape_transition(struct shape *s, struct value const *key, unsigned long hash)
+{
+        bool interned = value_string_owner(key->string)->interned;
+
+        for (int i = 0; i < s->transitions.count; ++i) {
+                if (shape_key_is(s->transitions.items[i], key, interned, hash)) {
+                        return s->transitions.items[i];
+                }
+        }
+
+        if (s->count == OBJECT_MAX_SHAPE_MEMBERS || shapecount == OBJECT_MAX_SHAPES) {
+                return NULL;
+        }
+
+        struct shape *next = shape_new(s, key, hash);
+        vec_push(s->transitions, next);
+
+        return next;
+}
+
+static struct value *
+add_slot(struct object *obj, struct shape *shape)
+{
+        if (obj->count == obj->capacity) {
+                int capacity = obj->capacity == 0 ? 4 : obj->capacity * 2;
+                struct value *slots = gc_alloc(capacity * sizeof *slots);
+
+                if (obj->slots != NULL) {
+                        memcpy(slots, obj->slots, obj->count * sizeof *slots);
+                        free(obj->slots);
+                }
+
+                obj->slots = slots;
+                obj->capacity = capacity;
+        }
+
+        obj->shape = shape;
+        obj->slots[obj->count] = NIL;
+
+        return &obj->slots[obj->count++];
+}
+
+static void
+make_dictionary(struct object *obj)
+{
+        LOG("object at %p becomes a dictionary", (void *) obj);
+
+        int capacity = OBJECT_MAX_UNINDEXED;
+        while (capacity <= obj->count) {
+                capacity *= 2;
+        }
+
+        struct object_entry *entries = gc_alloc(capacity * sizeof *entries);
+        for (struct shape *s = obj->shape; s->parent != NULL; s = s->parent) {
+                entries[s->count - 1] = (struct object_entry){
+                        .key = s->key,
+                        .value = obj->slots[s->count - 1],
+                        .hash = s->hash
+                };
+        }
+
+        free(obj->slots);
+
+        obj->entries = entries;
+        obj->capacity = capacity;
+        obj->shape = dictionary;
+
+        if (obj->count > OBJECT_MAX_UNINDEXED) {
+                reindex(obj);
+        }
+}
+
+/*
+ * Add 'key', which mustn't already be there, and return a pointer to its (nil) value.
+ */
+static struct value *
+insert(struct object *obj, struct value key, unsigned long hash)
+{
+        if (obj->shape != dictionary) {
+                if (key.type == VALUE_STRING) {
+                        struct shape *next = shape_transition(obj->shape, &key, hash);
+                        if (next != NULL) {
+                                return add_slot(obj, next);
+                        }
+                }
+                make_dictionary(obj);
+        }
+
+        /*
+         * The key may not be reachable from anywhere else until it's in the table.
+         */
+        ++gc_prevent;
+
+        struct value *valueptr = add_entry(obj, key, hash);
+
+        --gc_prevent;
+
+        return valueptr;
+}
+
+static struct value *
+find(struct object const *obj, struct value const *key, unsigned long hash)
+{
+        if (obj->shape == dictionary) {
+                return entry_find(obj, key, hash);
+        }
+
+        if (key->type != VALUE_STRING) {
+                return NULL;
+        }
+
+        int i = shape_find(obj->shape, key, hash);
+
+        return (i == -1) ? NULL : &obj->slots[i];
 }
 
 size_t
@@ -84,16 +324,21 @@ object_item_count(struct object const *obj)
 struct object *
 object_new(void)
 {
-        struct object *object = gc_alloc(sizeof *object);
-
-        for (int i = 0; i < OBJECT_NUM_BUCKETS; ++i) {
-                object->buckets[i] = NULL;
+        if (root == NULL) {
+                root = shape_new(NULL, NULL, 0);
+                dictionary = shape_new(NULL, NULL, 0);
         }
 
+        struct object *object = gc_new(sizeof *object);
+
+        object->shape = root;
+        object->slots = NULL;
+        object->capacity = 0;
+        object->index = NULL;
         object->count = 0;
-        object->mark = GC_MARK;
-        object->next = object_chain;
-        object_chain = object;
+        object->mark = GC_NONE;
+        object->next = objects.fresh;
+        objects.fresh = object;
 
         return object;
 }
@@ -101,57 +346,119 @@ object_new(void)
 struct value *
 object_get_value(struct object const *obj, struct value const *key)
 {
-        unsigned bucket_index = value_hash(key) % OBJECT_NUM_BUCKETS;
-        return bucket_find(obj->buckets[bucket_index], key);
+        return find(obj, key, value_hash(key));
 }
 
 void
 object_put_value(struct object *obj, struct value key, struct value value)
 {
-        unsigned bucket_index = value_hash(&key) % OBJECT_NUM_BUCKETS;
-        struct value *valueptr = bucket_find(obj->buckets[bucket_index], &key);
-        
-        if (valueptr == NULL) {
-                obj->count += 1;
-                obj->buckets[bucket_index] = mknode(key, value, obj->buckets[bucket_index]);
-        } else {
-                *valueptr = value;
-        }
+        *object_put_key_if_not_exists(obj, key) = value;
 }
 
 struct value *
 object_put_key_if_not_exists(struct object *obj, struct value key)
 {
-        unsigned bucket_index = value_hash(&key) % OBJECT_NUM_BUCKETS;
-        struct value *valueptr = bucket_find(obj->buckets[bucket_index], &key);
+        unsigned long hash = value_hash(&key);
+        struct value *valueptr = find(obj, &key, hash);
 
-        if (valueptr != NULL) {
-                return valueptr;
-        } else {
-                obj->count += 1;
-                obj->buckets[bucket_index] = mknode(key, nil, obj->buckets[bucket_index]);
-                return &obj->buckets[bucket_index]->value;
+        if (valueptr == NULL) {
+                valueptr = insert(obj, key, hash);
         }
+
+        object_barrier(obj);
+
+        return valueptr;
 }
 
 struct value *
 object_put_member_if_not_exists(struct object *obj, char const *member)
 {
-        return object_put_key_if_not_exists(obj, STRING_NOGC(member, strlen(member)));
+        return object_put_key_if_not_exists(obj, STRING_INTERN(member, strlen(member)));
 }
 
 struct value *
 object_get_member(struct object const *obj, char const *key)
 {
-        struct value string = STRING_NOGC(key, strlen(key));
+        struct value string = STRING_INTERN(key, strlen(key));
         return object_get_value(obj, &string);
 }
 
 void
 object_put_member(struct object *obj, char const *key, struct value value)
 {
-        struct value string = STRING_NOGC(key, strlen(key));
-        object_put_value(obj, string, value);
+        *object_put_member_if_not_exists(obj, key) = value;
+}
+
+/*
+ * The slow path of object_get_member_cached().
+ */
+struct value *
+object_lookup_member(struct object *obj, struct member_cache *cache)
+{
+        struct value key = STRING(value_string_owner(cache->name), cache->length);
+        unsigned long hash = value_hash(&key);
+
+        if (obj->shape == dictionary) {
+                return entry_find(obj, &key, hash);
+        }
+
+        int i = shape_find(obj->shape, &key, hash);
+        if (i == -1) {
+                return NULL;
+        }
+
+        cache->shape = obj->shape;
+        cache->index = i;
+
+        return &obj->slots[i];
+}
+
+/*
+ * The slow path of object_put_member_cached(), which is also the fast path for adding a member.
+ */
+static struct value *
+add_member(struct object *obj, struct member_cache *cache)
+{
+        if (obj->shape == cache->shape) {
+                return add_slot(obj, cache->next);
+        }
+
+        struct value key = STRING(value_string_owner(cache->name), cache->length);
+        unsigned long hash = value_hash(&key);
+
+        if (obj->shape == dictionary) {
+                struct value *valueptr = entry_find(obj, &key, hash);
+                return (valueptr != NULL) ? valueptr : insert(obj, key, hash);
+        }
+
+        int i = shape_find(obj->shape, &key, hash);
+        if (i != -1) {
+                cache->shape = obj->shape;
+                cache->next = NULL;
+                cache->index = i;
+                return &obj->slots[i];
+        }
+
+        struct shape *next = shape_transition(obj->shape, &key, hash);
+        if (next == NULL) {
+                return insert(obj, key, hash);
+        }
+
+        cache->shape = obj->shape;
+        cache->next = next;
+        cache->index = obj->count;
+
+        return add_slot(obj, next);
+}
+
+struct value *
+object_add_member(struct object *obj, struct member_cache *cache)
+{
+        struct value *valueptr = add_member(obj, cache);
+
+        object_barrier(obj);
+
+        return valueptr;
 }
 
 struct value
@@ -159,10 +466,18 @@ object_keys_array(struct object *obj)
 {
         struct value_array *keys = value_array_new();
 
-        for (int i = 0; i < OBJECT_NUM_BUCKETS; ++i) {
-                for (struct object_hashmap_node *node = obj->buckets[i]; node != NULL; node = node->next) {
-                        vec_push(*keys, node->key);
+        if (obj->shape != dictionary) {
+                value_array_reserve(keys, obj->count);
+                keys->count = obj->count;
+                for (struct shape *s = obj->shape; s->parent != NULL; s = s->parent) {
+                        keys->items[s->count - 1] = s->key;
                 }
+                return ARRAY(keys);
+        }
+
+        value_array_reserve(keys, obj->count);
+        for (int i = 0; i < obj->count; ++i) {
+                value_array_push(keys, obj->entries[i].key);
         }
 
         return ARRAY(keys);
@@ -171,45 +486,196 @@ object_keys_array(struct object *obj)
 void
 object_mark(struct object *obj)
 {
-        obj->mark |= GC_MARK;
+        gc_set_mark(&obj->mark);
 
-        for (int i = 0; i < OBJECT_NUM_BUCKETS; ++i) {
-                for (struct object_hashmap_node *node = obj->buckets[i]; node != NULL; node = node->next) {
-                        value_mark(&node->key);
-                        value_mark(&node->value);
+        if (obj->shape != dictionary) {
+                for (int i = 0; i < obj->count; ++i) {
+                        value_mark(&obj->slots[i]);
                 }
+                return;
+        }
+
+        for (int i = 0; i < obj->count; ++i) {
+                value_mark(&obj->entries[i].key);
+                value_mark(&obj->entries[i].value);
         }
 }
 
+/*
+ * Anything allocated since the last collection is a root (see value_mark_fresh()).
+ */
 void
-object_sweep(void)
-{
-        while (object_chain != NULL && object_chain->mark == GC_NONE) {
-                struct object *next = object_chain->next;
-                freeobj(object_chain);
-                object_chain = next;
-        }
-        if (object_chain != NULL) {
-                object_chain->mark &= ~GC_MARK;
-        }
-        for (struct object *obj = object_chain; obj != NULL && obj->next != NULL;) {
-                struct object *next;
-                if (obj->next->mark == GC_NONE) {
-                        next = obj->next->next;
-                        freeobj(obj->next);
-                        obj->next = next;
+object_mark_fresh(void)
+{
+        for (struct object *obj = objects.fresh; obj != NULL; obj = obj->next) {
+                if (!(obj->mark & gc_skip)) {
+                        object_mark(obj);
+                }
+        }
+}
+
+bool
+object_has_young(struct object const *obj)
+{
+        if (obj->shape != dictionary) {
+                for (int i = 0; i < obj->count; ++i) {
+                        if (value_is_young(&obj->slots[i])) {
+                                return true;
+                        }
+                }
+                return false;
+        }
+
+        for (int i = 0; i < obj->count; ++i) {
+                if (value_is_young(&obj->entries[i].key) || value_is_young(&obj->entries[i].value)) {
+                        return true;
+                }
+        }
+
+        return false;
+}
+
+/*
+ * The number of bytes that obj and its storage take up.
+ */
+static size_t
+size(struct object const *obj)
+{
+        size_t n = gc_size(obj);
+
+        if (obj->shape != dictionary) {
+                return n + obj->capacity * sizeof (struct value);
+        }
+
+        n += obj->capacity * sizeof (struct object_entry);
+
+        if (obj->index != NULL) {
+                n += 2 * obj->capacity * sizeof (int);
+        }
+
+        return n;
+}
+
+/*
+ * Like value_array_sweep().
+ */
+size_t
+object_sweep(bool major)
+{
+        struct object *obj, *next;
+        size_t n = 0;
+
+        if (major) {
+                objects.unswept = objects.old;
+                objects.nunswept = objects.nold;
+                objects.old = NULL;
+                objects.nold = 0;
+        }
+
+        for (obj = objects.aging; obj != NULL; obj = next) {
+                next = obj->next;
+                if (obj->mark & (GC_MARK | GC_HARD)) {
+                        obj->mark = (obj->mark & ~GC_MARK) | GC_OLD;
+                        obj->next = objects.old;
+                        objects.old = obj;
+                        objects.nold += 1;
+                        if (!major) {
+                                gc_remember(OBJECT(obj));
+                        }
+                        n += size(obj);
                 } else {
-                        next = obj->next;
+                        freeobj(obj);
                 }
-                if (next != NULL) {
-                        next->mark &= ~GC_MARK;
+        }
+
+        for (obj = objects.fresh; obj != NULL; obj = next) {
+                next = obj->next;
+                obj->mark &= ~GC_MARK;
+                if (major) {
+                        obj->mark |= GC_OLD;
+                        obj->next = objects.old;
+                        objects.old = obj;
+                        objects.nold += 1;
+                        n += size(obj);
                 }
-                obj = next;
         }
+
+        objects.aging = major ? NULL : objects.fresh;
+        objects.fresh = NULL;
+
+        return n;
+}
+
+/*
+ * Like value_array_sweep_old().
+ */
+size_t
+object_sweep_old(int *budget)
+{
+        struct object *obj;
+        size_t n = 0;
+
+        for (; *budget > 0 && (obj = objects.unswept) != NULL; --*budget) {
+                objects.unswept = obj->next;
+                objects.nunswept -= 1;
+                if (obj->mark & (GC_MARK | GC_HARD)) {
+                        obj->mark &= ~GC_MARK;
+                        obj->next = objects.old;
+                        objects.old = obj;
+                        objects.nold += 1;
+                        n += size(obj);
+                } else {
+                        freeobj(obj);
+                }
+        }
+
+        return n;
+}
+
+size_t
+object_unswept(void)
+{
+        return objects.nunswept;
 }
 
 void
 object_gc_reset(void)
 {
-        object_chain = NULL;
+        memset(&objects, 0, sizeof objects);
+}
+
+static void
+shape_free(struct shape *s)
+{
+        for (int i = 0; i < s->transitions.count; ++i) {
+                shape_free(s->transitions.items[i]);
+        }
+
+        vec_empty(s->transitions);
+        free(s);
+}
+
+/*
+ * Free every object, and the shapes too (see gc_destroy()).
+ */
+void
+object_gc_destroy(void)
+{
+        struct object *chains[] = { objects.fresh, objects.aging, objects.old, objects.unswept };
+
+        for (int i = 0; i < sizeof chains / sizeof chains[0]; ++i) {
+                for (struct object *obj = chains[i], *next; obj != NULL; obj = next) {
+                        next = obj->next;
+                        freeobj(obj);
+                }
+        }
+
+        if (root != NULL) {
+                shape_free(root);
+                shape_free(dictionary);
+                root = dictionary = NULL;
+                shapecount = 0;
+        }
+
+        object_gc_reset();
 }
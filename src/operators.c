@@ -9,13 +9,11 @@
 static struct value
 str_concat(struct value const *s1, struct value const *s2)
 {
-        size_t n = s1->bytes + s2->bytes;
-        struct string *s = value_string_alloc(n);
+        struct value s = *s1;
 
-        memcpy(s->data, s1->string, s1->bytes);
-        memcpy(s->data + s1->bytes, s2->string, s2->bytes);
+        memcpy(value_string_append(&s, s2->bytes), s2->string, s2->bytes);
 
-        return STRING(s->data, n, s);
+        return s;
 }
 
 struct value
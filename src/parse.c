@@ -18,6 +18,7 @@
 #include "value.h"
 #include "log.h"
 #include "vm.h"
+#include "tls.h"
 
 #define BINARY_OPERATOR(name, token, prec, right_assoc) \
         static struct expression * \
@@ -85,14 +86,14 @@ enum {
         LV_ANY
 };
 
-static jmp_buf jb;
-static char errbuf[MAX_ERR_LEN + 1];
+static TLS jmp_buf jb;
+static TLS char errbuf[MAX_ERR_LEN + 1];
 
-static vec(struct token) tokens;
-static int tokidx = 0;
-enum lex_context lex_ctx = LEX_PREFIX;
+static TLS vec(struct token) tokens;
+static TLS int tokidx = 0;
+TLS enum lex_context lex_ctx = LEX_PREFIX;
 
-static int depth;
+static TLS int depth;
 
 static struct statement BREAK_STATEMENT    = { .type = STATEMENT_BREAK,    .loc = {42, 42} };
 static struct statement CONTINUE_STATEMENT = { .type = STATEMENT_CONTINUE, .loc = {42, 42} };
@@ -129,7 +130,7 @@ tok(void);
 char *
 gensym(void)
 {
-        static int sym = 0;
+        static TLS int sym = 0;
         char buf[24];
 
         sprintf(buf, ":%d", sym++);
@@ -2,6 +2,7 @@
 
 #include "log.h"
 #include "value.h"
+#include "object.h"
 #include "alloc.h"
 #include "vm.h"
 #include "state.h"
@@ -38,18 +39,56 @@ mkstate(void)
         return s;
 }
 
-inline static void
-markall(struct input_state *s)
+/*
+ * Walk the trie with an explicit stack, since a long enough key sequence could otherwise
+ * overflow the C stack during GC.
+ */
+static void
+markall(struct input_state *start)
 {
-        if (s == NULL)
-                return;
+        vec(struct input_state *) pending;
+        vec_init(pending);
+        vec_push(pending, start);
 
-        if (s->has_action)
-                value_mark(&s->f);
+        while (pending.count > 0) {
+                struct input_state *s = *vec_pop(pending);
 
-        int n = s->transitions.count;
-        for (int i = 0; i < n; ++i)
-                markall(s->transitions.items[i].s);
+                if (s == NULL)
+                        continue;
+
+                if (s->has_action)
+                        value_mark(&s->f);
+
+                int n = s->transitions.count;
+                for (int i = 0; i < n; ++i)
+                        vec_push(pending, s->transitions.items[i].s);
+        }
+
+        vec_empty(pending);
+}
+
+static void
+freeall(struct input_state *start)
+{
+        vec(struct input_state *) pending;
+        vec_init(pending);
+        vec_push(pending, start);
+
+        while (pending.count > 0) {
+                struct input_state *s = *vec_pop(pending);
+
+                if (s == NULL)
+                        continue;
+
+                int n = s->transitions.count;
+                for (int i = 0; i < n; ++i)
+                        vec_push(pending, s->transitions.items[i].s);
+
+                vec_empty(s->transitions);
+                free(s);
+        }
+
+        vec_empty(pending);
 }
 
 inline static struct input_state *
@@ -129,6 +168,22 @@ state_new(void)
         return state;
 }
 
+/*
+ * Free the key maps and handlers of 's'. The message handlers object belongs to the GC.
+ */
+void
+state_free(struct state *s)
+{
+        freeall(s->normal_start);
+        freeall(s->insert_start);
+        freeall(s->txtobj_start);
+
+        vec_empty(s->input_buffer);
+
+        for (int i = 0; i < NUM_EVENTS; ++i)
+                vec_empty(s->event_handlers[i]);
+}
+
 void
 state_push_input(struct state *s, char const *key)
 {
@@ -238,6 +293,8 @@ state_mark_actions(struct state *s)
 void
 state_register_message_handler(struct state *s, struct value type, struct value f)
 {
+        /* incoming types are only interned if they match one of these (see buffer.c) */
+        type = STRING_INTERN(type.string, type.bytes);
         object_put_value(s->message_handlers, type, f);
 }
 
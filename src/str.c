@@ -4,13 +4,14 @@
 #include "value.h"
 #include "util.h"
 #include "vm.h"
+#include "tls.h"
 
-static struct stringpos limitpos = {
+static TLS struct stringpos limitpos = {
         .columns = -1,
         .column  = 0,
         .lines   = -1,
 };
-static struct stringpos outpos;
+static TLS struct stringpos outpos;
 
 inline static void
 stringcount(char const *s, int byte_lim, int grapheme_lim)
@@ -135,7 +136,7 @@ string_search(struct value *string, value_vector *args)
                 n = match - s;
         } else {
                 int len = string->bytes;
-                pcre *re = pattern.regex;
+                pcre *re = pattern.regex->re;
                 int rc;
                 int out[3];
 
@@ -189,21 +190,20 @@ string_split(struct value *string, value_vector *args)
                 
                 while (i < len) {
 
-                        struct value str = STRING_VIEW(*string, i, 0);
+                        int start = i;
 
                         while (i < len && !is_prefix(s + i, len - i, p, n)) {
-                                ++str.bytes;
                                 ++i;
                         }
 
-                        vec_push(*result.array, str);
+                        value_array_push(result.array, STRING_VIEW(*string, start, i - start));
 
                         while (i < len && is_prefix(s + i, len - i, p, n)) {
                                 i += n;
                         }
                 }
         } else {
-                pcre *re = pattern.regex;
+                pcre *re = pattern.regex->re;
                 int len = string->bytes;
                 int start = 0;
                 int out[3];
@@ -223,7 +223,7 @@ string_split(struct value *string, value_vector *args)
                                 goto next;
                         }
 
-                        vec_push(*result.array, STRING_VIEW(*string, start, n));
+                        value_array_push(result.array, STRING_VIEW(*string, start, n));
 next:
                         start = out[1];
                 }
@@ -235,7 +235,7 @@ next:
 static struct value
 string_replace(struct value *string, value_vector *args)
 {
-        static vec(char) chars = { .items = NULL, .count = 0, .capacity = 0 };
+        static TLS vec(char) chars = { .items = NULL, .count = 0, .capacity = 0 };
 
         if (args->count != 2) {
                 vm_panic("the replace method on strings expects 2 arguments but got %zu", args->count);
@@ -280,7 +280,7 @@ string_replace(struct value *string, value_vector *args)
 
                 vec_push_n(chars, s, len);
         } else if (replacement.type == VALUE_STRING) {
-                pcre *re = pattern.regex;
+                pcre *re = pattern.regex->re;
                 char const *r = replacement.string;
                 int len = string->bytes;
                 int start = 0;
@@ -298,7 +298,7 @@ string_replace(struct value *string, value_vector *args)
                 vec_push_n(chars, s + start, len - start);
 
         } else {
-                pcre *re = pattern.regex;
+                pcre *re = pattern.regex->re;
                 int len = string->bytes;
                 int start = 0;
                 int out[30];
@@ -317,7 +317,7 @@ string_replace(struct value *string, value_vector *args)
 
                                 int j = 0;
                                 for (int i = 0; i < rc; ++i, j += 2) {
-                                        vec_push(*match.array, STRING_VIEW(*string, out[j], out[j + 1] - out[j]));
+                                        value_array_push(match.array, STRING_VIEW(*string, out[j], out[j + 1] - out[j]));
                                 }
                         }
 
@@ -354,7 +354,7 @@ string_is_match(struct value *string, value_vector *args)
         int rc;
 
         rc = pcre_exec(
-                pattern.regex,
+                pattern.regex->re,
                 NULL,
                 string->string,
                 len,
@@ -384,12 +384,12 @@ string_match(struct value *string, value_vector *args)
                 vm_panic("non-regex passed to the match method on string");
         }
 
-        static int ovec[30];
+        static TLS int ovec[30];
         int len = string->bytes;
         int rc;
 
         rc = pcre_exec(
-                pattern.regex,
+                pattern.regex->re,
                 NULL,
                 string->string,
                 len,
@@ -413,11 +413,11 @@ string_match(struct value *string, value_vector *args)
                 match = STRING_VIEW(*string, ovec[0], ovec[1] - ovec[0]);
         } else {
                 match = ARRAY(value_array_new());
-                vec_reserve(*match.array, rc);
+                value_array_reserve(match.array, rc);
 
                 int j = 0;
                 for (int i = 0; i < rc; ++i, j += 2) {
-                        vec_push(*match.array, STRING_VIEW(*string, ovec[j], ovec[j + 1] - ovec[j]));
+                        value_array_push(match.array, STRING_VIEW(*string, ovec[j], ovec[j + 1] - ovec[j]));
                 }
         }
 
@@ -439,14 +439,14 @@ string_matches(struct value *string, value_vector *args)
 
         struct value result = ARRAY(value_array_new());
 
-        static int ovec[30];
+        static TLS int ovec[30];
         char const *s = string->string;
         int len = string->bytes;
         int rc;
 
         while ((rc = pcre_exec(
-                        pattern.regex,
-                        pattern.extra,
+                        pattern.regex->re,
+                        pattern.regex->extra,
                         s,
                         len,
                         0,
@@ -461,15 +461,15 @@ string_matches(struct value *string, value_vector *args)
                         match = STRING_VIEW(*string, ovec[0], ovec[1] - ovec[0]);
                 } else {
                         match = ARRAY(value_array_new());
-                        vec_reserve(*match.array, rc);
+                        value_array_reserve(match.array, rc);
 
                         int j = 0;
                         for (int i = 0; i < rc; ++i, j += 2) {
-                                vec_push(*match.array, STRING_VIEW(*string, ovec[j], ovec[j + 1] - ovec[j]));
+                                value_array_push(match.array, STRING_VIEW(*string, ovec[j], ovec[j + 1] - ovec[j]));
                         }
                 }
 
-                vec_push(*result.array, match);
+                value_array_push(result.array, match);
 
                 s += ovec[1];
                 len -= ovec[1];
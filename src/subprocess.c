@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
@@ -14,6 +16,7 @@
 #include "buffer.h"
 #include "log.h"
 #include "vm.h"
+#include "tls.h"
 
 struct sp {
         pid_t pid;
@@ -22,103 +25,112 @@ struct sp {
         struct value on_output;
         struct value on_exit;
         char *path;
+        int idx; // position in 'jobs'
 };
 
-static vec(struct sp) jobs;
+static TLS vec(struct sp *) jobs;
 
-/* find a job given the fd for the read-end of its pipe */
-inline static int
-outfind(int fd)
-{
-        for (int i = 0; i < jobs.count; ++i)
-                if (jobs.items[i].output == fd)
-                        return i;
-        return -1;
-}
+/*
+ * Jobs indexed by the fd of the write-end of their pipe (the fd that scripts
+ * hold on to), so that we never have to search for them.
+ */
+static TLS vec(struct sp *) byinput;
 
 /* find a job given the fd for the write-end of its pipe */
-inline static int
+inline static struct sp *
 infind(int fd)
 {
-        for (int i = 0; i < jobs.count; ++i)
-                if (jobs.items[i].input == fd)
-                        return i;
-        return -1;
+        if (fd < 0 || fd >= byinput.count)
+                return NULL;
+        return byinput.items[fd];
 }
 
 inline static void
-deljob(int i)
+deljob(struct sp *job)
 {
-        close(jobs.items[i].input);
-        close(jobs.items[i].output);
-        free(jobs.items[i].path);
+        close(job->input);
+        close(job->output);
+        free(job->path);
 
-        struct value f = jobs.items[i].on_exit;
+        if (byinput.items[job->input] == job)
+                byinput.items[job->input] = NULL;
 
-        jobs.items[i] = *vec_last(jobs);
+        jobs.items[job->idx] = *vec_last(jobs);
+        jobs.items[job->idx]->idx = job->idx;
         --jobs.count;
 
+        struct value f = job->on_exit;
+
+        free(job);
+
         if (f.type != VALUE_NIL)
                 vm_eval_function(&f, &NIL);
 }
 
-bool
+static void
+closepipes(int (*ps)[2], int n)
+{
+        for (int i = 0; i < n; ++i) {
+                close(ps[i][0]);
+                close(ps[i][1]);
+        }
+}
+
+/*
+ * With PLUM_THREADED_BUFFERS every buffer shares one fd table, so another buffer may fork at any
+ * moment: the pipes are all made close-on-exec from the start (dup2() clears the flag on the
+ * child's stdio) so that its child can't inherit them, and the child only calls async-signal-safe
+ * functions between fork() and execvp().
+ */
+struct sp *
 sp_tryspawn(char *path, struct value_array *args, struct value on_output, struct value on_exit, int fds[static 2])
 {
         pid_t pid;
 
-        int c2p[2];
-        int p2c[2];
-        int exc[2];
+        int ps[3][2];
+        int *c2p = ps[0];
+        int *p2c = ps[1];
+        int *exc = ps[2];
 
-        if (pipe(c2p) != 0) {
-                return false;
-        }
-        if (pipe(p2c) != 0) {
-                close(c2p[0]);
-                close(c2p[1]);
-                return false;
+        for (int i = 0; i < 3; ++i) {
+                if (pipe2(ps[i], O_CLOEXEC) != 0) {
+                        closepipes(ps, i);
+                        return NULL;
+                }
         }
-        if (pipe(exc) != 0) {
-                close(c2p[0]);
-                close(c2p[1]);
-                close(p2c[0]);
-                close(p2c[1]);
-                return false;
+
+        int argc = min(16, args->count);
+        char *argv[18] = { path };
+        for (int i = 0; i < argc; ++i) {
+                argv[i + 1] = alloc(args->items[i].bytes + 1);
+                memcpy(argv[i + 1], args->items[i].string, args->items[i].bytes);
+                argv[i + 1][args->items[i].bytes] = '\0';
         }
+        argv[argc + 1] = NULL;
 
-        if (pid = fork(), pid == -1)
-                return false;
+        pid = fork();
 
         if (pid == 0) {
                 // child
-                close(c2p[0]);
-                close(p2c[1]);
-                close(exc[0]);
                 if (dup2(p2c[0], STDIN_FILENO) == -1
                 ||  dup2(c2p[1], STDOUT_FILENO) == -1
                 ||  dup2(c2p[1], STDERR_FILENO) == -1) {
                         write(exc[1], &errno, sizeof errno);
-                        exit(EXIT_FAILURE);
+                        _exit(EXIT_FAILURE);
                 }
 
-                /* close the exc pipe after we exec, so the parent knows everything worked */
-                fcntl(exc[1], F_SETFD, FD_CLOEXEC);
-
-                char *argv[17] = { path };
-                for (int i = 0; i < 16 && i < args->count; ++i) {
-                        argv[i + 1] = alloc(args->items[i].bytes + 1);
-                        memcpy(argv[i + 1], args->items[i].string, args->items[i].bytes);
-                        argv[i + 1][args->items[i].bytes] = '\0';
-                }
-                argv[min(16, args->count + 1)] = NULL;
+                /* the exc pipe is closed when we exec, so the parent knows everything worked */
+                execvp(path, argv);
+                write(exc[1], &errno, sizeof errno);
+                _exit(EXIT_FAILURE);
+        }
 
-                if (execvp(path, argv) == -1) {
-                        write(exc[1], &errno, sizeof errno);
-                        exit(EXIT_FAILURE);
-                }
+        for (int i = 1; i <= argc; ++i)
+                free(argv[i]);
 
-                return false;
+        if (pid == -1) {
+                closepipes(ps, 3);
+                return NULL;
         } else {
                 // parent
                 close(c2p[1]);
@@ -132,79 +144,111 @@ sp_tryspawn(char *path, struct value_array *args, struct value on_output, struct
                         close(c2p[0]);
                         close(p2c[1]);
                         close(exc[0]);
-                        return false;
+                        return NULL;
                 }
 
                 close(exc[0]);
 
                 // everything went well. add the process to the list.
-                struct sp sp = {
+                struct sp *sp = alloc(sizeof *sp);
+                *sp = (struct sp) {
                         .pid = pid,
                         .input = p2c[1],
                         .output = c2p[0],
                         .on_output = on_output,
                         .on_exit = on_exit,
-                        .path = path
+                        .path = path,
+                        .idx = jobs.count
                 };
 
                 vec_push(jobs, sp);
 
-                fds[0] = sp.input;
-                fds[1] = sp.output;
+                while (byinput.count <= sp->input)
+                        vec_push(byinput, NULL);
+                byinput.items[sp->input] = sp;
+
+                fds[0] = sp->input;
+                fds[1] = sp->output;
+
+                return sp;
+        }
+}
 
-                return true;
+void
+sp_mark(void)
+{
+        for (int i = 0; i < jobs.count; ++i) {
+                value_mark(&jobs.items[i]->on_output);
+                value_mark(&jobs.items[i]->on_exit);
         }
 }
 
 bool
 sp_fdvalid(int fd)
 {
-        return infind(fd) != -1;
+        return infind(fd) != NULL;
+}
+
+int
+sp_output_fd(struct sp const *job)
+{
+        return job->output;
 }
 
 void
-sp_on_exit(int fd)
+sp_on_exit(struct sp *job)
 {
-        int i = outfind(fd);
-        deljob(i);
+        deljob(job);
 }
 
 void
-sp_on_output(int fd, char const *data, int n)
+sp_on_output(struct sp *job, char const *data, int n)
 {
-        int i = outfind(fd);
-        if (jobs.items[i].on_output.type == VALUE_NIL)
+        if (job->on_output.type == VALUE_NIL)
                 return;
 
         struct value string = STRING_CLONE(data, n);
-        vm_eval_function(&jobs.items[i].on_output, &string);
+        vm_eval_function(&job->on_output, &string);
 }
 
 void
 sp_kill(int fd)
 {
-        int i = infind(fd);
-        kill(jobs.items[i].pid, SIGTERM);
+        struct sp *job = infind(fd);
+        kill(job->pid, SIGTERM);
 }
 
 void
 sp_close(int fd)
 {
-        if (infind(fd) != -1)
+        if (infind(fd) != NULL)
                 close(fd);
 }
 
+void
+sp_close_all(void)
+{
+        for (int i = 0; i < jobs.count; ++i) {
+                struct sp *job = jobs.items[i];
+                close(job->input);
+                close(job->output);
+                free(job->path);
+                free(job);
+        }
+
+        vec_empty(jobs);
+        vec_empty(byinput);
+}
+
 void
 sp_wait(int fd)
 {
         char buffer[1024];
         int n;
 
-        int i = infind(fd);
-        assert(i != -1);
-
-        int in = jobs.items[i].output;
+        struct sp *job = infind(fd);
+        assert(job != NULL);
 
-        while ((n = read(in, buffer, sizeof buffer)) > 0)
-                sp_on_output(in, buffer, n);
+        while ((n = read(job->output, buffer, sizeof buffer)) > 0)
+                sp_on_output(job, buffer, n);
 }
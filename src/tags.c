@@ -1,9 +1,12 @@
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 
 #include "alloc.h"
 #include "log.h"
 #include "vec.h"
+#include "tls.h"
+#include "vm.h"
 
 struct tags;
 
@@ -19,9 +22,9 @@ struct tags {
         vec(struct link) links;
 };
 
-static int tagcount = 0;
-static vec(struct tags *) lists;
-static vec(char const *) names;
+static TLS int tagcount = 0;
+static TLS vec(struct tags *) lists;
+static TLS vec(char const *) names;
 
 static struct tags *
 mklist(int tag, struct tags *next)
@@ -47,6 +50,19 @@ tags_init(void)
         mklist(tagcount++, NULL);
 }
 
+void
+tags_destroy(void)
+{
+        for (int i = 0; i < lists.count; ++i) {
+                vec_empty(lists.items[i]->links);
+                free(lists.items[i]);
+        }
+
+        vec_empty(lists);
+        vec_empty(names);
+        tagcount = 0;
+}
+
 int
 tags_new(char const *tag)
 {
@@ -76,6 +92,13 @@ tags_push(int n, int tag)
                 }
         }
 
+        /*
+         * Values only have room for 16 bits of tags.
+         */
+        if (lists.count > UINT16_MAX) {
+                vm_panic("too many distinct combinations of tags");
+        }
+
         struct tags *new = mklist(tag, t);
         vec_push(t->links, ((struct link){ .t = new, .tag = tag }));
 
@@ -101,7 +124,7 @@ tags_first(int tags)
 char const *
 tags_wrap(char const *s, int tags)
 {
-        static vec(char) cs = { .items = 0, .count = 0, .capacity = 0 };
+        static TLS vec(char) cs = { .items = 0, .count = 0, .capacity = 0 };
 
         struct tags *list = lists.items[tags];
         int n = 0;
@@ -20,6 +20,7 @@
 #include "alloc.h"
 #include "utf8.h"
 #include "vm.h"
+#include "tls.h"
 
 #define RIGHT(s) ((s)->right + (s)->capacity - (s)->rightcount)
 #define CURRENT_EDIT(s) (&(s)->edits.items[(s)->edits.count - 1])
@@ -49,8 +50,8 @@ struct edit {
         vec(struct change) changes;
 };
 
-static struct stringpos limitpos;
-static struct stringpos outpos;
+static TLS struct stringpos limitpos;
+static TLS struct stringpos outpos;
 
 /*
  * If necessary, grow the left and right buffers in s so that
@@ -642,6 +643,115 @@ tb_murder(struct tb *s)
         vec_empty(s->edits);
 }
 
+/*
+ * Write everything in 's' (the text, the cursor state, and the undo history) to 'f' and
+ * release all of the memory it was using. 's' must not be used again until tb_wake() is
+ * called. Markers are left alone, since other code holds pointers to them.
+ */
+bool
+tb_hibernate(struct tb *s, FILE *f)
+{
+        int edits = s->edits.count;
+
+        if (fwrite(s, sizeof *s, 1, f) != 1
+        ||  fwrite(s->left, 1, s->leftcount, f) != s->leftcount
+        ||  fwrite(RIGHT(s), 1, s->rightcount, f) != s->rightcount
+        ||  fwrite(&edits, sizeof edits, 1, f) != 1)
+                return false;
+
+        for (int i = 0; i < s->edits.count; ++i) {
+                struct edit const *e = &s->edits.items[i];
+                int changes = e->changes.count;
+                if (fwrite(&e->when, sizeof e->when, 1, f) != 1 || fwrite(&changes, sizeof changes, 1, f) != 1)
+                        return false;
+                for (int j = 0; j < e->changes.count; ++j) {
+                        struct change const *c = &e->changes.items[j];
+                        int n = c->data.count;
+                        if (fwrite(c, sizeof *c, 1, f) != 1
+                        ||  fwrite(&n, sizeof n, 1, f) != 1
+                        ||  fwrite(c->data.items, 1, n, f) != n)
+                                return false;
+                }
+        }
+
+        if (fflush(f) != 0)
+                return false;
+
+        free(s->left);
+        free(s->right);
+        s->left = s->right = NULL;
+
+        for (int i = 0; i < s->edits.count; ++i) {
+                free_edit(&s->edits.items[i]);
+                vec_empty(s->edits.items[i].changes);
+        }
+        vec_empty(s->edits);
+
+        return true;
+}
+
+/*
+ * Restore the state of 's' from a snapshot written to 'f' by tb_hibernate().
+ */
+bool
+tb_wake(struct tb *s, FILE *f)
+{
+        struct tb t;
+        int edits;
+
+        if (fread(&t, sizeof t, 1, f) != 1)
+                return false;
+
+        t.markers = s->markers;
+        t.markers_allocated = s->markers_allocated;
+
+        t.left = alloc(t.capacity + 1);
+        t.right = alloc(t.capacity + 1);
+        vec_init(t.edits);
+
+        if (fread(t.left, 1, t.leftcount, f) != t.leftcount
+        ||  fread(RIGHT(&t), 1, t.rightcount, f) != t.rightcount
+        ||  fread(&edits, sizeof edits, 1, f) != 1)
+                goto Fail;
+
+        vec_reserve(t.edits, edits);
+
+        for (int i = 0; i < edits; ++i) {
+                struct edit e;
+                int changes;
+                if (fread(&e.when, sizeof e.when, 1, f) != 1 || fread(&changes, sizeof changes, 1, f) != 1)
+                        goto Fail;
+                vec_init(e.changes);
+                for (int j = 0; j < changes; ++j) {
+                        struct change c;
+                        int n;
+                        if (fread(&c, sizeof c, 1, f) != 1 || fread(&n, sizeof n, 1, f) != 1)
+                                goto Fail;
+                        vec_init(c.data);
+                        vec_reserve(c.data, n);
+                        if (fread(c.data.items, 1, n, f) != n)
+                                goto Fail;
+                        c.data.count = n;
+                        vec_push(e.changes, c);
+                }
+                vec_push(t.edits, e);
+        }
+
+        *s = t;
+
+        return true;
+
+Fail:
+        free(t.left);
+        free(t.right);
+        for (int i = 0; i < t.edits.count; ++i) {
+                free_edit(&t.edits.items[i]);
+                vec_empty(t.edits.items[i].changes);
+        }
+        vec_empty(t.edits);
+        return false;
+}
+
 int
 tb_seek(struct tb *s, int i)
 {
@@ -716,7 +826,7 @@ tb_append_line(struct tb *s, char const *data, int n)
 int
 tb_read(struct tb *s, int fd)
 {
-        static char buf[4096];
+        static TLS char buf[4096];
 
         int n;
         while (n = read(fd, buf, sizeof buf), n > 0)
@@ -1174,49 +1284,66 @@ tb_find_prev(struct tb *s, char const *c, int n)
 
 }
 
+static struct value
+slab_line(struct string **slab, char const *l, int lb, char const *r, int rb)
+{
+        return STRING(value_slab_string(slab, l, lb, r, rb), lb + rb);
+}
+
+/*
+ * The lines are carved out of slabs (see value_slab_string()) rather than allocated one by one,
+ * since f usually drops each of them as soon as it returns.
+ */
 void
 tb_each_line(struct tb const *s, struct value *f)
 {
-        f->refs->mark |= GC_HARD;
+        bool closure = f->type == VALUE_FUNCTION;
+        if (closure)
+                f->function->mark |= GC_HARD;
+
+        struct string *slab = NULL;
+        struct value line;
 
         int ln = 0;
         char const *l = s->left;
         char const *end = s->left + s->leftcount;
+        char const *start;
 
-        for (char const *start = l; l != end; ++l) {
+        for (start = l; l != end; ++l) {
                 if (*l != '\n') 
                         continue;
 
-                struct value line = STRING_CLONE(start, l - start);
+                line = slab_line(&slab, start, l - start, l, 0);
                 vm_eval_function2(f, &line, &INTEGER(ln));
 
                 ++ln;
                 start = l + 1;
         }
 
-        struct value current = tb_get_line(s, s->line);
-        vm_eval_function2(f, &current, &INTEGER(ln));
-
-        ++ln;
-
+        /*
+         * The line that the cursor is on is split between the two halves of the buffer.
+         */
         char const *r = RIGHT(s);
         end = r + s->rightcount;
-        char const *start;
-        for (start = r; r != end; ++r) {
-                if (*r != '\n') 
-                        continue;
+        while (r != end && *r != '\n')
+                ++r;
 
-                struct value line = STRING_CLONE(start, r - start);
-                vm_eval_function2(f, &line, &INTEGER(ln));
+        line = slab_line(&slab, start, l - start, RIGHT(s), r - RIGHT(s));
+        vm_eval_function2(f, &line, &INTEGER(ln));
 
-                ++ln;
-                start = r + 1;
+        while (r != end) {
+                start = ++r;
+                while (r != end && *r != '\n')
+                        ++r;
+
+                line = slab_line(&slab, start, r - start, r, 0);
+                vm_eval_function2(f, &line, &INTEGER(++ln));
         }
 
-        struct value line = STRING_CLONE(start, r - start);
-        vm_eval_function2(f, &line, &INTEGER(ln));
+        value_slab_done(slab);
 
-        f->refs->mark &= ~GC_HARD;
+        if (closure)
+                f->function->mark &= ~GC_HARD;
 }
 
 struct value
@@ -1240,7 +1367,7 @@ tb_get_line(struct tb const *s, int i)
                 memcpy(line->data, l, lb);
                 memcpy(line->data + lb, r, rb);
 
-                return STRING(line->data, lb + rb, line);
+                return STRING(line, lb + rb);
         }
 
         char const *p;
@@ -1701,6 +1828,36 @@ TEST(undo_grouping)
         claim(tb_compare_cstr(&s, "HELLO") == 0);
 }
 
+TEST(hibernate)
+{
+        struct tb s = tb_new();
+
+        tb_insert(&s, "HELLO", 5);
+
+        tb_start_history(&s);
+        tb_start_new_edit(&s);
+        tb_insert(&s, " WORLD!", 7);
+        tb_backward(&s, 3);
+
+        FILE *f = tmpfile();
+        claim(f != NULL);
+
+        claim(tb_hibernate(&s, f));
+        claim(s.left == NULL);
+        claim(s.edits.count == 0);
+
+        rewind(f);
+        claim(tb_wake(&s, f));
+        fclose(f);
+
+        claim(tb_compare_cstr(&s, "HELLO WORLD!") == 0);
+        claim(s.character == 9);
+        claim(s.edits.count == 1);
+
+        claim(tb_undo(&s));
+        claim(tb_compare_cstr(&s, "HELLO") == 0);
+}
+
 TEST(find_next)
 {
         struct tb s = tb_new();
@@ -6,8 +6,9 @@
 #include "token.h"
 #include "alloc.h"
 #include "util.h"
+#include "tls.h"
 
-static char token_show_buffer[512];
+static TLS char token_show_buffer[512];
 
 static struct {
         char const *string;
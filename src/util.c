@@ -6,6 +6,7 @@
 
 #include "panic.h"
 #include "alloc.h"
+#include "tls.h"
 
 uintmax_t
 umax(uintmax_t a, uintmax_t b)
@@ -59,7 +60,7 @@ slurp(char const *path)
         int used = 0;
 
         int n;
-        static char buffer[4096];
+        static TLS char buffer[4096];
         while ((n = fread(buffer, 1, sizeof buffer, f)) != 0) {
                 if (n + used >= capacity) {
                         capacity += n;
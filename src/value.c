@@ -5,6 +5,7 @@
 #include <inttypes.h>
 #include <math.h>
 
+#include "alloc.h"
 #include "value.h"
 #include "test.h"
 #include "util.h"
@@ -13,10 +14,67 @@
 #include "log.h"
 #include "gc.h"
 #include "vm.h"
+#include "tls.h"
+
+/*
+ * Each kind of GC object is on one of three chains: 'fresh' ones have been allocated since the
+ * last collection, 'aging' ones have survived one, and 'old' ones have survived two (see gc.c).
+ */
+/*
+ * A major collection leaves the old objects on 'unswept' for gc.c to sweep a batch at a time (see
+ * value_array_sweep_old()). 'nold' and 'nunswept' are the lengths of those two chains.
+ */
+static TLS struct { struct value_array *fresh, *aging, *old, *unswept; size_t nold, nunswept; } arrays;
+static TLS struct { struct function *fresh, *aging, *old, *unswept; size_t nold, nunswept; } functions;
+static TLS struct { struct string *fresh, *aging, *old, *unswept; size_t nold, nunswept; } strings;
+
+/*
+ * The interned strings, open-addressed by hash with linear probing and kept at most half full.
+ * Like string literals they aren't on any string chain, so they live forever.
+ */
+static TLS struct {
+        struct string **items;
+        int *lengths;
+        int count;
+        int capacity;
+} interned;
+
+/*
+ * Slabs fill a GC page (less its header), and strings longer than SLAB_MAX aren't carved out of
+ * them (see value_slab_string()).
+ */
+enum {
+        SLAB_SIZE = (1 << 16) - 256,
+        SLAB_MAX  = 4096,
+};
+
+/*
+ * The string which the collector sees for s: its own, or if it's a slice, its slab's.
+ */
+inline static struct string *
+cell(char const *s)
+{
+        struct string *str = value_string_owner(s);
+        return (str->mark & GC_SLICE) ? str->next : str;
+}
+
+static bool
+strings_equal(struct value const *v1, struct value const *v2)
+{
+        if (v1->bytes != v2->bytes) {
+                return false;
+        }
 
-static struct value_array *array_chain;
-static struct ref_vector *ref_vector_chain;
-static struct string *string_chain;
+        if (v1->string == v2->string) {
+                return true;
+        }
+
+        if (value_string_owner(v1->string)->interned && value_string_owner(v2->string)->interned) {
+                return false;
+        }
+
+        return memcmp(v1->string, v2->string, v1->bytes) == 0;
+}
 
 static bool
 arrays_equal(struct value const *v1, struct value const *v2)
@@ -108,18 +166,34 @@ ary_hash(struct value const *a)
         return hash;
 }
 
+static unsigned long
+string_hash(struct value const *s)
+{
+        struct string *str = value_string_owner(s->string);
+
+        if (s->bytes != str->used) {
+                return str_hash(s->string, s->bytes);
+        }
+
+        if (str->hash == 0) {
+                str->hash = str_hash(s->string, s->bytes);
+        }
+
+        return str->hash;
+}
+
 unsigned long
 value_hash(struct value const *val)
 {
         switch (val->type) {
         case VALUE_NIL:       return 1;
         case VALUE_BOOLEAN:   return val->boolean ? 2 : 3;
-        case VALUE_STRING:    return str_hash(val->string, val->bytes);
+        case VALUE_STRING:    return string_hash(val);
         case VALUE_INTEGER:   return int_hash(val->integer);
         case VALUE_REAL:      return flt_hash(val->real);
         case VALUE_ARRAY:     return ary_hash(val);
         case VALUE_OBJECT:    return ptr_hash(val->object);
-        case VALUE_FUNCTION:  return ptr_hash(val->code);
+        case VALUE_FUNCTION:  return ptr_hash(val->function->code);
         case VALUE_REGEX:     return ptr_hash(val->regex);
         }
 
@@ -187,7 +261,7 @@ show_string(char const *s, size_t n)
 char *
 value_show(struct value const *v)
 {
-        static char buffer[1024];
+        static TLS char buffer[1024];
         char const *s = buffer;
 
         switch (v->type & ~VALUE_TAGGED) {
@@ -210,13 +284,13 @@ value_show(struct value const *v)
                 s = show_array(v);
                 break;
         case VALUE_REGEX:
-                snprintf(buffer, 1024, "/%s/", v->pattern);
+                snprintf(buffer, 1024, "/%s/", v->regex->pattern);
                 break;
         case VALUE_OBJECT:
                 snprintf(buffer, 1024, "<object at %p>", (void *) v->object);
                 break;
         case VALUE_FUNCTION:
-                snprintf(buffer, 1024, "<function at %p>", (void *) v->code);
+                snprintf(buffer, 1024, "<function at %p>", (void *) v->function->code);
                 break;
         case VALUE_BUILTIN_FUNCTION:
                 snprintf(buffer, 1024, "<builtin function>");
@@ -286,7 +360,7 @@ value_apply_predicate(struct value *p, struct value *v)
                         int rc;
 
                         rc = pcre_exec(
-                                p->regex,
+                                p->regex->re,
                                 NULL,
                                 s,
                                 len,
@@ -321,13 +395,13 @@ value_apply_callable(struct value const *f, struct value *v)
                         vm_panic("regex applied as predicate to non-string");
                 }
 
-                static int ovec[30];
+                static TLS int ovec[30];
                 char const *s = v->string;
                 int len = v->bytes;
                 int rc;
 
                 rc = pcre_exec(
-                        f->regex,
+                        f->regex->re,
                         NULL,
                         s,
                         len,
@@ -351,11 +425,11 @@ value_apply_callable(struct value const *f, struct value *v)
                         match = STRING_VIEW(*v, ovec[0], ovec[1] - ovec[0]);
                 } else {
                         match = ARRAY(value_array_new());
-                        vec_reserve(*match.array, rc);
+                        value_array_reserve(match.array, rc);
 
                         int j = 0;
                         for (int i = 0; i < rc; ++i, j += 2) {
-                                vec_push(*match.array, STRING_VIEW(*v, ovec[j], ovec[j + 1] - ovec[j]));
+                                value_array_push(match.array, STRING_VIEW(*v, ovec[j], ovec[j + 1] - ovec[j]));
                         }
                 }
 
@@ -383,10 +457,10 @@ value_test_equality(struct value const *v1, struct value const *v2)
         case VALUE_REAL:             if (v1->real != v2->real)                                                      return false; break;
         case VALUE_BOOLEAN:          if (v1->boolean != v2->boolean)                                                return false; break;
         case VALUE_INTEGER:          if (v1->integer != v2->integer)                                                return false; break;
-        case VALUE_STRING:           if (v1->bytes != v2->bytes || memcmp(v1->string, v2->string, v1->bytes) != 0)  return false; break;
+        case VALUE_STRING:           if (!strings_equal(v1, v2))                                                    return false; break;
         case VALUE_ARRAY:            if (!arrays_equal(v1, v2))                                                     return false; break;
         case VALUE_REGEX:            if (v1->regex != v2->regex)                                                    return false; break;
-        case VALUE_FUNCTION:         if (v1->code != v2->code)                                                      return false; break;
+        case VALUE_FUNCTION:         if (v1->function->code != v2->function->code)                                  return false; break;
         case VALUE_BUILTIN_FUNCTION: if (v1->builtin_function != v2->builtin_function)                              return false; break;
         case VALUE_OBJECT:           if (v1->object != v2->object)                                                  return false; break;
         case VALUE_TAG:              if (v1->tag != v2->tag)                                                        return false; break;
@@ -403,7 +477,7 @@ value_test_equality(struct value const *v1, struct value const *v2)
 inline static void
 value_array_mark(struct value_array *a)
 {
-        a->mark |= GC_MARK;
+        gc_set_mark(&a->mark);
 
         for (int i = 0; i < a->count; ++i) {
                 value_mark(&a->items[i]);
@@ -411,64 +485,377 @@ value_array_mark(struct value_array *a)
 }
 
 inline static void
-function_mark_references(struct value *v)
+function_mark(struct function *f)
 {
-        for (int i = 0; i < v->refs->count; ++i) {
-                vm_mark_variable((struct variable *)v->refs->refs[i].pointer);
+        gc_set_mark(&f->mark);
+
+        for (int i = 0; i < f->count; ++i) {
+                vm_mark_variable(f->vars[i]);
         }
+}
+
+/*
+ * Strings of at most one byte are interned the first time they're made, so that after that (for
+ * every ASCII character, say) they never have to be allocated.
+ */
+static TLS struct string *singles[257];
+
+static struct string *
+single(char const *s, int n)
+{
+        int i = (n == 0) ? 256 : (unsigned char) *s;
 
-        v->refs->mark |= GC_MARK;
+        if (singles[i] == NULL) {
+                singles[i] = value_intern_string(s, n);
+        }
+
+        return singles[i];
 }
 
 struct string *
 value_clone_string(char const *s, int n)
 {
-        struct string *str = gc_alloc(sizeof *str + n);
-        str->mark = GC_MARK;
-        str->next = string_chain;
-        string_chain = str;
+        if (n <= 1) {
+                return single(s, n);
+        }
 
+        struct string *str = value_string_alloc(n);
         memcpy(str->data, s, n);
-
         return str;
 }
 
 struct string *
 value_string_alloc(int n)
 {
-        struct string *str = gc_alloc(sizeof *str + n);
-        str->mark = GC_MARK;
-        str->next = string_chain;
-        string_chain = str;
+        struct string *str = gc_new(sizeof *str + n);
+        str->mark = GC_NONE;
+        str->interned = false;
+        str->hash = 0;
+        str->used = n;
+        str->next = strings.fresh;
+        strings.fresh = str;
+
+        return str;
+}
+
+/*
+ * n bytes for the caller to fill in, carved out of *slab.
+ */
+static struct string *
+slice(struct string **slab, int n)
+{
+        struct string *s = *slab;
+        int size = (sizeof *s + n + 7) & ~7;
+
+        if (s == NULL || s->used + size > gc_size(s) - offsetof(struct string, data)) {
+                if (s != NULL) {
+                        value_slab_done(s);
+                }
+                s = *slab = value_string_alloc(SLAB_SIZE);
+                s->mark |= GC_HARD;
+                s->used = 0;
+        }
+
+        struct string *str = (struct string *)(s->data + s->used);
+        str->mark = GC_SLICE;
+        str->interned = false;
+        str->hash = 0;
+        str->used = n;
+        str->next = s;
+
+        s->used += size;
+
+        return str;
+}
+
+/*
+ * Returns the string s[0..n) + t[0..m), carved out of *slab, starting a new slab when it's full,
+ * so that making lots of little strings at once costs one allocation rather than one each. The
+ * slab being carved from is pinned until it's full or value_slab_done() is called. A slice keeps
+ * its whole slab alive, so long strings get an allocation of their own, and strings of at most
+ * one byte are the shared ones.
+ */
+struct string *
+value_slab_string(struct string **slab, char const *s, int n, char const *t, int m)
+{
+        struct string *str;
+
+        if (n + m <= 1) {
+                return value_clone_string(n ? s : t, n + m);
+        }
+
+        if (n + m > SLAB_MAX) {
+                str = value_string_alloc(n + m);
+        } else {
+                str = slice(slab, n + m);
+        }
+
+        memcpy(str->data, s, n);
+        memcpy(str->data + n, t, m);
 
         return str;
 }
 
+void
+value_slab_done(struct string *slab)
+{
+        if (slab != NULL) {
+                slab->mark &= ~GC_HARD;
+        }
+}
+
+static void
+intern_grow(void)
+{
+        struct string **items = interned.items;
+        int *lengths = interned.lengths;
+        int capacity = interned.capacity;
+
+        interned.capacity = capacity == 0 ? 256 : 2 * capacity;
+        interned.items = alloc(interned.capacity * sizeof *interned.items);
+        interned.lengths = alloc(interned.capacity * sizeof *interned.lengths);
+        memset(interned.items, 0, interned.capacity * sizeof *interned.items);
+
+        int mask = interned.capacity - 1;
+        for (int i = 0; i < capacity; ++i) {
+                if (items[i] == NULL) {
+                        continue;
+                }
+                int b = items[i]->hash & mask;
+                while (interned.items[b] != NULL) {
+                        b = (b + 1) & mask;
+                }
+                interned.items[b] = items[i];
+                interned.lengths[b] = lengths[i];
+        }
+
+        free(items);
+        free(lengths);
+}
+
+/*
+ * Make room for n more bytes at the end of the string s, and return where they go; s is then
+ * that much longer. If s is all of a string with room left after it, this just claims the room,
+ * so that building a string up a piece at a time (s = s + x) is linear rather than quadratic.
+ * Otherwise s is copied into a new string, with some room to spare if it was all of its old one.
+ */
+char *
+value_string_append(struct value *s, int n)
+{
+        struct string *str = value_string_owner(s->string);
+        int k = s->bytes + n;
+        bool whole = (s->bytes == str->used);
+
+        if (whole && !str->interned && !(str->mark & GC_SLICE) && gc_size(str) - offsetof(struct string, data) >= k) {
+                str->used = k;
+                str->hash = 0;
+        } else {
+                str = value_string_alloc((whole && k >= 64) ? k + k / 2 : k);
+                str->used = k;
+                memcpy(str->data, s->string, s->bytes);
+        }
+
+        char *end = str->data + s->bytes;
+
+        *s = STRING(str, k);
+
+        return end;
+}
+
+/*
+ * The bucket of the interned string with the contents s[0..n), or of the empty one it would go in.
+ */
+static int
+intern_find(char const *s, int n, unsigned hash)
+{
+        int mask = interned.capacity - 1;
+        int b = hash & mask;
+
+        for (; interned.items[b] != NULL; b = (b + 1) & mask) {
+                struct string *str = interned.items[b];
+                if (str->hash == hash && interned.lengths[b] == n && memcmp(str->data, s, n) == 0) {
+                        break;
+                }
+        }
+
+        return b;
+}
+
+/*
+ * Returns the one interned string with the contents s[0..n). Its hash is already computed and
+ * it's NUL-terminated, so its data can be used as a C string.
+ */
+struct string *
+value_intern_string(char const *s, int n)
+{
+        if (2 * (interned.count + 1) > interned.capacity) {
+                intern_grow();
+        }
+
+        unsigned hash = str_hash(s, n);
+        int b = intern_find(s, n, hash);
+
+        if (interned.items[b] != NULL) {
+                return interned.items[b];
+        }
+
+        struct string *str = alloc(sizeof *str + n + 1);
+        str->mark = GC_STATIC;
+        str->interned = true;
+        str->hash = hash;
+        str->used = n;
+        str->next = NULL;
+        memcpy(str->data, s, n);
+        str->data[n] = '\0';
+
+        interned.items[b] = str;
+        interned.lengths[b] = n;
+        ++interned.count;
+
+        return str;
+}
+
+/*
+ * Like value_intern_string(), but only finds a string that's already interned: NULL if there
+ * isn't one, and the table doesn't grow.
+ */
+struct string *
+value_find_interned(char const *s, int n)
+{
+        if (interned.count == 0) {
+                return NULL;
+        }
+
+        return interned.items[intern_find(s, n, str_hash(s, n))];
+}
+
+/*
+ * Marking is done with an explicit stack (see gc.c) rather than by recursion: marking an object
+ * sets its mark bit and pushes it, and its children are only marked once it's popped again.
+ * Strings have nothing to trace, so they're never pushed. Interned strings are GC_STATIC, so
+ * there's never any need to write to them here.
+ *
+ * During incremental marking only old objects are marked.
+ */
 void
 value_mark(struct value *v)
 {
-        switch (v->type) {
-        case VALUE_ARRAY:    value_array_mark(v->array);                      break;
-        case VALUE_OBJECT:   object_mark(v->object);                          break;
-        case VALUE_FUNCTION: function_mark_references(v);                     break;
-        case VALUE_STRING:   if (v->gcstr != NULL) v->gcstr->mark |= GC_MARK; break;
-        default:                                                              break;
+        unsigned char *mark;
+
+        switch (v->type & ~VALUE_TAGGED) {
+        case VALUE_ARRAY:    mark = &v->array->mark;                        break;
+        case VALUE_OBJECT:   mark = &v->object->mark;                       break;
+        case VALUE_FUNCTION: mark = &v->function->mark;                     break;
+        case VALUE_STRING:   mark = &cell(v->string)->mark;                 break;
+        default:                                                            return;
+        }
+
+        unsigned char bits = gc_peek(mark);
+
+        if (gc_incremental ? (bits & (GC_OLD | GC_MARK)) != GC_OLD : (bits & gc_skip))
+                return;
+
+        if (!gc_set_mark(mark))
+                return;
+
+        if ((v->type & ~VALUE_TAGGED) != VALUE_STRING)
+                gc_gray(*v);
+}
+
+/*
+ * Mark everything v refers to, whether or not v itself has already been marked. This is how the
+ * collector traces an object which it has popped off the mark stack.
+ */
+void
+value_mark_children(struct value *v)
+{
+        switch (v->type & ~VALUE_TAGGED) {
+        case VALUE_ARRAY:    value_array_mark(v->array);   break;
+        case VALUE_OBJECT:   object_mark(v->object);       break;
+        case VALUE_FUNCTION: function_mark(v->function);   break;
+        }
+}
+
+/*
+ * Anything allocated since the last collection may only be referenced from the C stack, so it's
+ * treated as a root: every object survives at least one collection.
+ */
+void
+value_mark_fresh(void)
+{
+        for (struct value_array *a = arrays.fresh; a != NULL; a = a->next) {
+                value_mark(&ARRAY(a));
+        }
+
+        for (struct function *f = functions.fresh; f != NULL; f = f->next) {
+                value_mark(&FUNCTION(f));
+        }
+
+        for (struct string *str = strings.fresh; str != NULL; str = str->next) {
+                str->mark |= GC_MARK;
+        }
+}
+
+/*
+ * Whether v refers to an object in the young generation.
+ */
+bool
+value_is_young(struct value const *v)
+{
+        switch (v->type & ~VALUE_TAGGED) {
+        case VALUE_ARRAY:    return !(v->array->mark & GC_OLD);
+        case VALUE_OBJECT:   return !(v->object->mark & GC_OLD);
+        case VALUE_FUNCTION: return !(v->function->mark & GC_OLD);
+        case VALUE_STRING:   return !(cell(v->string)->mark & GC_OLD);
+        default:             return false;
         }
 }
 
 struct value_array *
 value_array_new(void)
 {
-        struct value_array *a = gc_alloc(sizeof *a);
-        a->next = array_chain;
-        a->mark = GC_MARK;
-        array_chain = a;
+        struct value_array *a = gc_new(sizeof *a);
+        a->next = arrays.fresh;
+        a->mark = GC_NONE;
+        arrays.fresh = a;
 
         vec_init(*a);
 
         return a;
 }
 
+void
+value_array_grow(struct value_array *a, size_t capacity)
+{
+        size_t n = capacity - a->capacity;
+
+        resize(a->items, capacity * sizeof (struct value));
+        a->capacity = capacity;
+
+        gc_account(n * sizeof (struct value));
+}
+
+/*
+ * Give back most of the slack in an array that has shrunk to well under its capacity. Only
+ * called from the sweep, so nothing can be holding on to the old items pointer.
+ */
+static void
+shrink(struct value_array *a)
+{
+        if (a->capacity < 64 || a->capacity < 4 * a->count) {
+                return;
+        }
+
+        if (a->count == 0) {
+                free(a->items);
+                a->items = NULL;
+                a->capacity = 0;
+        } else {
+                a->capacity = a->count < 8 ? 16 : 2 * a->count;
+                resize(a->items, a->capacity * sizeof (struct value));
+        }
+}
+
 struct value_array *
 value_array_clone(struct value_array const *a)
 {
@@ -481,10 +868,9 @@ value_array_clone(struct value_array const *a)
         if (a->count == 0)
                 return new;
 
+        value_array_grow(new, a->count);
+        memcpy(new->items, a->items, sizeof *new->items * a->count);
         new->count = a->count;
-        new->capacity = a->count;
-        new->items = alloc(sizeof *new->items * new->count);
-        memcpy(new->items, a->items, sizeof *new->items * new->count);
 
         return new;
 }
@@ -495,121 +881,327 @@ value_array_extend(struct value_array *a, struct value_array const *other)
         int n = a->count + other->count;
 
         if (n != 0)
-                vec_reserve(*a, n);
+                value_array_reserve(a, n);
         if (other->count != 0)
                 memcpy(a->items + a->count, other->items, other->count * sizeof (struct value));
 
         a->count = n;
+
+        value_array_barrier(a);
 }
 
-struct ref_vector *
-ref_vector_new(int n)
+struct function *
+value_function_new(int n)
 {
-        struct ref_vector *v = gc_alloc(sizeof *v + sizeof (struct reference) * n);
-        v->count = n;
-        v->mark = GC_MARK;
-        v->next = ref_vector_chain;
-        ref_vector_chain = v;
+        struct function *f = gc_new(sizeof *f + sizeof (struct variable *) * n);
+        f->count = n;
+        f->mark = GC_NONE;
+        f->next = functions.fresh;
+        functions.fresh = f;
 
-        return v;
+        return f;
 }
 
-void
-value_array_sweep(void)
-{
-        while (array_chain != NULL && array_chain->mark == GC_NONE) {
-                struct value_array *next = array_chain->next;
-                vec_empty(*array_chain);
-                free(array_chain);
-                array_chain = next;
-        }
-        if (array_chain != NULL) {
-                array_chain->mark &= ~GC_MARK;
-        }
-        for (struct value_array *array = array_chain; array != NULL && array->next != NULL;) {
-                struct value_array *next;
-                if (array->next->mark == GC_NONE) {
-                        next = array->next->next;
-                        vec_empty(*array->next);
-                        free(array->next);
-                        array->next = next;
+/*
+ * The sweeps free the dead aging objects, make the fresh ones aging and promote the surviving
+ * aging ones. A major collection promotes everything young that survives, and sets the old
+ * generation aside to be swept lazily. They return the number of bytes promoted (counting the
+ * storage that the objects own).
+ */
+size_t
+value_array_sweep(bool major)
+{
+        struct value_array *a, *next;
+        size_t n = 0;
+
+        if (major) {
+                arrays.unswept = arrays.old;
+                arrays.nunswept = arrays.nold;
+                arrays.old = NULL;
+                arrays.nold = 0;
+        }
+
+        for (a = arrays.aging; a != NULL; a = next) {
+                next = a->next;
+                if (a->mark & (GC_MARK | GC_HARD)) {
+                        a->mark = (a->mark & ~GC_MARK) | GC_OLD;
+                        a->next = arrays.old;
+                        arrays.old = a;
+                        arrays.nold += 1;
+                        if (!major) {
+                                gc_remember(ARRAY(a));
+                        }
+                        shrink(a);
+                        n += gc_size(a) + a->capacity * sizeof (struct value);
                 } else {
-                        next = array->next;
+                        vec_empty(*a);
+                        gc_free(a);
                 }
-                if (next != NULL) {
-                        next->mark &= ~GC_MARK;
+        }
+
+        for (a = arrays.fresh; a != NULL; a = next) {
+                next = a->next;
+                a->mark &= ~GC_MARK;
+                if (major) {
+                        a->mark |= GC_OLD;
+                        a->next = arrays.old;
+                        arrays.old = a;
+                        arrays.nold += 1;
+                        n += gc_size(a) + a->capacity * sizeof (struct value);
                 }
-                array = next;
         }
+
+        arrays.aging = major ? NULL : arrays.fresh;
+        arrays.fresh = NULL;
+
+        return n;
 }
 
-void
-value_string_sweep(void)
-{
-        while (string_chain != NULL && string_chain->mark == GC_NONE) {
-                struct string *next = string_chain->next;
-                free(string_chain);
-                string_chain = next;
-        }
-        if (string_chain != NULL) {
-                string_chain->mark &= ~GC_MARK;
-        }
-        for (struct string *str = string_chain; str != NULL && str->next != NULL;) {
-                struct string *next;
-                if (str->next->mark == GC_NONE) {
-                        next = str->next->next;
-                        free(str->next);
-                        str->next = next;
+/*
+ * Sweep at most *budget of the old arrays that the last major collection left unswept, and return
+ * the number of bytes taken up by the ones which survive.
+ */
+size_t
+value_array_sweep_old(int *budget)
+{
+        struct value_array *a;
+        size_t n = 0;
+
+        for (; *budget > 0 && (a = arrays.unswept) != NULL; --*budget) {
+                arrays.unswept = a->next;
+                arrays.nunswept -= 1;
+                if (a->mark & (GC_MARK | GC_HARD)) {
+                        a->mark &= ~GC_MARK;
+                        a->next = arrays.old;
+                        arrays.old = a;
+                        arrays.nold += 1;
+                        shrink(a);
+                        n += gc_size(a) + a->capacity * sizeof (struct value);
                 } else {
-                        next = str->next;
+                        vec_empty(*a);
+                        gc_free(a);
                 }
-                if (next != NULL) {
-                        next->mark &= ~GC_MARK;
+        }
+
+        return n;
+}
+
+size_t
+value_string_sweep(bool major)
+{
+        struct string *str, *next;
+        size_t n = 0;
+
+        if (major) {
+                strings.unswept = strings.old;
+                strings.nunswept = strings.nold;
+                strings.old = NULL;
+                strings.nold = 0;
+        }
+
+        for (str = strings.aging; str != NULL; str = next) {
+                next = str->next;
+                if (str->mark & (GC_MARK | GC_HARD)) {
+                        str->mark = (str->mark & ~GC_MARK) | GC_OLD;
+                        str->next = strings.old;
+                        strings.old = str;
+                        strings.nold += 1;
+                        n += gc_size(str);
+                } else {
+                        gc_free(str);
                 }
-                str = next;
         }
+
+        for (str = strings.fresh; str != NULL; str = next) {
+                next = str->next;
+                str->mark &= ~GC_MARK;
+                if (major) {
+                        str->mark |= GC_OLD;
+                        str->next = strings.old;
+                        strings.old = str;
+                        strings.nold += 1;
+                        n += gc_size(str);
+                }
+        }
+
+        strings.aging = major ? NULL : strings.fresh;
+        strings.fresh = NULL;
+
+        return n;
 }
-void
-value_ref_vector_sweep(void)
-{
-        while (ref_vector_chain != NULL && ref_vector_chain->mark == GC_NONE) {
-                struct ref_vector *next = ref_vector_chain->next;
-                free(ref_vector_chain);
-                ref_vector_chain = next;
-        }
-        if (ref_vector_chain != NULL) {
-                ref_vector_chain->mark &= ~GC_MARK;
-        }
-        for (struct ref_vector *ref_vector = ref_vector_chain; ref_vector != NULL && ref_vector->next != NULL;) {
-                struct ref_vector *next;
-                if (ref_vector->next->mark == GC_NONE) {
-                        next = ref_vector->next->next;
-                        free(ref_vector->next);
-                        ref_vector->next = next;
+
+size_t
+value_function_sweep(bool major)
+{
+        struct function *f, *next;
+        size_t n = 0;
+
+        if (major) {
+                functions.unswept = functions.old;
+                functions.nunswept = functions.nold;
+                functions.old = NULL;
+                functions.nold = 0;
+        }
+
+        for (f = functions.aging; f != NULL; f = next) {
+                next = f->next;
+                if (f->mark & (GC_MARK | GC_HARD)) {
+                        f->mark = (f->mark & ~GC_MARK) | GC_OLD;
+                        f->next = functions.old;
+                        functions.old = f;
+                        functions.nold += 1;
+                        n += gc_size(f);
+                } else {
+                        gc_free(f);
+                }
+        }
+
+        for (f = functions.fresh; f != NULL; f = next) {
+                next = f->next;
+                f->mark &= ~GC_MARK;
+                if (major) {
+                        f->mark |= GC_OLD;
+                        f->next = functions.old;
+                        functions.old = f;
+                        functions.nold += 1;
+                        n += gc_size(f);
+                }
+        }
+
+        functions.aging = major ? NULL : functions.fresh;
+        functions.fresh = NULL;
+
+        return n;
+}
+
+size_t
+value_string_sweep_old(int *budget)
+{
+        struct string *str;
+        size_t n = 0;
+
+        for (; *budget > 0 && (str = strings.unswept) != NULL; --*budget) {
+                strings.unswept = str->next;
+                strings.nunswept -= 1;
+                if (str->mark & (GC_MARK | GC_HARD)) {
+                        str->mark &= ~GC_MARK;
+                        str->next = strings.old;
+                        strings.old = str;
+                        strings.nold += 1;
+                        n += gc_size(str);
                 } else {
-                        next = ref_vector->next;
+                        gc_free(str);
                 }
-                if (next != NULL) {
-                        next->mark &= ~GC_MARK;
+        }
+
+        return n;
+}
+
+size_t
+value_function_sweep_old(int *budget)
+{
+        struct function *f;
+        size_t n = 0;
+
+        for (; *budget > 0 && (f = functions.unswept) != NULL; --*budget) {
+                functions.unswept = f->next;
+                functions.nunswept -= 1;
+                if (f->mark & (GC_MARK | GC_HARD)) {
+                        f->mark &= ~GC_MARK;
+                        f->next = functions.old;
+                        functions.old = f;
+                        functions.nold += 1;
+                        n += gc_size(f);
+                } else {
+                        gc_free(f);
                 }
-                ref_vector = next;
         }
+
+        return n;
+}
+
+size_t
+value_unswept(void)
+{
+        return arrays.nunswept + strings.nunswept + functions.nunswept;
 }
 
 void
 value_gc_reset(void)
 {
-        array_chain = NULL;
+        memset(&arrays, 0, sizeof arrays);
+        memset(&functions, 0, sizeof functions);
+        memset(&strings, 0, sizeof strings);
+}
+
+/*
+ * Free all of the arrays, functions and strings, and the interned strings too (see gc_destroy()).
+ */
+void
+value_gc_destroy(void)
+{
+        struct value_array *as[] = { arrays.fresh, arrays.aging, arrays.old, arrays.unswept };
+        struct function *fs[] = { functions.fresh, functions.aging, functions.old, functions.unswept };
+        struct string *ss[] = { strings.fresh, strings.aging, strings.old, strings.unswept };
+
+        for (int i = 0; i < 4; ++i) {
+                for (struct value_array *a = as[i], *next; a != NULL; a = next) {
+                        next = a->next;
+                        vec_empty(*a);
+                        gc_free(a);
+                }
+                for (struct function *f = fs[i], *next; f != NULL; f = next) {
+                        next = f->next;
+                        gc_free(f);
+                }
+                for (struct string *str = ss[i], *next; str != NULL; str = next) {
+                        next = str->next;
+                        gc_free(str);
+                }
+        }
+
+        for (int i = 0; i < interned.capacity; ++i) {
+                free(interned.items[i]);
+        }
+
+        free(interned.items);
+        free(interned.lengths);
+        memset(&interned, 0, sizeof interned);
+        memset(singles, 0, sizeof singles);
+
+        value_gc_reset();
+}
+
+TEST(size)
+{
+        claim(sizeof (struct value) == 16);
 }
 
 TEST(hash)
 {
-        struct value v1 = STRING_NOGC("hello", 5);
-        struct value v2 = STRING_NOGC("world", 5);
+        struct value v1 = STRING_INTERN("hello", 5);
+        struct value v2 = STRING_INTERN("world", 5);
 
         claim(value_hash(&v1) != value_hash(&v2));
 }
 
+TEST(intern)
+{
+        struct value v1 = STRING_INTERN("hello", 5);
+        struct value v2 = STRING_INTERN("hello world", 5);
+        struct value v3 = STRING_CLONE("hello", 5);
+        struct value v4 = STRING_INTERN("hellO", 5);
+
+        claim(v1.string == v2.string);
+        claim(value_hash(&v1) == value_hash(&v3));
+        claim(value_test_equality(&v1, &v3));
+        claim(!value_test_equality(&v1, &v4));
+
+        claim(value_find_interned("hello", 5) == value_string_owner(v1.string));
+        claim(value_find_interned("help!", 5) == NULL);
+        claim(value_find_interned("help!", 5) == NULL);
+}
+
 TEST(equality)
 {
         vm_init();
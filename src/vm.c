@@ -1,8 +1,13 @@
 #include <string.h>
+#include <errno.h>
 #include <stdbool.h>
 #include <setjmp.h>
 #include <stdarg.h>
 #include <stdnoreturn.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 #include <pcre.h>
 
@@ -21,42 +26,135 @@
 #include "str.h"
 #include "buffer.h"
 #include "tags.h"
+#include "tls.h"
+#include "config.h"
+#include "panic.h"
 
-#define READVALUE(s) (memcpy(&s, ip, sizeof s), (ip += sizeof s))
-#define CASE(i)      case INSTR_ ## i: LOG("executing instr: " #i);
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+
+/*
+ * The compiler stores every operand at an offset that is a multiple of its size, so reading
+ * one is just a matter of rounding ip up and doing a single aligned load.
+ */
+#define ALIGN_IP(n)  (ip = (char *) (((uintptr_t) ip + ((n) - 1)) & ~((uintptr_t) (n) - 1)))
+#define READVALUE(s) (ALIGN_IP(sizeof s), memcpy(&s, ip, sizeof s), (ip += sizeof s))
+
+#ifdef PLUM_VM_TRACE
+#define TRACE(i) LOG("executing instr: " #i);
+#else
+#define TRACE(i)
+#endif
+
+/*
+ * With GCC we use direct-threaded dispatch: every handler ends by jumping straight to the
+ * handler for the next instruction through a table of label addresses, instead of going back
+ * to the top of the switch. Build with -DPLUM_SWITCH_DISPATCH to get the portable switch.
+ */
+#if defined(__GNUC__) && !defined(PLUM_SWITCH_DISPATCH)
+#define DIRECT_THREADED
+#define CASE(i)      case INSTR_ ## i: do_ ## i: TRACE(i)
+#define LABEL(i)     [INSTR_ ## i] = &&do_ ## i
+#define DISPATCH()   __extension__ ({ goto *dispatch[(unsigned char) *ip++]; })
+#else
+#define CASE(i)      case INSTR_ ## i: TRACE(i)
+#define DISPATCH()   break
+#endif
+
+/*
+ * The arithmetic and comparison instructions quicken: the first time one sees two integers or
+ * two reals, it rewrites itself in the code into the specialized form for them, which works on
+ * the stack in place. If a specialized instruction ever sees anything else, it turns back into
+ * the generic one and runs that instead. Either rewrite re-executes the instruction.
+ */
+#define BINARY_OPERATOR(op, function) \
+        CASE(op) \
+                if (top()[-1].type == top()->type) { \
+                        if (top()->type == VALUE_INTEGER) { \
+                                ip[-1] = INSTR_ ## op ## _INTS; \
+                                --ip; \
+                                DISPATCH(); \
+                        } \
+                        if (top()->type == VALUE_REAL) { \
+                                ip[-1] = INSTR_ ## op ## _REALS; \
+                                --ip; \
+                                DISPATCH(); \
+                        } \
+                } \
+                right = pop(); \
+                left = pop(); \
+                push(function(&left, &right)); \
+                DISPATCH();
+
+#define QUICKENED(name, generic, t, field, result, op) \
+        CASE(name) \
+                if (top()[-1].type != t || top()->type != t) { \
+                        ip[-1] = INSTR_ ## generic; \
+                        --ip; \
+                        DISPATCH(); \
+                } \
+                top()[-1] = result(top()[-1].field op top()->field); \
+                --stack.count; \
+                DISPATCH();
 
 static char halt = INSTR_HALT;
 
 struct variable {
-        bool mark;
+        unsigned char mark;
         bool captured;
         struct variable *prev;
         struct value value;
         struct variable *next;
 };
 
+struct frame {
+        char *ip;
+        struct value *fp;
+        struct function *closure;
+};
+
 /*
  * Linked-list of captured variables which is traversed during garbage-collection.
  */
-static struct variable *captured_chain;
+static TLS struct variable *captured_chain;
 
-static jmp_buf jb;
-static bool jb_is_set;
+static TLS jmp_buf jb;
+static TLS bool jb_is_set;
 
-static struct variable **vars;
-static vec(struct value) stack;
-static vec(char *) callstack;
-static vec(size_t) sp_stack;
-static vec(struct value *) targetstack;
-static vec(char) output_buffer;
-static char *ip;
+static TLS struct variable **vars;
+static TLS vec(struct value) stack;
+static TLS vec(struct frame) callstack;
 
-static int symbolcount = 0;
+/*
+ * Local variables of active function calls. This is never reallocated, since the target stack
+ * can hold pointers into it: room for VM_MAX_LOCALS is reserved up front, and only the part up to
+ * 'committed' is backed by memory (see growlocals()).
+ */
+static TLS struct value *locals;
+static TLS struct value *committed;
+static TLS struct value *fp;
+static TLS struct value *lp;
 
-static char const *filename;
+/*
+ * The closure that is currently executing, whose captured variables are its upvalues.
+ */
+static TLS struct function *closure;
+static TLS vec(size_t) sp_stack;
+static TLS vec(struct value *) targetstack;
+static TLS vec(char) output_buffer;
+static TLS char *ip;
 
-static char const *err_msg;
-static char err_buf[8192];
+static TLS int symbolcount = 0;
+
+static TLS char const *filename;
+
+static TLS char const *err_msg;
+static TLS char err_buf[8192];
 
 static struct {
         char const *module;
@@ -147,6 +245,9 @@ static struct {
         { .module = "proc",   .name = "kill",              .fn = builtin_editor_proc_kill              },
         { .module = "proc",   .name = "wait",              .fn = builtin_editor_proc_wait              },
         { .module = "json",   .name = "parse",             .fn = builtin_json_parse                    },
+        { .module = "gc",     .name = "setMaxPause",       .fn = builtin_gc_set_max_pause              },
+        { .module = "gc",     .name = "pauses",            .fn = builtin_gc_pauses                     },
+        { .module = "gc",     .name = "stats",             .fn = builtin_gc_stats                      },
 };
 
 static int builtin_count = sizeof builtins / sizeof builtins[0];
@@ -159,6 +260,7 @@ newvar(struct variable *next)
         v->captured = false;
         v->prev = NULL;
         v->next = next;
+        v->value = NIL;
 
         return v;
 }
@@ -228,20 +330,88 @@ pushtarget(struct value *v)
         vec_push(targetstack, v);
 }
 
+/*
+ * Commit enough of the space reserved for locals that the slots up to 'end' can be used.
+ */
+static void
+growlocals(struct value *end)
+{
+        if (end > locals + VM_MAX_LOCALS) {
+                vm_panic("stack overflow");
+        }
+
+        size_t n = end - locals;
+        n = (n + VM_LOCALS_CHUNK - 1) / VM_LOCALS_CHUNK * VM_LOCALS_CHUNK;
+
+        if (mprotect(committed, (locals + n - committed) * sizeof *locals, PROT_READ | PROT_WRITE) != 0) {
+                vm_panic("stack overflow: %s", strerror(errno));
+        }
+
+        committed = locals + n;
+}
+
+/*
+ * Set up a new frame for the function f, taking its argc arguments off of the top of the
+ * stack. When f returns, execution continues at ret.
+ */
+static void
+call(struct function *f, int argc, char *ret)
+{
+        struct value *frame = lp;
+
+        if (frame + f->slots > committed) {
+                growlocals(frame + f->slots);
+        }
+
+        while (argc > f->params) {
+                pop();
+                --argc;
+        }
+
+        for (int i = argc; i < f->slots; ++i) {
+                frame[i] = NIL;
+        }
+
+        while (argc --> 0) {
+                frame[argc] = pop();
+                LOG("passing %s as argument %d", value_show(&frame[argc]), argc);
+        }
+
+        for (int i = 0; i < f->bound; ++i) {
+                int s = f->bound_symbols[i];
+                if (vars[s] == NULL) {
+                        vars[s] = newvar(NULL);
+                }
+                if (vars[s]->prev == NULL) {
+                        vars[s]->prev = newvar(vars[s]);
+                }
+                vars[s] = vars[s]->prev;
+        }
+
+        vec_push(callstack, ((struct frame){ .ip = ret, .fp = fp, .closure = closure }));
+
+        fp = frame;
+        lp = frame + f->slots;
+        closure = f;
+}
+
 static void
 vm_exec(char *code)
 {
         char *save = ip;
         ip = code;
 
-        uintptr_t s, s2, off;
+        uintptr_t s;
         intmax_t k;
         bool b;
         float f;
         int n, index, tag, l, r;
 
         struct value left, right, v, key, value, container, subscript, *vp;
-        struct string *str;
+        char *str;
+        uintptr_t const *bound;
+        char *body;
+        struct member_cache *cache;
 
         value_vector args;
         vec_init(args);
@@ -250,13 +420,41 @@ vm_exec(char *code)
 
         struct variable *next;
 
+#ifdef DIRECT_THREADED
+        __extension__ static void * const dispatch[] = {
+                LABEL(LOAD_VAR),            LABEL(LOAD_UPVALUE),        LABEL(LOAD_LOCAL),          LABEL(PUSH_VAR),
+                LABEL(POP_VAR),             LABEL(TARGET_VAR),          LABEL(TARGET_UPVALUE),      LABEL(TARGET_LOCAL),
+                LABEL(TARGET_MEMBER),       LABEL(TARGET_SUBSCRIPT),    LABEL(ASSIGN),              LABEL(ASSIGN_POP),
+                LABEL(STORE_VAR),           LABEL(STORE_LOCAL),         LABEL(ARRAY_REST),          LABEL(INTEGER),
+                LABEL(REAL),                LABEL(BOOLEAN),             LABEL(STRING),              LABEL(REGEX),
+                LABEL(ARRAY),               LABEL(OBJECT),              LABEL(NIL),                 LABEL(TAG),
+                LABEL(TO_STRING),           LABEL(CONCAT_STRINGS),      LABEL(RANGE),               LABEL(MEMBER_ACCESS),
+                LABEL(SUBSCRIPT),           LABEL(CALL),                LABEL(CALL_METHOD),         LABEL(POP),
+                LABEL(DUP),                 LABEL(LEN),                 LABEL(PRE_INC),             LABEL(POST_INC),
+                LABEL(PRE_DEC),             LABEL(POST_DEC),            LABEL(INC),                 LABEL(INC_LOCAL),
+                LABEL(DEC_LOCAL),           LABEL(FUNCTION),            LABEL(JUMP),                LABEL(JUMP_IF),
+                LABEL(JUMP_IF_NOT),         LABEL(RETURN),              LABEL(EXEC_CODE),           LABEL(HALT),
+                LABEL(SAVE_STACK_POS),      LABEL(RESTORE_STACK_POS),   LABEL(TAG_PUSH),            LABEL(TRY_INDEX),
+                LABEL(TRY_TAG_POP),         LABEL(TRY_REGEX),           LABEL(TRY_ASSIGN_NON_NIL),  LABEL(BAD_MATCH),
+                LABEL(UNTAG_OR_DIE),        LABEL(ENSURE_LEN),          LABEL(ADD),                 LABEL(SUB),
+                LABEL(MUL),                 LABEL(DIV),                 LABEL(MOD),                 LABEL(EQ),
+                LABEL(NEQ),                 LABEL(LT),                  LABEL(GT),                  LABEL(LEQ),
+                LABEL(GEQ),                 LABEL(MUT_ADD),             LABEL(MUT_MUL),             LABEL(MUT_DIV),
+                LABEL(MUT_SUB),             LABEL(ADD_INT),             LABEL(ADD_LOCAL_INT),       LABEL(ADD_INTS),
+                LABEL(SUB_INTS),            LABEL(MUL_INTS),            LABEL(LT_INTS),             LABEL(GT_INTS),
+                LABEL(LEQ_INTS),            LABEL(GEQ_INTS),            LABEL(ADD_REALS),           LABEL(SUB_REALS),
+                LABEL(MUL_REALS),           LABEL(LT_REALS),            LABEL(GT_REALS),            LABEL(LEQ_REALS),
+                LABEL(GEQ_REALS),           LABEL(NEG),                 LABEL(NOT),                 LABEL(KEYS),
+        };
+#endif
+
         for (;;) {
                 switch (*ip++) {
                 CASE(PUSH_VAR)
                         READVALUE(s);
                         LOG("new var for %d", (int) s);
                         vars[s] = newvar(vars[s]);
-                        break;
+                        DISPATCH();
                 CASE(POP_VAR)
                         READVALUE(s);
                         next = vars[s]->next;
@@ -267,58 +465,69 @@ vm_exec(char *code)
                                 captured_chain = vars[s];
                         }
                         vars[s] = next;
-                        break;
+                        DISPATCH();
                 CASE(LOAD_VAR)
                         READVALUE(s);
                         LOG("loading %d", (int) s);
                         push(vars[s]->value);
-                        break;
+                        DISPATCH();
+                CASE(LOAD_LOCAL)
+                        READVALUE(n);
+                        push(fp[n]);
+                        DISPATCH();
                 CASE(EXEC_CODE)
                         READVALUE(s);
                         vm_exec((char *) s);
-                        break;
+                        DISPATCH();
                 CASE(DUP)
                         push(peek());
-                        break;
+                        DISPATCH();
                 CASE(JUMP)
                         READVALUE(n);
                         LOG("JUMPING %d", n);
                         ip += n;
-                        break;
+                        DISPATCH();
                 CASE(JUMP_IF)
                         READVALUE(n);
                         v = pop();
-                        if (value_truthy(&v)) {
+                        b = (v.type == VALUE_BOOLEAN) ? v.boolean : value_truthy(&v);
+                        if (b) {
                                 LOG("JUMPING %d", n);
                                 ip += n;
                         }
-                        break;
+                        DISPATCH();
                 CASE(JUMP_IF_NOT)
                         READVALUE(n);
                         v = pop();
-                        if (!value_truthy(&v)) {
+                        b = (v.type == VALUE_BOOLEAN) ? v.boolean : value_truthy(&v);
+                        if (!b) {
                                 LOG("JUMPING %d", n);
                                 ip += n;
                         }
-                        break;
+                        DISPATCH();
                 CASE(TARGET_VAR)
                         READVALUE(s);
                         LOG("targetting %d", (int) s);
                         pushtarget(&vars[s]->value);
-                        break;
-                CASE(TARGET_REF)
-                        READVALUE(s);
-                        LOG("ref = %p", (void *) s);
-                        pushtarget(&((struct variable *) s)->value);
-                        break;
+                        DISPATCH();
+                CASE(TARGET_UPVALUE)
+                        READVALUE(n);
+                        pushtarget(&closure->vars[n]->value);
+                        DISPATCH();
+                CASE(TARGET_LOCAL)
+                        READVALUE(n);
+                        pushtarget(&fp[n]);
+                        DISPATCH();
                 CASE(TARGET_MEMBER)
                         v = pop();
                         if (v.type != VALUE_OBJECT) {
                                 vm_panic("assignment to member of non-object");
                         }
-                        pushtarget(object_put_member_if_not_exists(v.object, ip));
-                        ip += strlen(ip) + 1;
-                        break;
+                        ALIGN_IP(_Alignof (struct member_cache));
+                        cache = (struct member_cache *) ip;
+                        ip += sizeof *cache;
+                        pushtarget(object_put_member_cached(v.object, cache));
+                        DISPATCH();
                 CASE(TARGET_SUBSCRIPT)
                         subscript = pop();
                         container = pop();
@@ -333,37 +542,54 @@ vm_exec(char *code)
                                 if (subscript.integer < 0 || subscript.integer >= container.array->count) {
                                         vm_panic("array index out of range in subscript expression");
                                 }
+                                value_array_barrier(container.array);
                                 pushtarget(&container.array->items[subscript.integer]);
                         } else if (container.type == VALUE_OBJECT) {
                                 pushtarget(object_put_key_if_not_exists(container.object, subscript));
                         } else {
                                 vm_panic("attempt to perform subscript assignment on something other than an object or array");
                         }
-                        break;
+                        DISPATCH();
                 CASE(ASSIGN)
                         if (peektarget() == &vars[0]->value) {
                                 LOG("ERROR: ASSIGNING TO PRINT");
                         }
                         *poptarget() = peek();
-                        break;
+                        DISPATCH();
+                CASE(ASSIGN_POP)
+                        vp = poptarget();
+                        *vp = pop();
+                        DISPATCH();
+                CASE(STORE_VAR)
+                        READVALUE(s);
+                        vars[s]->value = pop();
+                        DISPATCH();
+                CASE(STORE_LOCAL)
+                        READVALUE(n);
+                        fp[n] = pop();
+                        DISPATCH();
                 CASE(TAG_PUSH)
                         READVALUE(tag);
                         top()->tags = tags_push(top()->tags, tag);
                         top()->type |= VALUE_TAGGED;
-                        break;
+                        DISPATCH();
                 CASE(ARRAY_REST)
-                        READVALUE(s);
+                        vp = poptarget();
                         READVALUE(index);
                         READVALUE(n);
                         if (top()->type != VALUE_ARRAY) {
                                 LOG("cannot do rest: top is not an array");
                                 ip += n;
                         } else {
-                                LOG("Assigning rest to: %d", (int) s);
-                                vars[s]->value = ARRAY(value_array_new());
-                                vec_push_n(*vars[s]->value.array, top()->array->items + index, top()->array->count - index);
+                                *vp = ARRAY(value_array_new());
+                                int count = top()->array->count - index;
+                                if (count > 0) {
+                                        value_array_reserve(vp->array, count);
+                                        memcpy(vp->array->items, top()->array->items + index, count * sizeof (struct value));
+                                        vp->array->count = count;
+                                }
                         }
-                        break;
+                        DISPATCH();
                 CASE(UNTAG_OR_DIE)
                         READVALUE(tag);
                         if (!tags_same(top()->tags, tag)) {
@@ -372,10 +598,10 @@ vm_exec(char *code)
                                 top()->tags = tags_pop(top()->tags);
                                 top()->type &= ~VALUE_TAGGED;
                         }
-                        break;
+                        DISPATCH();
                 CASE(BAD_MATCH)
                         vm_panic("expression did not match any patterns in match expression");
-                        break;
+                        DISPATCH();
                 CASE(ENSURE_LEN)
                         READVALUE(n);
                         b = top()->array->count == n;
@@ -383,26 +609,24 @@ vm_exec(char *code)
                         if (!b) {
                                 ip += n;
                         }
-                        break;
+                        DISPATCH();
                 CASE(TRY_ASSIGN_NON_NIL)
-                        READVALUE(s);
+                        vp = poptarget();
                         READVALUE(n);
                         if (top()->type == VALUE_NIL) {
                                 ip += n;
                         } else {
-                                vars[s]->value = peek();
+                                *vp = peek();
                         }
-                        break;
+                        DISPATCH();
                 CASE(TRY_REGEX)
                         READVALUE(s);
-                        READVALUE(s2);
                         READVALUE(n);
-                        v = REGEX((pcre *) s);
-                        v.extra = (pcre_extra *) s2;
+                        v = REGEX((struct regex const *) s);
                         if (!value_apply_predicate(&v, top())) {
                                 ip += n;
                         }
-                        break;
+                        DISPATCH();
                 CASE(TRY_INDEX)
                         READVALUE(index);
                         READVALUE(n);
@@ -411,7 +635,7 @@ vm_exec(char *code)
                         } else {
                                 push(top()->array->items[index]);
                         }
-                        break;
+                        DISPATCH();
                 CASE(TRY_TAG_POP)
                         READVALUE(tag);
                         READVALUE(n);
@@ -425,56 +649,50 @@ vm_exec(char *code)
                                         top()->type &= ~VALUE_TAGGED;
                                 }
                         }
-                        break;
+                        DISPATCH();
                 CASE(POP)
                         pop();
-                        break;
-                CASE(LOAD_REF)
-                        READVALUE(s);
-                        LOG("reference is: %p", (void *) s);
-                        push(((struct variable *) s)->value);
-                        break;
+                        DISPATCH();
+                CASE(LOAD_UPVALUE)
+                        READVALUE(n);
+                        push(closure->vars[n]->value);
+                        DISPATCH();
                 CASE(INTEGER)
                         READVALUE(k);
                         push(INTEGER(k));
-                        break;
+                        DISPATCH();
                 CASE(REAL)
                         READVALUE(f);
                         push(REAL(f));
-                        break;
+                        DISPATCH();
                 CASE(BOOLEAN)
                         READVALUE(b);
                         push(BOOLEAN(b));
-                        break;
+                        DISPATCH();
                 CASE(STRING)
-                        n = strlen(ip);
-                        push(STRING_NOGC(ip, n));
-                        ip += n + 1;
-                        break;
+                        READVALUE(n);
+                        READVALUE(s);
+                        push(STRING((struct string *) s, n));
+                        DISPATCH();
                 CASE(TAG)
                         READVALUE(tag);
                         push(TAG(tag));
-                        break;
+                        DISPATCH();
                 CASE(REGEX)
                         READVALUE(s);
-                        v = REGEX((pcre *) s);
-                        READVALUE(s);
-                        v.extra = (pcre_extra *) s;
-                        READVALUE(s);
-                        v.pattern = (char const *) s;
-                        push(v);
-                        break;
+                        push(REGEX((struct regex const *) s));
+                        DISPATCH();
                 CASE(ARRAY)
                         v = ARRAY(value_array_new());
 
                         READVALUE(n);
-                        vec_reserve(*v.array, n);
+                        value_array_reserve(v.array, n);
                         for (int i = 0; i < n; ++i) {
-                                vec_push(*v.array, pop());
+                                value_array_push(v.array, pop());
                         }
 
                         push(v);
-                        break;
+                        DISPATCH();
                 CASE(OBJECT)
                         v = OBJECT(object_new());
 
@@ -486,15 +704,15 @@ vm_exec(char *code)
                         }
 
                         push(v);
-                        break;
+                        DISPATCH();
                 CASE(NIL)
                         push(NIL);
-                        break;
+                        DISPATCH();
                 CASE(TO_STRING)
                         v = pop();
                         v = builtin_str(&(value_vector){ .items = &v, .count = 1 });
                         push(v);
-                        break;
+                        DISPATCH();
                 CASE(CONCAT_STRINGS)
                         READVALUE(n);
                         LOG("n = %d", n);
@@ -504,17 +722,16 @@ vm_exec(char *code)
                                 k += stack.items[index].bytes;
                         }
                         LOG("total bytes: %d", (int) k);
-                        str = value_string_alloc(k);
-                        v = STRING(str->data, k, str);
-                        k = 0;
-                        for (index = stack.count - n; index < stack.count; ++index) {
+                        v = stack.items[stack.count - n];
+                        str = value_string_append(&v, k - v.bytes);
+                        for (index = stack.count - n + 1; index < stack.count; ++index) {
                                 LOG("adding string: %s", value_show(&stack.items[index]));
-                                memcpy(str->data + k, stack.items[index].string, stack.items[index].bytes);
-                                k += stack.items[index].bytes;
+                                memcpy(str, stack.items[index].string, stack.items[index].bytes);
+                                str += stack.items[index].bytes;
                         }
                         stack.count -= n - 1;
                         stack.items[stack.count - 1] = v;
-                        break;
+                        DISPATCH();
                 CASE(RANGE)
                         READVALUE(l);
                         READVALUE(r);
@@ -535,17 +752,19 @@ vm_exec(char *code)
                                 }
                         }
                         push(v);
-                        break;
+                        DISPATCH();
                 CASE(MEMBER_ACCESS)
                         v = pop();
                         if (v.type != VALUE_OBJECT) {
                                 vm_panic("member access on non-object");
                         }
-                        vp = object_get_member(v.object, ip);
-                        ip += strlen(ip) + 1;
+                        ALIGN_IP(_Alignof (struct member_cache));
+                        cache = (struct member_cache *) ip;
+                        ip += sizeof *cache;
+                        vp = object_get_member_cached(v.object, cache);
 
                         push((vp == NULL) ? NIL : *vp);
-                        break;
+                        DISPATCH();
                 CASE(SUBSCRIPT)
                         subscript = pop();
                         container = pop();
@@ -567,111 +786,135 @@ vm_exec(char *code)
                         } else {
                                 vm_panic("attempt to subscript something other than an object or array");
                         }
-                        break;
+                        DISPATCH();
                 CASE(NOT)
                         v = pop();
                         push(unary_operator_not(&v));
-                        break;
+                        DISPATCH();
                 CASE(NEG)
                         v = pop();
                         push(unary_operator_negate(&v));
-                        break;
-                CASE(ADD)
-                        right = pop();
-                        left = pop();
-                        push(binary_operator_addition(&left, &right));
-                        break;
-                CASE(SUB)
-                        right = pop();
-                        left = pop();
-                        push(binary_operator_subtraction(&left, &right));
-                        break;
-                CASE(MUL)
-                        right = pop();
-                        left = pop();
-                        push(binary_operator_multiplication(&left, &right));
-                        break;
+                        DISPATCH();
+                BINARY_OPERATOR(ADD, binary_operator_addition)
+                CASE(ADD_INT)
+                        READVALUE(k);
+                        if (top()->type == VALUE_INTEGER) {
+                                top()->integer += k;
+                        } else {
+                                left = pop();
+                                right = INTEGER(k);
+                                push(binary_operator_addition(&left, &right));
+                        }
+                        DISPATCH();
+                CASE(ADD_LOCAL_INT)
+                        READVALUE(n);
+                        READVALUE(k);
+                        if (fp[n].type == VALUE_INTEGER) {
+                                push(INTEGER(fp[n].integer + k));
+                        } else {
+                                right = INTEGER(k);
+                                push(binary_operator_addition(&fp[n], &right));
+                        }
+                        DISPATCH();
+                BINARY_OPERATOR(SUB, binary_operator_subtraction)
+                BINARY_OPERATOR(MUL, binary_operator_multiplication)
                 CASE(DIV)
                         right = pop();
                         left = pop();
                         push(binary_operator_division(&left, &right));
-                        break;
+                        DISPATCH();
                 CASE(MOD)
                         right = pop();
                         left = pop();
                         push(binary_operator_remainder(&left, &right));
-                        break;
+                        DISPATCH();
                 CASE(EQ)
                         right = pop();
                         left = pop();
                         push(binary_operator_equality(&left, &right));
-                        break;
+                        DISPATCH();
                 CASE(NEQ)
                         right = pop();
                         left = pop();
                         push(binary_operator_equality(&left, &right));
                         --top()->boolean;
-                        break;
-                CASE(LT)
-                        right = pop();
-                        left = pop();
-                        push(binary_operator_less_than(&left, &right));
-                        break;
-                CASE(GT)
-                        right = pop();
-                        left = pop();
-                        push(binary_operator_greater_than(&left, &right));
-                        break;
-                CASE(LEQ)
-                        right = pop();
-                        left = pop();
-                        push(binary_operator_less_than_or_equal(&left, &right));
-                        break;
-                CASE(GEQ)
-                        right = pop();
-                        left = pop();
-                        push(binary_operator_greater_than_or_equal(&left, &right));
-                        break;
+                        DISPATCH();
+                BINARY_OPERATOR(LT, binary_operator_less_than)
+                BINARY_OPERATOR(GT, binary_operator_greater_than)
+                BINARY_OPERATOR(LEQ, binary_operator_less_than_or_equal)
+                BINARY_OPERATOR(GEQ, binary_operator_greater_than_or_equal)
+                QUICKENED(ADD_INTS,  ADD, VALUE_INTEGER, integer, INTEGER, +)
+                QUICKENED(SUB_INTS,  SUB, VALUE_INTEGER, integer, INTEGER, -)
+                QUICKENED(MUL_INTS,  MUL, VALUE_INTEGER, integer, INTEGER, *)
+                QUICKENED(LT_INTS,   LT,  VALUE_INTEGER, integer, BOOLEAN, <)
+                QUICKENED(GT_INTS,   GT,  VALUE_INTEGER, integer, BOOLEAN, >)
+                QUICKENED(LEQ_INTS,  LEQ, VALUE_INTEGER, integer, BOOLEAN, <=)
+                QUICKENED(GEQ_INTS,  GEQ, VALUE_INTEGER, integer, BOOLEAN, >=)
+                QUICKENED(ADD_REALS, ADD, VALUE_REAL,    real,    REAL,    +)
+                QUICKENED(SUB_REALS, SUB, VALUE_REAL,    real,    REAL,    -)
+                QUICKENED(MUL_REALS, MUL, VALUE_REAL,    real,    REAL,    *)
+                QUICKENED(LT_REALS,  LT,  VALUE_REAL,    real,    BOOLEAN, <)
+                QUICKENED(GT_REALS,  GT,  VALUE_REAL,    real,    BOOLEAN, >)
+                QUICKENED(LEQ_REALS, LEQ, VALUE_REAL,    real,    BOOLEAN, <=)
+                QUICKENED(GEQ_REALS, GEQ, VALUE_REAL,    real,    BOOLEAN, >=)
                 CASE(KEYS)
                         v = pop();
                         push(unary_operator_keys(&v));
-                        break;
+                        DISPATCH();
                 CASE(LEN)
                         v = pop();
                         push(INTEGER(v.array->count)); // TODO
-                        break;
+                        DISPATCH();
                 CASE(INC) // only used for internal (hidden) variables
                         READVALUE(s);
                         ++vars[s]->value.integer;
-                        break;
+                        DISPATCH();
+                CASE(INC_LOCAL)
+                        READVALUE(n);
+                        if (fp[n].type != VALUE_INTEGER) {
+                                vm_panic("increment applied to non-integer");
+                        }
+                        ++fp[n].integer;
+                        DISPATCH();
+                CASE(DEC_LOCAL)
+                        READVALUE(n);
+                        if (fp[n].type != VALUE_INTEGER) {
+                                vm_panic("decrement applied to non-integer");
+                        }
+                        --fp[n].integer;
+                        DISPATCH();
                 CASE(PRE_INC)
                         if (peektarget()->type != VALUE_INTEGER) {
                                 vm_panic("pre-increment applied to non-integer");
                         }
                         ++peektarget()->integer;
                         push(*poptarget());
-                        break;
+                        DISPATCH();
                 CASE(POST_INC)
                         if (peektarget()->type != VALUE_INTEGER) {
                                 vm_panic("post-increment applied to non-integer");
                         }
                         push(*peektarget());
                         ++poptarget()->integer;
-                        break;
+                        DISPATCH();
                 CASE(PRE_DEC)
                         if (peektarget()->type != VALUE_INTEGER) {
                                 vm_panic("pre-decrement applied to non-integer");
                         }
                         --peektarget()->integer;
                         push(*poptarget());
-                        break;
+                        DISPATCH();
                 CASE(POST_DEC)
                         if (peektarget()->type != VALUE_INTEGER) {
                                 vm_panic("post-decrement applied to non-integer");
                         }
                         push(*peektarget());
                         --poptarget()->integer;
-                        break;
+                        DISPATCH();
+                /*
+                 * The target's container was passed through the write barrier when the target was
+                 * pushed, so there mustn't be a collection between then and the store.
+                 */
                 CASE(MUT_ADD)
                         vp = poptarget();
                         if (vp->type == VALUE_ARRAY) {
@@ -681,101 +924,91 @@ vm_exec(char *code)
                                 value_array_extend(vp->array, pop().array);
                         } else {
                                 v = pop();
+                                ++gc_prevent;
                                 *vp = binary_operator_addition(vp, &v);
+                                --gc_prevent;
                         }
                         push(*vp);
-                        break;
+                        DISPATCH();
                 CASE(MUT_MUL)
                         vp = poptarget();
                         v = pop();
+                        ++gc_prevent;
                         *vp = binary_operator_multiplication(vp, &v);
+                        --gc_prevent;
                         push(*vp);
-                        break;
+                        DISPATCH();
                 CASE(MUT_DIV)
                         vp = poptarget();
                         v = pop();
+                        ++gc_prevent;
                         *vp = binary_operator_division(vp, &v);
+                        --gc_prevent;
                         push(*vp);
-                        break;
+                        DISPATCH();
                 CASE(MUT_SUB)
                         vp = poptarget();
                         v = pop();
+                        ++gc_prevent;
                         *vp = binary_operator_subtraction(vp, &v);
+                        --gc_prevent;
                         push(*vp);
-                        break;
+                        DISPATCH();
                 CASE(FUNCTION)
-                        v.tags = 0;
-                        v.type = VALUE_FUNCTION;
-
-                        READVALUE(n);
-                        vec_init(v.bound_symbols);
-                        vec_reserve(v.bound_symbols, n);
-                        LOG("function has %d bound symbol(s)", n);
-                        for (int i = 0; i < n; ++i) {
-                                READVALUE(s);
-                                vec_push(v.bound_symbols, s);
+                        /*
+                         * Everything but the captured variables is left in the code; the
+                         * closure just points at it. If there are no captured variables, the
+                         * closure itself is in the code too.
+                         */
+                        READVALUE(l);
+                        LOG("function has %d bound symbol(s)", l);
+                        if (l != 0) {
+                                ALIGN_IP(sizeof (uintptr_t));
                         }
+                        bound = (uintptr_t const *) ip;
+                        ip += l * sizeof (uintptr_t);
 
                         READVALUE(n);
-                        v.code = ip;
+                        body = ip;
                         ip += n;
 
+                        READVALUE(r);
                         READVALUE(n);
-                        vec_init(v.param_symbols);
-                        vec_reserve(v.param_symbols, n);
-                        LOG("function has %d parameter(s)", n);
-                        for (int i = 0; i < n; ++i) {
-                                READVALUE(s);
-                                vec_push(v.param_symbols, s);
-                        }
+                        LOG("function has %d parameter(s) and %d slot(s)", r, n);
 
-                        READVALUE(n);
-                        v.refs = ref_vector_new(n);
-                        LOG("function contains %d reference(s)", n);
-                        for (int i = 0; i < n; ++i) {
+                        READVALUE(index);
+                        LOG("function captures %d variable(s)", index);
+                        if (index == 0) {
+                                ALIGN_IP(_Alignof (struct function));
+                                v = FUNCTION((struct function *) ip);
+                                ip += sizeof (struct function);
+                                if (v.function->code != NULL) {
+                                        push(v);
+                                        DISPATCH();
+                                }
+                        } else {
+                                v = FUNCTION(value_function_new(index));
+                        }
+                        v.function->bound = l;
+                        v.function->bound_symbols = bound;
+                        v.function->code = body;
+                        v.function->params = r;
+                        v.function->slots = n;
+                        for (int i = 0; i < index; ++i) {
                                 READVALUE(s);
-                                READVALUE(off);
+                                LOG("it captures symbol %d", (int) s);
                                 vars[s]->captured = true;
-                                struct reference ref = { .pointer = (uintptr_t) vars[s], .offset = off };
-                                LOG("it refers to symbol %d", (int) s);
-                                LOG("it refers to pointer %p", (void *) ref.pointer);
-                                v.refs->refs[i] = ref;
+                                v.function->vars[i] = vars[s];
                         }
 
                         push(v);
-                        break;
+                        DISPATCH();
                 CASE(CALL)
                         v = pop();
                         if (v.type == VALUE_FUNCTION) {
-                                for (int i = 0; i < v.bound_symbols.count; ++i) {
-                                        if (vars[v.bound_symbols.items[i]] == NULL) {
-                                                vars[v.bound_symbols.items[i]] = newvar(NULL);
-                                        }
-                                        if (vars[v.bound_symbols.items[i]]->prev == NULL) {
-                                                vars[v.bound_symbols.items[i]]->prev = newvar(vars[v.bound_symbols.items[i]]);
-                                        }
-                                        vars[v.bound_symbols.items[i]] = vars[v.bound_symbols.items[i]]->prev;
-                                }
                                 READVALUE(n);
-                                while (n > v.param_symbols.count) {
-                                        pop();
-                                        --n;
-                                }
-                                for (int i = n; i < v.param_symbols.count; ++i) {
-                                        vars[v.param_symbols.items[i]]->value = NIL;
-                                }
-                                while (n --> 0) {
-                                        struct value v2 = pop();
-                                        LOG("passing %s as argument %d", value_show(&v2), n);
-                                        vars[v.param_symbols.items[n]]->value = v2;
-                                }
-                                for (int i = 0; i < v.refs->count; ++i) {
-                                        struct reference ref = v.refs->refs[i];
-                                        LOG("resolving reference to %p", (void *) ref.pointer);
-                                        memcpy(v.code + ref.offset, &ref.pointer, sizeof ref.pointer);
-                                }
-                                vec_push(callstack, ip);
-                                ip = v.code;
+                                call(v.function, n, ip);
+                                ip = v.function->code;
                         } else if (v.type == VALUE_BUILTIN_FUNCTION) {
                                 READVALUE(n);
                                 vec_reserve(args, n);
@@ -794,18 +1027,24 @@ vm_exec(char *code)
                         } else {
                                 vm_panic("attempt to call a non-function");
                         }
-                        break;
+                        DISPATCH();
                 CASE(CALL_METHOD)
-                        
+                        ALIGN_IP(_Alignof (struct member_cache));
+                        cache = (struct member_cache *) ip;
+                        ip += sizeof *cache;
+
                         value = peek();
 
+                        /*
+                         * The string and array methods with this name were looked up at compile time.
+                         */
                         if (value.type == VALUE_STRING) {
                                 ++gc_prevent;
-                                func = get_string_method(ip);
+                                memcpy(&func, ip, sizeof func);
                                 if (func == NULL) {
-                                        vm_panic("call to non-existent string method: %s", ip);
+                                        vm_panic("call to non-existent string method: %s", cache->name);
                                 }
-                                ip += strlen(ip) + 1;
+                                ip += 2 * sizeof (uintptr_t);
                                 vec_init(args);
                                 READVALUE(n);
                                 vec_reserve(args, n);
@@ -819,16 +1058,16 @@ vm_exec(char *code)
                                 stack.items[stack.count - 1] = v;
                                 --gc_prevent;
                                 gc_alloc(0);
-                                break;
+                                DISPATCH();
                         }
 
                         if (value.type == VALUE_ARRAY) {
                                 ++gc_prevent;
-                                func = get_array_method(ip);
+                                memcpy(&func, ip + sizeof (uintptr_t), sizeof func);
                                 if (func == NULL) {
-                                        vm_panic("call to non-existent array method: %s", ip);
+                                        vm_panic("call to non-existent array method: %s", cache->name);
                                 }
-                                ip += strlen(ip) + 1;
+                                ip += 2 * sizeof (uintptr_t);
                                 READVALUE(n);
                                 vec_reserve(args, n);
                                 args.count = n;
@@ -843,7 +1082,7 @@ vm_exec(char *code)
                                 stack.items[stack.count - 1] = v;
                                 --gc_prevent;
                                 gc_alloc(0);
-                                break;
+                                DISPATCH();
                         }
 
                         /*
@@ -856,46 +1095,32 @@ vm_exec(char *code)
                                 vm_panic("attempt to call a method on a non-object");
                         }
 
-                        vp = object_get_member(value.object, ip);
+                        vp = object_get_member_cached(value.object, cache);
                         if (vp == NULL) {
-                                vm_panic("attempt to call a non-existent method: %s", ip);
+                                vm_panic("attempt to call a non-existent method: %s", cache->name);
                         }
 
                         if (vp->type != VALUE_FUNCTION) {
-                                vm_panic("attempt to call a non-function as a method on an object: %s", ip);
+                                vm_panic("attempt to call a non-function as a method on an object: %s", cache->name);
                         }
-                        ip += strlen(ip) + 1;
+                        ip += 2 * sizeof (uintptr_t);
 
-                        for (int i = 0; i < vp->bound_symbols.count; ++i) {
-                                vars[vp->bound_symbols.items[i]] = newvar(vars[vp->bound_symbols.items[i]]);
-                        }
                         READVALUE(n);
-                        /* throw away ignored arguments */
-                        while (n > vp->param_symbols.count)
-                                pop(), --n;
-                        /* default missing parameters to nil */
-                        for (int i = n; i < vp->param_symbols.count; ++i)
-                                vars[vp->param_symbols.items[i]]->value = NIL;
-                        /* fill in the rest of the arguments */
-                        while (n --> 0)
-                                vars[vp->param_symbols.items[n]]->value = pop();
-                        for (int i = 0; i < vp->refs->count; ++i) {
-                                struct reference ref = vp->refs->refs[i];
-                                LOG("resolving reference to %p", (void *) ref.pointer);
-                                memcpy(vp->code + ref.offset, &ref.pointer, sizeof ref.pointer);
-                        }
-                        vec_push(callstack, ip);
-                        ip = vp->code;
-                        break;
+                        call(vp->function, n, ip);
+                        ip = vp->function->code;
+                        DISPATCH();
                 CASE(SAVE_STACK_POS)
                         vec_push(sp_stack, stack.count);
-                        break;
+                        DISPATCH();
                 CASE(RESTORE_STACK_POS)
                         stack.count = *vec_pop(sp_stack);
-                        break;
+                        DISPATCH();
                 CASE(RETURN)
-                        ip = *vec_pop(callstack);
-                        break;
+                        lp = fp;
+                        fp = vec_last(callstack)->fp;
+                        closure = vec_last(callstack)->closure;
+                        ip = vec_pop(callstack)->ip;
+                        DISPATCH();
                 CASE(HALT)
                         ip = save;
                         return;
@@ -919,6 +1144,16 @@ vm_init(void)
         vars = NULL;
         symbolcount = 0;
 
+        if (locals == NULL) {
+                locals = mmap(NULL, VM_MAX_LOCALS * sizeof *locals, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+                if (locals == MAP_FAILED) {
+                        panic("failed to reserve space for local variables: %s", strerror(errno));
+                }
+                committed = locals;
+        }
+        fp = lp = locals;
+        closure = NULL;
+
         pcre_malloc = alloc;
 
         compiler_init();
@@ -927,6 +1162,43 @@ vm_init(void)
         add_builtins();
 }
 
+/*
+ * Free everything the VM has allocated: the variables, the stacks, the compiled code and the whole
+ * GC heap. vm_init() has to be called again before anything else is run.
+ */
+void
+vm_destroy(void)
+{
+        for (int i = 0; i < symbolcount; ++i) {
+                for (struct variable *v = vars[i], *next; v != NULL; v = next) {
+                        next = v->next;
+                        free(v);
+                }
+        }
+
+        for (struct variable *v = captured_chain, *next; v != NULL; v = next) {
+                next = v->next;
+                free(v);
+        }
+
+        free(vars);
+        vars = NULL;
+        symbolcount = 0;
+        captured_chain = NULL;
+
+        munmap(locals, VM_MAX_LOCALS * sizeof *locals);
+        locals = committed = NULL;
+
+        vec_empty(stack);
+        vec_empty(callstack);
+        vec_empty(sp_stack);
+        vec_empty(targetstack);
+        vec_empty(output_buffer);
+
+        compiler_destroy();
+        gc_destroy();
+}
+
 noreturn void
 vm_panic(char const *fmt, ...)
 {
@@ -947,6 +1219,15 @@ vm_panic(char const *fmt, ...)
 
         LOG("VM Error: %s", err_buf);
 
+        /*
+         * Whatever was running is abandoned, so its frames can go too, and so can anything it
+         * did to hold off the GC.
+         */
+        callstack.count = 0;
+        fp = lp = locals;
+        closure = NULL;
+        gc_prevent = 0;
+
         if (jb_is_set) {
                 longjmp(jb, 1);
         } else {
@@ -1011,33 +1292,12 @@ struct value
 vm_eval_function(struct value const *f, struct value *v)
 {
         if (f->type == VALUE_FUNCTION) {
-                vec_push(callstack, &halt);
-
-                for (int i = 0; i < f->bound_symbols.count; ++i) {
-                        if (vars[f->bound_symbols.items[i]] == NULL) {
-                                vars[f->bound_symbols.items[i]] = newvar(NULL);
-                        }
-                        if (vars[f->bound_symbols.items[i]]->prev == NULL) {
-                                vars[f->bound_symbols.items[i]]->prev = newvar(vars[f->bound_symbols.items[i]]);
-                        }
-                        vars[f->bound_symbols.items[i]] = vars[f->bound_symbols.items[i]]->prev;
+                if (v != NULL) {
+                        push(*v);
                 }
 
-                if (f->param_symbols.count >= 1 && v != NULL) {
-                        vars[f->param_symbols.items[0]]->value = *v;
-                }
-
-                for (int i = 1 - !v; i < f->param_symbols.count; ++i) {
-                        vars[f->param_symbols.items[i]]->value = NIL;
-                }
-
-                for (int i = 0; i < f->refs->count; ++i) {
-                        struct reference ref = f->refs->refs[i];
-                        LOG("resolving reference to %p", (void *) ref.pointer);
-                        memcpy(f->code + ref.offset, &ref.pointer, sizeof ref.pointer);
-                }
-                
-                vm_exec(f->code);
+                call(f->function, v != NULL, &halt);
+                vm_exec(f->function->code);
 
                 return pop();
         } else {
@@ -1052,37 +1312,11 @@ struct value
 vm_eval_function2(struct value *f, struct value *v1, struct value *v2)
 {
         if (f->type == VALUE_FUNCTION ){
-                vec_push(callstack, &halt);
+                push(*v1);
+                push(*v2);
 
-                for (int i = 0; i < f->bound_symbols.count; ++i) {
-                        if (vars[f->bound_symbols.items[i]] == NULL) {
-                                vars[f->bound_symbols.items[i]] = newvar(NULL);
-                        }
-                        if (vars[f->bound_symbols.items[i]]->prev == NULL) {
-                                vars[f->bound_symbols.items[i]]->prev = newvar(vars[f->bound_symbols.items[i]]);
-                        }
-                        vars[f->bound_symbols.items[i]] = vars[f->bound_symbols.items[i]]->prev;
-                }
-
-                if (f->param_symbols.count >= 1) {
-                        vars[f->param_symbols.items[0]]->value = *v1;
-                }
-
-                if (f->param_symbols.count >= 2) {
-                        vars[f->param_symbols.items[1]]->value = *v2;
-                }
-
-                for (int i = 2; i < f->param_symbols.count; ++i) {
-                        vars[f->param_symbols.items[i]]->value = NIL;
-                }
-
-                for (int i = 0; i < f->refs->count; ++i) {
-                        struct reference ref = f->refs->refs[i];
-                        LOG("resolving reference to %p", (void *) ref.pointer);
-                        memcpy(f->code + ref.offset, &ref.pointer, sizeof ref.pointer);
-                }
-                
-                vm_exec(f->code);
+                call(f->function, 2, &halt);
+                vm_exec(f->function->code);
 
                 return pop();
         } else {
@@ -1107,16 +1341,43 @@ vm_mark(void)
                 value_mark(&stack.items[i]);
         }
 
+        for (struct value *v = locals; v < lp; ++v) {
+                value_mark(v);
+        }
+
+        /*
+         * The closures that are currently running might not be reachable from anywhere else.
+         */
+        if (closure != NULL) {
+                value_mark(&FUNCTION(closure));
+        }
+        for (int i = 0; i < callstack.count; ++i) {
+                if (callstack.items[i].closure != NULL) {
+                        value_mark(&FUNCTION(callstack.items[i].closure));
+                }
+        }
+
         buffer_mark_values();
 }
 
 void
 vm_mark_variable(struct variable *v)
 {
-        v->mark |= GC_MARK;
+        gc_set_mark(&v->mark);
         value_mark(&v->value);
 }
 
+/*
+ * A minor collection doesn't look inside old functions, so every captured variable is a root.
+ */
+void
+vm_mark_captured(void)
+{
+        for (struct variable *v = captured_chain; v != NULL; v = v->next) {
+                value_mark(&v->value);
+        }
+}
+
 void
 vm_sweep_variables(void)
 {
@@ -1197,17 +1458,33 @@ TEST(func)
         claim(vars[0 + builtin_count]->value.integer == 2);
 }
 
+static double
+now_us(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/*
+ * The two stress tests below are benchmarks for the dispatch loop; build with RELEASE=1 and
+ * with and without -DPLUM_SWITCH_DISPATCH to compare.
+ */
 TEST(stress) // OFF
 {
         char const *source = "let n = 0; for (let i = 0; i < 1000000; i = i + 1) { n = n + 1; }";
 
         vm_init();
 
+        double start = now_us();
         vm_execute(source);
+        double elapsed = now_us() - start;
 
         claim(vars[0 + builtin_count]->value.type == VALUE_INTEGER);
         LOG("value is %d", (int) vars[0 + builtin_count]->value.integer);
         claim(vars[0 + builtin_count]->value.integer == 1000000);
+
+        printf("%.1f ns per iteration ... ", elapsed * 1e3 / 1000000);
 }
 
 TEST(stress2) // OFF
@@ -1216,11 +1493,54 @@ TEST(stress2) // OFF
 
         vm_init();
 
+        double start = now_us();
         vm_execute(source);
+        double elapsed = now_us() - start;
 
         claim(vars[0 + builtin_count]->value.type == VALUE_INTEGER);
         LOG("value is %d", (int) vars[0 + builtin_count]->value.integer);
         claim(vars[0 + builtin_count]->value.integer == 1000000);
+
+        printf("%.1f ns per iteration ... ", elapsed * 1e3 / 1000000);
+}
+
+TEST(calls) // OFF
+{
+        char const *source = "let n = 0;"
+                             "function f(a) { let b = a + 1; return b; }"
+                             "function g() { let k = 0; for (let i = 0; i < 1000000; i = i + 1) { k = k + f(i) - i; } return k; }"
+                             "n = g();";
+
+        vm_init();
+
+        double start = now_us();
+        vm_execute(source);
+        double elapsed = now_us() - start;
+
+        claim(vars[0 + builtin_count]->value.type == VALUE_INTEGER);
+        claim(vars[0 + builtin_count]->value.integer == 1000000);
+
+        printf("%.1f ns per call ... ", elapsed * 1e3 / 1000000);
+}
+
+TEST(members_bench) // OFF
+{
+        char const *source = "let n = 0;"
+                             "function f() { let o = {}; o.a = 1; o.b = 2; o.n = 0;"
+                             "               for (let i = 0; i < 1000000; i = i + 1) { o.n = o.n + o.a + o.b + o.a + o.b + o.a + o.b; }"
+                             "               return o.n; }"
+                             "n = f();";
+
+        vm_init();
+
+        double start = now_us();
+        vm_execute(source);
+        double elapsed = now_us() - start;
+
+        claim(vars[0 + builtin_count]->value.type == VALUE_INTEGER);
+        claim(vars[0 + builtin_count]->value.integer == 9000000);
+
+        printf("%.1f ns per iteration ... ", elapsed * 1e3 / 1000000);
 }
 
 TEST(array)
@@ -1363,6 +1683,347 @@ TEST(method_call)
         claim(strcmp(vars[0 + builtin_count]->value.string, "foobar") == 0);
 }
 
+TEST(frame_locals)
+{
+        char const *source = "let a = 0;"
+                             "function g(x, y) { let [p, q] = [x, y]; let t = 0; for (let i = 0; i < 3; ++i) t += p; return t + q; }"
+                             "function f(n) { let s = 0; for (k in [1, 2, 3]) { s = s + g(k, n); } match [n, s] { [_, *r] => { return r[0]; } } }"
+                             "a = f(10);";
+
+        vm_init();
+
+        vm_execute(source);
+
+        claim(vars[0 + builtin_count]->value.type == VALUE_INTEGER);
+        claim(vars[0 + builtin_count]->value.integer == 48);
+}
+
+TEST(deep_recursion)
+{
+        /*
+         * Far more frames than fit in the locals committed at first, so they have to grow.
+         */
+        char const *source = "let a = 0;"
+                             "function rec(n) { let a = 1; let b = 2; let c = 3; let d = 4; if (n == 0) return 0; return 1 + rec(n - 1); }"
+                             "a = rec(70000);";
+
+        vm_init();
+
+        claim(vm_execute(source));
+
+        claim(vars[0 + builtin_count]->value.type == VALUE_INTEGER);
+        claim(vars[0 + builtin_count]->value.integer == 70000);
+}
+
+TEST(captured_locals)
+{
+        char const *source = "let a = 0;"
+                             "function counter(n) { let k = 0; return function () { k = k + n; return k; }; }"
+                             "let c = counter(5); let d = counter(1);"
+                             "c(); d(); a = c() + d();";
+
+        vm_init();
+
+        vm_execute(source);
+
+        claim(vars[0 + builtin_count]->value.type == VALUE_INTEGER);
+        claim(vars[0 + builtin_count]->value.integer == 12);
+}
+
+TEST(upvalues)
+{
+        char const *source = "let a = 0;"
+                             "function adder(k) { return function (x) { return x + k; }; }"
+                             "let add1 = adder(1); let add10 = adder(10);"
+                             "function twice(f, g) { let x = 5; return function () { let y = f(x); return g(y) + x; }; }"
+                             "a = twice(add1, add10)();";
+
+        vm_init();
+
+        vm_execute(source);
+
+        claim(vars[0 + builtin_count]->value.type == VALUE_INTEGER);
+        claim(vars[0 + builtin_count]->value.integer == 21);
+}
+
+TEST(members)
+{
+        char const *source = "let n = 0;"
+                             "function get(o) { return o.x; }"
+                             "function set(o, v) { o.x = v; }"
+                             "let a = { 'x': 1 }; let b = { 'y': 2, 'x': 3 };"
+                             "for (let i = 0; i < 3; i = i + 1) { let c = {}; set(c, i); let d = { 'z': 1 }; set(d, 10); n = n + get(a) + get(b) + c.x + d.x; }"
+                             "let e = {}; for (let i = 0; i < 40; i = i + 1) { e[str(i)] = i; }"
+                             "e.x = 100; n = n + get(e) + e['39'];"
+                             "a.y = 0; a.x += (a.z = 1000); n = n + a.x;";
+
+        vm_init();
+
+        vm_execute(source);
+
+        claim(vars[0 + builtin_count]->value.type == VALUE_INTEGER);
+        claim(vars[0 + builtin_count]->value.integer == 45 + 139 + 1001);
+}
+
+TEST(folding)
+{
+        char const *source = "let a = 0; let s = '';"
+                             "function f(n) { let t = 0; for (let i = 0; i < n; ++i) { t = t + 2; if (!(i < 2)) t += 1 + 2 * 3; } while (false) { t = 1000; } return t + (true && 10) + (false || 20); }"
+                             "s = \"{1 + 2}\" + \"x{s}y\" + (\"\" if 'a' + 'b' == 'ab' else 'no');"
+                             "a = f(4) + (10 - 2 * 3) % 3 + (1 if 0 < 1 else 2);";
+
+        vm_init();
+
+        claim(vm_execute(source));
+
+        claim(vars[0 + builtin_count]->value.type == VALUE_INTEGER);
+        claim(vars[0 + builtin_count]->value.integer == 54);
+        claim(vars[1 + builtin_count]->value.type == VALUE_STRING);
+        claim(vars[1 + builtin_count]->value.bytes == 3);
+        claim(memcmp(vars[1 + builtin_count]->value.string, "3xy", 3) == 0);
+}
+
+TEST(quickening)
+{
+        char const *source = "let a = 0; let s = '';"
+                             "function f(x, y) { return x + y; }"
+                             "function g(x, y) { return [x - y, x * y, x < y, x >= y]; }"
+                             "for (let i = 0; i < 3; ++i) { a = a + f(i, 10); s = f(s, str(i)); }"
+                             "let r = f(1.5, 2.0); let [d, p, lt, ge] = g(4, 2); let [rd, rp, rlt, rge] = g(0.5, 2.0);"
+                             "if (r == 3.5 && d == 2 && p == 8 && !lt && ge && rd == -1.5 && rp == 1.0 && rlt && !rge) a = a + f(1000, 0);";
+
+        vm_init();
+
+        claim(vm_execute(source));
+
+        claim(vars[0 + builtin_count]->value.type == VALUE_INTEGER);
+        claim(vars[0 + builtin_count]->value.integer == 1033);
+        claim(vars[1 + builtin_count]->value.type == VALUE_STRING);
+        claim(vars[1 + builtin_count]->value.bytes == 3);
+        claim(memcmp(vars[1 + builtin_count]->value.string, "012", 3) == 0);
+}
+
+TEST(module_cache)
+{
+        char const *files[][2] = {
+                { "base", "tag Wrap; export let greeting = 'hello';"
+                          "export function wrap(x) { return Wrap(x); }"
+                          "export function unwrap(v) { return match v { Wrap(x) => x, _ => nil }; }" },
+                { "mod",  "import base\n"
+                          "tag Pair; let total = 0;"
+                          "export function sum(xs) { for (x in xs) total = total + x; let [a, b] = [total, Pair(1)]; match b { Pair(k) => { a = a + k; } } return a; }"
+                          "export function describe(o) { return \"{base::greeting} {o.name.len()} {o.name.match?(/b+/)}\"; }"
+                          "export function unwrap(v) { return base::unwrap(v); }" },
+        };
+
+        char home[] = "/tmp/plum-test-XXXXXX";
+        char path[256];
+        char *old_home = sclone(getenv("HOME"));
+
+        claim(mkdtemp(home) != NULL);
+        setenv("HOME", home, 1);
+        snprintf(path, sizeof path, "%s/.plum", home);
+        claim(mkdir(path, 0700) == 0);
+
+        for (int i = 0; i < sizeof files / sizeof files[0]; ++i) {
+                snprintf(path, sizeof path, "%s/.plum/%s.plum", home, files[i][0]);
+                FILE *f = fopen(path, "w");
+                fputs(files[i][1], f);
+                fclose(f);
+        }
+
+        /*
+         * The first run compiles the modules and writes their caches, and the second one loads them.
+         * Then base is changed, so the last run has to compile it again.
+         */
+        for (int run = 0; run < 3; ++run) {
+                if (run == 2) {
+                        snprintf(path, sizeof path, "%s/.plum/base.plum", home);
+                        FILE *f = fopen(path, "a");
+                        fputs("greeting = 'howdy';", f);
+                        fclose(f);
+                }
+
+                vm_init();
+
+                claim(vm_execute("let a = 0; let s = ''; let u = 0;"));
+                claim(vm_execute("import mod\nimport base\na = mod::sum([1, 2, 3]); s = mod::describe({'name': 'abba'}); u = mod::unwrap(base::wrap(4));"));
+
+                claim(vars[0 + builtin_count]->value.type == VALUE_INTEGER);
+                claim(vars[0 + builtin_count]->value.integer == 7);
+                claim(vars[1 + builtin_count]->value.type == VALUE_STRING);
+                claim(vars[1 + builtin_count]->value.bytes == 12);
+                claim(memcmp(vars[1 + builtin_count]->value.string, (run == 2) ? "howdy 4 true" : "hello 4 true", 12) == 0);
+                claim(vars[2 + builtin_count]->value.type == VALUE_INTEGER);
+                claim(vars[2 + builtin_count]->value.integer == 4);
+        }
+
+        for (int i = 0; i < sizeof files / sizeof files[0]; ++i) {
+                snprintf(path, sizeof path, "%s/.plum/%s.plumc", home, files[i][0]);
+                claim(unlink(path) == 0);
+                path[strlen(path) - 1] = '\0';
+                unlink(path);
+        }
+
+        snprintf(path, sizeof path, "%s/.plum", home);
+        rmdir(path);
+        rmdir(home);
+        setenv("HOME", old_home, 1);
+        free(old_home);
+}
+
+TEST(generations)
+{
+        char const *source = "let ok = false;"
+                             "let big = 'x'; for (let i = 0; i < 10; ++i) big = big + big;"
+                             "function churn(n) { let t = nil; for (let i = 0; i < n; ++i) t = big + str(i); return t; }"
+                             "let o = { 'xs': [], 'last': nil, 's': '' }; let a = [nil, nil, nil];"
+                             "churn(20000);"
+                             "for (let i = 0; i < 50; ++i) {"
+                             "        o.xs.push(str(i)); o.last = str(i) + '!'; o['k' + str(i % 5)] = [str(i)];"
+                             "        a[i % 3] = str(i); o.s += str(i % 10); churn(400);"
+                             "}"
+                             "o.xs.map!(function (x) { return x + '?'; }); churn(20000);"
+                             "ok = o.xs.len() == 50 && o.xs[7] == '7?' && o.xs[49] == '49?' && o.last == '49!'"
+                             "  && o.k0[0] == '45' && o.k4[0] == '49' && a[0] == '48' && a[1] == '49' && a[2] == '47'"
+                             "  && o.s.len() == 50 && o.s.slice(40, 10) == '0123456789';";
+
+        vm_init();
+
+        claim(vm_execute(source));
+
+        claim(vars[0 + builtin_count]->value.type == VALUE_BOOLEAN);
+        claim(vars[0 + builtin_count]->value.boolean);
+}
+
+TEST(incremental)
+{
+        bool started = false;
+        int slices = 0;
+
+        vm_init();
+        gc_set_max_pause(1);
+
+        claim(vm_execute("let ok = false; let n = 0; let j = 0; let k = 0; let t = nil; let xs = []; for (let i = 0; i < 100000; ++i) xs.push([str(i)]);"));
+
+        /*
+         * Between slices, swap elements around so that some of them are only reachable from
+         * containers which have already been traced, and store some new ones.
+         */
+        for (int i = 0; i < 200000 && (!started || gc_pending()); ++i) {
+                if (gc_pending()) {
+                        started = true;
+                        gc_idle();
+                        slices += 1;
+                }
+                claim(vm_execute("j = n % 100000; k = 99999 - j; t = xs[j]; xs[j] = xs[k]; xs[k] = t;"
+                                 "xs[j].push(str(n)); n += 1;"));
+        }
+
+        claim(started);
+        claim(slices > 1);
+
+        gc_collect();
+
+        claim(vm_execute("import gc\n"
+                         "let total = 0; for (x in xs) total += int(x[0]);"
+                         "ok = xs.len() == 100000 && total == 4999950000 && gc::pauses().len() > 0;"));
+        claim(vars[0 + builtin_count]->value.type == VALUE_BOOLEAN);
+        claim(vars[0 + builtin_count]->value.boolean);
+
+        gc_set_max_pause(GC_MAX_PAUSE_US);
+}
+
+TEST(gc_stats)
+{
+        vm_init();
+
+        claim(vm_execute("let ok = false; let xs = []; for (let i = 0; i < 1000000; ++i) xs.push(str(i));"
+                         "for (let i = 0; i < 100000; ++i) xs[i] + '!';"));
+
+        gc_collect();
+
+        claim(vm_execute("import gc\n"
+                         "let s = gc::stats();"
+                         "ok = s.minor > 0 && s.major > 0 && s.live > 1000000 * 16 && s.allocated >= s.live"
+                         "  && s.nursery == s.live / 4 && s.pauseMax <= s.pauseTotal && s.allocationRate > 0.0;"));
+        claim(vars[0 + builtin_count]->value.type == VALUE_BOOLEAN);
+        claim(vars[0 + builtin_count]->value.boolean);
+}
+
+TEST(array_growth)
+{
+        vm_init();
+
+        claim(vm_execute("import gc\n"
+                         "let ok = false; let base = gc::stats().allocated; let xs = [];"
+                         "for (let i = 0; i < 1000000; ++i) xs.push(i);"
+                         "let grown = gc::stats().allocated - base; let before = 0; let s = 0;"));
+
+        gc_collect();
+
+        claim(vm_execute("before = gc::stats().live; while (xs.len() > 10) xs.pop();"));
+
+        gc_collect();
+
+        claim(vm_execute("for (x in xs) s += x;"
+                         "ok = grown < 1048576 * 17 && gc::stats().live < before - 1000000 * 8 && s == 45;"));
+        claim(vars[0 + builtin_count]->value.type == VALUE_BOOLEAN);
+        claim(vars[0 + builtin_count]->value.boolean);
+}
+
+TEST(parallel_mark)
+{
+        vm_init();
+
+        claim(vm_execute("let ok = false; let xs = []; let n = 0;"
+                         "for (let i = 0; i < 200000; ++i) xs.push({'i': i, 'a': [i, str(i)]});"));
+
+        gc_collect();
+        gc_collect();
+
+        claim(vm_execute("ok = true; for (x in xs) { n += x['i']; ok = ok && x['a'][1] == str(x['a'][0]); }"
+                         "ok = ok && n == 199999 * 100000;"));
+        claim(vars[0 + builtin_count]->value.type == VALUE_BOOLEAN);
+        claim(vars[0 + builtin_count]->value.boolean);
+        claim(gc_stats().parallel > 0 || GC_MARK_THREADS == 0 || sysconf(_SC_NPROCESSORS_ONLN) < 2);
+}
+
+TEST(string_append)
+{
+        vm_init();
+
+        claim(vm_execute("import gc\n"
+                         "let ok = false; let base = gc::stats().allocated; let s = '';"
+                         "for (let i = 0; i < 100000; ++i) s = s + 'x';"
+                         "for (let i = 0; i < 100000; ++i) s = \"{s}y\";"
+                         "let grown = gc::stats().allocated - base;"
+                         "let a = 'hello, ' + str(42); let b = a + '!'; let c = a + '?'; let o = {};"
+                         "o[a] = 1; o[b] = 2; o[c] = 3;"
+                         "let t = str(12345); let x0 = gc::stats().allocated; let x1 = gc::stats().allocated;"
+                         "let u = t + '!'; let x2 = gc::stats().allocated;"
+                         "let inplace = x2 - x1 == x1 - x0 && t == '12345' && u == '12345!';"
+                         "ok = inplace && s.len() == 200000 && grown < 2000000 && a == 'hello, 42' && b == 'hello, 42!'"
+                         "  && c == 'hello, 42?' && o[a] == 1 && o[b] == 2 && o[c] == 3 && o['hello, 42?'] == 3"
+                         "  && 'abc'.chars()[1] == 'b';"));
+        claim(vars[0 + builtin_count]->value.type == VALUE_BOOLEAN);
+        claim(vars[0 + builtin_count]->value.boolean);
+}
+
+TEST(deep_mark)
+{
+        vm_init();
+
+        claim(vm_execute("let n = 0; let l = nil; for (let i = 0; i < 1000000; ++i) l = [l, {'i': i}];"));
+
+        gc_collect();
+        gc_collect();
+
+        claim(vm_execute("while (l != nil) { n += 1; l = l[0]; }"));
+        claim(vars[0 + builtin_count]->value.type == VALUE_INTEGER);
+        claim(vars[0 + builtin_count]->value.integer == 1000000);
+}
+
 TEST(print)
 {
         vm_init();
@@ -1377,6 +2038,21 @@ TEST(each)
         claim(vm_execute("for (k in @o) { print(k); print(o[k]); print('---'); }"));
 }
 
+TEST(key_order)
+{
+        char const *expected = "3,b,a,100,107,114,101,108,115,102,109,116,103,110,117,104,111,118,105,112,119,106,113,";
+
+        vm_init();
+
+        claim(vm_execute("let s = ''; let o = {}; o[3] = 1; o.b = 2; o['a'] = 3;"));
+        claim(vm_execute("for (let i = 0; i < 20; i = i + 1) { o[i * 7 % 20 + 100] = i; }"));
+        claim(vm_execute("for (k in @o) { s = s + str(k) + ','; }"));
+
+        claim(vars[0 + builtin_count]->value.type == VALUE_STRING);
+        claim(vars[0 + builtin_count]->value.bytes == strlen(expected));
+        claim(memcmp(vars[0 + builtin_count]->value.string, expected, strlen(expected)) == 0);
+}
+
 TEST(bench)
 {
         vm_init();